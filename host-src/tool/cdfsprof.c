@@ -0,0 +1,205 @@
+/*
+ * This file is part of the dcload Dreamcast ethernet loader
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "cdfsprof.h"
+#include "utils.h"
+
+/* Reads that skip at most this many sectors past the current extent get merged
+   into it. Pulling in a few unneeded sectors is cheaper than a round trip. */
+#define CDFS_PLAN_MAX_GAP 16
+
+typedef struct {
+    unsigned int usec;      /* When the program first got here */
+    unsigned int fad;
+    unsigned int sectors;
+} cdfs_extent_t;
+
+static FILE *trace_file = NULL;
+static struct timeval trace_start;
+
+static cdfs_extent_t *plan = NULL;
+static unsigned int plan_len = 0;
+static unsigned int plan_pos = 0;
+
+int cdfs_trace_start(const char *path)
+{
+    if (!(trace_file = fopen(path, "w"))) {
+        log_error(path);
+        return -1;
+    }
+
+    fprintf(trace_file, "# dcload cdfs trace: usec fad sectors\n");
+    gettimeofday(&trace_start, 0);
+
+    return 0;
+}
+
+/* Reads lines of three numbers, skipping comments. Returns the number of
+   entries read, or -1 if the file can't be opened. */
+static int read_extents(const char *path, cdfs_extent_t **out)
+{
+    FILE *fp;
+    char line[256];
+    cdfs_extent_t *list = NULL;
+    cdfs_extent_t e;
+    unsigned int len = 0, size = 0;
+
+    if (!(fp = fopen(path, "r"))) {
+        log_error(path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%u %u %u", &e.usec, &e.fad, &e.sectors) != 3 || !e.sectors)
+            continue;
+
+        if (len == size) {
+            size = size ? size * 2 : 256;
+            list = realloc(list, size * sizeof(cdfs_extent_t));
+        }
+        list[len++] = e;
+    }
+
+    fclose(fp);
+    *out = list;
+    return len;
+}
+
+int cdfs_plan_load(const char *path)
+{
+    int len = read_extents(path, &plan);
+
+    if (len < 0)
+        return -1;
+
+    plan_len = len;
+    plan_pos = 0;
+    printf("Loaded cdfs prefetch plan with %u extents\n", plan_len);
+
+    return 0;
+}
+
+void cdfs_profile_stop(void)
+{
+    if (trace_file) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+
+    free(plan);
+    plan = NULL;
+    plan_len = 0;
+}
+
+int cdfs_profile_read(unsigned int fad, unsigned int sectors, unsigned int *hint_fad)
+{
+    struct timeval now;
+    unsigned int i, k, end;
+
+    /* No hints while tracing, otherwise reads served out of dcload's staging
+       area would never show up in the trace */
+    if (trace_file) {
+        gettimeofday(&now, 0);
+        fprintf(trace_file, "%u %u %u\n",
+                (unsigned int)((now.tv_sec - trace_start.tv_sec) * 1000000 + (now.tv_usec - trace_start.tv_usec)),
+                fad, sectors);
+        return 0;
+    }
+
+    if (!plan_len)
+        return -1;
+
+    /* The program mostly walks the plan in order, so look from where it was
+       last before going around again */
+    i = plan_pos % plan_len;
+    for (k = 0; k < plan_len; k++) {
+        if ((fad >= plan[i].fad) && (fad < plan[i].fad + plan[i].sectors))
+            break;
+        if (++i == plan_len)
+            i = 0;
+    }
+
+    if (k == plan_len)
+        return -1; /* Went somewhere new this time */
+
+    plan_pos = i;
+    end = fad + sectors;
+
+    if (end < plan[i].fad + plan[i].sectors) {
+        *hint_fad = end;
+        return plan[i].fad + plan[i].sectors - end;
+    }
+
+    if (i + 1 < plan_len) {
+        *hint_fad = plan[i + 1].fad;
+        return plan[i + 1].sectors;
+    }
+
+    return 0;
+}
+
+int cdfs_analyze_trace(const char *trace_path, FILE *out)
+{
+    cdfs_extent_t *trace;
+    cdfs_extent_t cur;
+    unsigned int extents = 0, total = 0;
+    int i, len = read_extents(trace_path, &trace);
+
+    if (len < 0)
+        return -1;
+
+    if (!len) {
+        fprintf(stderr, "No reads in %s\n", trace_path);
+        return -1;
+    }
+
+    fprintf(out, "# dcload cdfs prefetch plan: usec fad sectors\n");
+
+    cur = trace[0];
+    for (i = 1; i <= len; i++) {
+        /* Carry on with the current extent if this read picks up within it or
+           a little past its end */
+        if ((i < len) && (trace[i].fad >= cur.fad) &&
+            (trace[i].fad <= cur.fad + cur.sectors + CDFS_PLAN_MAX_GAP)) {
+            if (trace[i].fad + trace[i].sectors > cur.fad + cur.sectors)
+                cur.sectors = trace[i].fad + trace[i].sectors - cur.fad;
+            continue;
+        }
+
+        fprintf(out, "%u %u %u\n", cur.usec, cur.fad, cur.sectors);
+        extents++;
+        total += cur.sectors;
+
+        if (i < len)
+            cur = trace[i];
+    }
+
+    fprintf(stderr, "%d reads folded into %u extents (%u sectors, %u seeks)\n",
+            len, extents, total, extents - 1);
+
+    free(trace);
+    return 0;
+}
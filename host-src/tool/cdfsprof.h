@@ -0,0 +1,49 @@
+/*
+ * This file is part of the dcload Dreamcast ethernet loader
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef __CDFSPROF_H__
+#define __CDFSPROF_H__
+
+#include <stdio.h>
+
+/* CDFS access profiling
+ *
+ * A trace is one line per sector read the program made: microseconds since
+ * the trace started, FAD and sector count. cdfs_analyze_trace() folds that
+ * into a prefetch plan, the list of disc extents in the order the program
+ * first went to them. With a plan loaded, each read gets answered with a
+ * read-ahead hint for wherever the program went next on the recorded run.
+ */
+
+/* Set by dcload in the FAD of its own read-ahead requests */
+#define CDFS_READ_PREFETCH 0x80000000
+
+int cdfs_trace_start(const char *path);
+int cdfs_plan_load(const char *path);
+void cdfs_profile_stop(void);
+
+/* Called for every read the program makes. Returns how many sectors to read
+   ahead and sets *hint_fad to where they start, or -1 if there's no trace or
+   plan to go by. */
+int cdfs_profile_read(unsigned int fad, unsigned int sectors, unsigned int *hint_fad);
+
+/* Writes the prefetch plan for the trace at trace_path to out */
+int cdfs_analyze_trace(const char *trace_path, FILE *out);
+
+#endif /* __CDFSPROF_H__ */
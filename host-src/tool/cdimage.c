@@ -0,0 +1,1042 @@
+/*
+ * This file is part of the dcload Dreamcast ethernet loader
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "cdimage.h"
+#include "utils.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define CDIMAGE_MAX_TRACKS  99
+#define CDIMAGE_MAX_PATH    4096
+
+/* GDI tracks at or past this LBA are in the GD-ROM high density area */
+#define GD_HIGH_DENSITY_LBA 45000
+
+/* CSO blocks get decompressed by a pool of worker threads into an LRU cache.
+   A read that spans several blocks has all of its missing blocks inflated in
+   parallel, and a few blocks past the end of each read get queued as well so
+   the workers stay ahead of sequential access. */
+#define CDIMAGE_CACHE_BYTES      (16 * 1024 * 1024)
+#define CDIMAGE_CACHE_MIN_BLOCKS 64
+#define CDIMAGE_CACHE_HASH_SIZE  4096
+#define CDIMAGE_WORKERS          4
+#define CDIMAGE_READAHEAD_BLOCKS CDIMAGE_WORKERS
+
+typedef struct {
+    int fd;
+    unsigned long long size;        /* Uncompressed size in bytes */
+    pthread_mutex_t io_lock;        /* Guards fd's file offset */
+
+    /* CSO only */
+    int compressed;
+    unsigned int block_size;
+    unsigned int align;
+    unsigned int num_blocks;
+    unsigned int *index;            /* num_blocks + 1 entries */
+} cdfile_t;
+
+typedef struct {
+    unsigned int number;
+    unsigned int session;
+    unsigned int ctrl;              /* 4 = data, 0 = audio */
+    unsigned int fad;
+    unsigned int sectors;
+    unsigned int sector_size;       /* 2048, 2336 or 2352 */
+    unsigned int data_offset;       /* Where the 2048 bytes of user data sit */
+    unsigned long long file_offset;
+    cdfile_t *file;
+} cdtrack_t;
+
+struct cdimage {
+    unsigned int num_tracks;
+    cdtrack_t tracks[CDIMAGE_MAX_TRACKS];
+    unsigned int num_files;
+    cdfile_t *files[CDIMAGE_MAX_TRACKS];
+};
+
+/*
+ * Decompressed block cache
+ */
+
+enum { BLOCK_EMPTY, BLOCK_PENDING, BLOCK_READY, BLOCK_FAILED };
+
+typedef struct cache_block {
+    cdfile_t *file;
+    unsigned int block;
+    int state;
+    unsigned int capacity;
+    unsigned char *data;
+    struct cache_block *hash_next;
+    struct cache_block *lru_prev;   /* Towards most recently used */
+    struct cache_block *lru_next;   /* Towards least recently used */
+    struct cache_block *job_next;
+} cache_block_t;
+
+static cache_block_t *cache = NULL;
+static unsigned int cache_entries = 0;
+static cache_block_t *cache_hash[CDIMAGE_CACHE_HASH_SIZE];
+static cache_block_t *lru_head = NULL;
+static cache_block_t *lru_tail = NULL;
+static cache_block_t *job_head = NULL;
+static cache_block_t *job_tail = NULL;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_job = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t cache_done = PTHREAD_COND_INITIALIZER;
+static pthread_t workers[CDIMAGE_WORKERS];
+static unsigned int num_workers = 0;
+static int workers_running = 0;
+static unsigned int compressed_files_open = 0;
+
+static inline unsigned int cache_hash_index(cdfile_t *file, unsigned int block)
+{
+    return ((unsigned int)((uintptr_t)file >> 4) ^ (block * 2654435761U)) % CDIMAGE_CACHE_HASH_SIZE;
+}
+
+static void lru_unlink(cache_block_t *b)
+{
+    if (b->lru_prev)
+        b->lru_prev->lru_next = b->lru_next;
+    else
+        lru_head = b->lru_next;
+
+    if (b->lru_next)
+        b->lru_next->lru_prev = b->lru_prev;
+    else
+        lru_tail = b->lru_prev;
+}
+
+static void lru_touch(cache_block_t *b)
+{
+    if (lru_head == b)
+        return;
+
+    lru_unlink(b);
+    b->lru_prev = NULL;
+    b->lru_next = lru_head;
+    lru_head->lru_prev = b;
+    lru_head = b;
+}
+
+static void hash_remove(cache_block_t *b)
+{
+    cache_block_t **link = &cache_hash[cache_hash_index(b->file, b->block)];
+
+    while (*link && (*link != b))
+        link = &(*link)->hash_next;
+
+    if (*link)
+        *link = b->hash_next;
+}
+
+static cache_block_t *cache_find(cdfile_t *file, unsigned int block)
+{
+    cache_block_t *b = cache_hash[cache_hash_index(file, block)];
+
+    while (b && ((b->file != file) || (b->block != block)))
+        b = b->hash_next;
+
+    return b;
+}
+
+/* Queues a block for decompression. Must hold cache_lock. If the block isn't
+   cached yet it takes over the least recently used entry that isn't busy. */
+static cache_block_t *cache_request(cdfile_t *file, unsigned int block)
+{
+    cache_block_t *b = cache_find(file, block);
+
+    if (b && (b->state != BLOCK_FAILED)) {
+        lru_touch(b);
+        return b;
+    }
+
+    if (!b) {
+        for (b = lru_tail; b && (b->state == BLOCK_PENDING); b = b->lru_prev)
+            ;
+        if (!b)
+            return NULL;
+
+        if (b->state != BLOCK_EMPTY)
+            hash_remove(b);
+
+        b->file = file;
+        b->block = block;
+        b->hash_next = cache_hash[cache_hash_index(file, block)];
+        cache_hash[cache_hash_index(file, block)] = b;
+    }
+
+    if (b->capacity < file->block_size) {
+        free(b->data);
+        b->data = malloc(file->block_size);
+        b->capacity = file->block_size;
+    }
+
+    b->state = BLOCK_PENDING;
+    lru_touch(b);
+
+    b->job_next = NULL;
+    if (job_tail)
+        job_tail->job_next = b;
+    else
+        job_head = b;
+    job_tail = b;
+    pthread_cond_signal(&cache_job);
+
+    return b;
+}
+
+/*
+ * Files
+ */
+
+static int cdfile_pread(cdfile_t *file, unsigned long long offset, unsigned char *out, unsigned int len)
+{
+    unsigned int got = 0;
+    ssize_t n;
+
+    pthread_mutex_lock(&file->io_lock);
+
+    if (lseek(file->fd, offset, SEEK_SET) == (off_t)-1) {
+        pthread_mutex_unlock(&file->io_lock);
+        return -1;
+    }
+
+    while (got < len) {
+        n = read(file->fd, out + got, len - got);
+        if (n > 0)
+            got += n;
+        else if ((n < 0) && (errno == EINTR))
+            continue;
+        else
+            break;
+    }
+
+    pthread_mutex_unlock(&file->io_lock);
+
+    /* Anything past the end of the file reads as zeroes */
+    if (got < len)
+        memset(out + got, 0, len - got);
+
+    return 0;
+}
+
+static int cso_inflate_block(cdfile_t *file, unsigned int block, unsigned char *out)
+{
+    unsigned long long pos = (unsigned long long)(file->index[block] & 0x7fffffff) << file->align;
+    unsigned long long end = (unsigned long long)(file->index[block + 1] & 0x7fffffff) << file->align;
+    unsigned int len = end - pos;
+    unsigned char *in;
+    z_stream zs;
+    int retval;
+
+    /* Stored blocks are flagged in the index, and anything that didn't come
+       out any smaller can't have been compressed either */
+    if ((file->index[block] & 0x80000000) || (len >= file->block_size))
+        return cdfile_pread(file, pos, out, file->block_size);
+
+    in = malloc(len);
+    if (cdfile_pread(file, pos, in, len)) {
+        free(in);
+        return -1;
+    }
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -15) != Z_OK) {
+        free(in);
+        return -1;
+    }
+
+    zs.next_in = in;
+    zs.avail_in = len;
+    zs.next_out = out;
+    zs.avail_out = file->block_size;
+
+    retval = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    free(in);
+
+    if ((retval != Z_STREAM_END) && !((retval == Z_BUF_ERROR || retval == Z_OK) && !zs.avail_out))
+        return -1;
+
+    /* The last block of an image can be short */
+    if (zs.avail_out)
+        memset(zs.next_out, 0, zs.avail_out);
+
+    return 0;
+}
+
+static void *cache_worker(void *arg)
+{
+    cache_block_t *b;
+    cdfile_t *file;
+    unsigned int block;
+    unsigned char *data;
+    int failed;
+
+    (void)arg;
+
+    pthread_mutex_lock(&cache_lock);
+    while (1) {
+        while (!job_head && workers_running)
+            pthread_cond_wait(&cache_job, &cache_lock);
+
+        if (!job_head)
+            break;
+
+        b = job_head;
+        job_head = b->job_next;
+        if (!job_head)
+            job_tail = NULL;
+
+        /* Nobody else touches a pending block, so this is safe unlocked */
+        file = b->file;
+        block = b->block;
+        data = b->data;
+        pthread_mutex_unlock(&cache_lock);
+
+        failed = cso_inflate_block(file, block, data);
+
+        pthread_mutex_lock(&cache_lock);
+        b->state = failed ? BLOCK_FAILED : BLOCK_READY;
+        pthread_cond_broadcast(&cache_done);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return NULL;
+}
+
+static int cache_start(unsigned int block_size)
+{
+    unsigned int i;
+
+    if (cache)
+        return 0;
+
+    cache_entries = CDIMAGE_CACHE_BYTES / block_size;
+    if (cache_entries < CDIMAGE_CACHE_MIN_BLOCKS)
+        cache_entries = CDIMAGE_CACHE_MIN_BLOCKS;
+
+    cache = calloc(cache_entries, sizeof(cache_block_t));
+    if (!cache)
+        return -1;
+
+    memset(cache_hash, 0, sizeof(cache_hash));
+    for (i = 0; i < cache_entries; i++) {
+        cache[i].lru_prev = i ? &cache[i - 1] : NULL;
+        cache[i].lru_next = (i + 1 < cache_entries) ? &cache[i + 1] : NULL;
+    }
+    lru_head = &cache[0];
+    lru_tail = &cache[cache_entries - 1];
+
+    workers_running = 1;
+    for (num_workers = 0; num_workers < CDIMAGE_WORKERS; num_workers++) {
+        if (pthread_create(&workers[num_workers], NULL, cache_worker, NULL)) {
+            log_error("cdimage worker thread");
+            break;
+        }
+    }
+
+    /* Can't decompress anything without at least one */
+    if (!num_workers) {
+        free(cache);
+        cache = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void cache_stop(void)
+{
+    unsigned int i;
+
+    if (!cache)
+        return;
+
+    pthread_mutex_lock(&cache_lock);
+    workers_running = 0;
+    pthread_cond_broadcast(&cache_job);
+    pthread_mutex_unlock(&cache_lock);
+
+    for (i = 0; i < num_workers; i++)
+        pthread_join(workers[i], NULL);
+    num_workers = 0;
+
+    for (i = 0; i < cache_entries; i++)
+        free(cache[i].data);
+    free(cache);
+    cache = NULL;
+    cache_entries = 0;
+}
+
+static int cso_read(cdfile_t *file, unsigned long long offset, unsigned char *out, unsigned int len)
+{
+    cache_block_t **batch;
+    unsigned int batch_max = cache_entries / 2;
+    unsigned int first, last, count, i, skip, n;
+    int retval = 0;
+
+    if (offset + len > file->size) {
+        if (offset >= file->size) {
+            memset(out, 0, len);
+            return 0;
+        }
+        memset(out + (file->size - offset), 0, offset + len - file->size);
+        len = file->size - offset;
+    }
+
+    batch = malloc(batch_max * sizeof(cache_block_t *));
+
+    while (len && !retval) {
+        first = offset / file->block_size;
+        last = (offset + len - 1) / file->block_size;
+        count = last - first + 1;
+        if (count > batch_max)
+            count = batch_max;
+
+        /* Queue everything this read needs, plus a few blocks past it */
+        pthread_mutex_lock(&cache_lock);
+        for (i = 0; i < count; i++)
+            batch[i] = cache_request(file, first + i);
+        for (i = first + count; (i < first + count + CDIMAGE_READAHEAD_BLOCKS) && (i < file->num_blocks); i++)
+            if (!cache_find(file, i))
+                cache_request(file, i);
+
+        for (i = 0; i < count; i++) {
+            while (batch[i] && (batch[i]->state == BLOCK_PENDING))
+                pthread_cond_wait(&cache_done, &cache_lock);
+            if (!batch[i] || (batch[i]->state != BLOCK_READY))
+                retval = -1;
+        }
+        pthread_mutex_unlock(&cache_lock);
+
+        if (retval)
+            break;
+
+        /* Ready blocks only ever get recycled from this thread, so copying out
+           of them doesn't need the lock */
+        for (i = 0; (i < count) && len; i++) {
+            skip = offset % file->block_size;
+            n = file->block_size - skip;
+            if (n > len)
+                n = len;
+
+            memcpy(out, batch[i]->data + skip, n);
+            out += n;
+            offset += n;
+            len -= n;
+        }
+    }
+
+    free(batch);
+    return retval;
+}
+
+static int cdfile_read(cdfile_t *file, unsigned long long offset, unsigned char *out, unsigned int len)
+{
+    if (file->compressed)
+        return cso_read(file, offset, out, len);
+
+    return cdfile_pread(file, offset, out, len);
+}
+
+static unsigned int read_le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static cdfile_t *cdfile_open(const char *path)
+{
+    cdfile_t *file;
+    unsigned char header[24];
+    unsigned long long total;
+    unsigned int i;
+
+    file = calloc(1, sizeof(cdfile_t));
+    file->fd = open(path, O_RDONLY | O_BINARY);
+    if (file->fd < 0) {
+        log_error(path);
+        free(file);
+        return NULL;
+    }
+    pthread_mutex_init(&file->io_lock, NULL);
+
+    file->size = lseek(file->fd, 0, SEEK_END);
+
+    /* CSO: "CISO", header size, uncompressed size, block size, version,
+       index alignment shift, then one index entry per block plus one */
+    if ((cdfile_pread(file, 0, header, sizeof(header)) == 0) && !memcmp(header, "CISO", 4)) {
+        total = read_le32(header + 8) | ((unsigned long long)read_le32(header + 12) << 32);
+        file->block_size = read_le32(header + 16);
+        file->align = header[21];
+
+        /* v2 uses the top index bit for LZ4 blocks instead */
+        if (header[20] > 1) {
+            fprintf(stderr, "%s: CSO version %u isn't supported (only v1, deflate)\n", path, header[20]);
+            goto fail;
+        }
+
+        if (!file->block_size || (file->block_size > 16 * 1024 * 1024)) {
+            fprintf(stderr, "%s: bad CSO block size %u\n", path, file->block_size);
+            goto fail;
+        }
+
+        file->num_blocks = (total + file->block_size - 1) / file->block_size;
+        file->index = malloc((file->num_blocks + 1) * sizeof(unsigned int));
+        if (cdfile_pread(file, sizeof(header), (unsigned char *)file->index, (file->num_blocks + 1) * 4))
+            goto fail;
+        for (i = 0; i <= file->num_blocks; i++)
+            file->index[i] = read_le32((unsigned char *)&file->index[i]);
+
+        pthread_mutex_lock(&cache_lock);
+        if (cache_start(file->block_size)) {
+            pthread_mutex_unlock(&cache_lock);
+            fprintf(stderr, "%s: unable to start CSO decompression\n", path);
+            goto fail;
+        }
+        compressed_files_open++;
+        pthread_mutex_unlock(&cache_lock);
+
+        file->compressed = 1;
+        file->size = total;
+    }
+
+    return file;
+
+fail:
+    close(file->fd);
+    pthread_mutex_destroy(&file->io_lock);
+    free(file->index);
+    free(file);
+    return NULL;
+}
+
+static void cdfile_close(cdfile_t *file)
+{
+    unsigned int i;
+
+    if (file->compressed) {
+        pthread_mutex_lock(&cache_lock);
+
+        /* Forget anything cached from this file */
+        for (i = 0; i < cache_entries; i++) {
+            while (cache[i].state == BLOCK_PENDING)
+                pthread_cond_wait(&cache_done, &cache_lock);
+            if ((cache[i].file == file) && (cache[i].state != BLOCK_EMPTY)) {
+                hash_remove(&cache[i]);
+                cache[i].state = BLOCK_EMPTY;
+                cache[i].file = NULL;
+            }
+        }
+
+        compressed_files_open--;
+        pthread_mutex_unlock(&cache_lock);
+
+        if (!compressed_files_open)
+            cache_stop();
+    }
+
+    close(file->fd);
+    pthread_mutex_destroy(&file->io_lock);
+    free(file->index);
+    free(file);
+}
+
+/*
+ * Image layouts
+ */
+
+/* Mode 1 user data follows a 16-byte header, mode 2 form 1 has another 8 bytes
+   of subheader on top of that */
+static unsigned int raw_data_offset(cdfile_t *file, unsigned long long offset)
+{
+    unsigned char header[16];
+
+    if (cdfile_read(file, offset, header, sizeof(header)))
+        return 16;
+
+    return (header[15] == 2) ? 24 : 16;
+}
+
+static int is_raw_sector(cdfile_t *file)
+{
+    static const unsigned char sync[12] = { 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 };
+    unsigned char header[12];
+
+    if (cdfile_read(file, 0, header, sizeof(header)))
+        return 0;
+
+    return !memcmp(header, sync, sizeof(sync));
+}
+
+static cdfile_t *image_add_file(cdimage_t *img, const char *dir, const char *name)
+{
+    char path[CDIMAGE_MAX_PATH];
+    cdfile_t *file;
+
+    if (img->num_files >= CDIMAGE_MAX_TRACKS)
+        return NULL;
+
+    /* Track files are relative to the GDI/CUE sheet */
+    if ((name[0] == '/') || (name[0] == '\\') || (name[0] && name[1] == ':'))
+        snprintf(path, sizeof(path), "%s", name);
+    else
+        snprintf(path, sizeof(path), "%s%s", dir, name);
+
+    file = cdfile_open(path);
+    if (file)
+        img->files[img->num_files++] = file;
+
+    return file;
+}
+
+/* Pulls a possibly quoted filename out of a GDI/CUE line */
+static const char *parse_filename(const char *p, char *out, unsigned int outlen)
+{
+    unsigned int n = 0;
+    char end = ' ';
+
+    while (isspace((unsigned char)*p))
+        p++;
+
+    if (*p == '"') {
+        end = '"';
+        p++;
+    }
+
+    while (*p && (*p != end) && (*p != '\r') && (*p != '\n') && !((end == ' ') && isspace((unsigned char)*p))) {
+        if (n + 1 < outlen)
+            out[n++] = *p;
+        p++;
+    }
+    out[n] = '\0';
+
+    if (*p == '"')
+        p++;
+
+    return p;
+}
+
+static int parse_gdi(cdimage_t *img, FILE *f, const char *dir)
+{
+    char line[CDIMAGE_MAX_PATH + 64];
+    char name[CDIMAGE_MAX_PATH];
+    unsigned int number, lba, type, sector_size;
+    int pos;
+    cdtrack_t *track;
+
+    if (!fgets(line, sizeof(line), f))
+        return -1;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%u %u %u %u %n", &number, &lba, &type, &sector_size, &pos) < 4)
+            continue;
+
+        if ((img->num_tracks >= CDIMAGE_MAX_TRACKS) || !number || (number > 99))
+            return -1;
+
+        if ((sector_size != 2048) && (sector_size != 2336) && (sector_size != 2352)) {
+            fprintf(stderr, "GDI track %u: unsupported sector size %u\n", number, sector_size);
+            return -1;
+        }
+
+        parse_filename(line + pos, name, sizeof(name));
+
+        track = &img->tracks[img->num_tracks];
+        track->file = image_add_file(img, dir, name);
+        if (!track->file)
+            return -1;
+
+        track->number = number;
+        track->fad = lba + 150;
+        track->ctrl = type ? 4 : 0;
+        track->session = (lba >= GD_HIGH_DENSITY_LBA) ? 1 : 0;
+        track->sector_size = sector_size;
+        track->file_offset = 0;
+        track->sectors = track->file->size / sector_size;
+
+        if (!track->ctrl || (sector_size == 2048))
+            track->data_offset = 0;
+        else if (sector_size == 2336)
+            track->data_offset = 8;
+        else
+            track->data_offset = raw_data_offset(track->file, 0);
+
+        img->num_tracks++;
+    }
+
+    return img->num_tracks ? 0 : -1;
+}
+
+static unsigned int cue_msf(const char *p)
+{
+    unsigned int m = 0, s = 0, f = 0;
+
+    sscanf(p, "%u:%u:%u", &m, &s, &f);
+
+    return (m * 60 + s) * 75 + f;
+}
+
+/* Tracks sharing a file run until the next one starts, the last runs to the
+   end of the file. Returns the FAD just past the file. */
+static unsigned int cue_finish_file(cdimage_t *img, unsigned int first_track, unsigned int file_fad)
+{
+    unsigned int i;
+    cdtrack_t *track;
+    unsigned long long end;
+
+    for (i = first_track; i < img->num_tracks; i++) {
+        track = &img->tracks[i];
+
+        if (i + 1 < img->num_tracks)
+            end = img->tracks[i + 1].file_offset;
+        else
+            end = track->file->size;
+
+        track->sectors = (end > track->file_offset) ? (end - track->file_offset) / track->sector_size : 0;
+    }
+
+    if (first_track >= img->num_tracks)
+        return file_fad;
+
+    track = &img->tracks[img->num_tracks - 1];
+    return track->fad + track->sectors;
+}
+
+static int parse_cue(cdimage_t *img, FILE *f, const char *dir)
+{
+    char line[CDIMAGE_MAX_PATH + 64];
+    char name[CDIMAGE_MAX_PATH];
+    char keyword[16], mode[16];
+    cdfile_t *file = NULL;
+    cdtrack_t *track = NULL;
+    unsigned int file_first_track = 0;
+    unsigned int file_fad = 150;
+    unsigned int pregap = 0;
+    unsigned int session = 0;
+    unsigned int number, index;
+    int pos;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, " %15s %n", keyword, &pos) < 1)
+            continue;
+
+        if (!strcmp(keyword, "FILE")) {
+            file_fad = cue_finish_file(img, file_first_track, file_fad);
+            file_first_track = img->num_tracks;
+
+            /* file_fad already takes in the pregaps so far, the next file
+               only needs to add its own */
+            pregap = 0;
+
+            parse_filename(line + pos, name, sizeof(name));
+            file = image_add_file(img, dir, name);
+            if (!file)
+                return -1;
+            track = NULL;
+        } else if (!strcmp(keyword, "TRACK")) {
+            if (!file || (img->num_tracks >= CDIMAGE_MAX_TRACKS))
+                return -1;
+            if (sscanf(line + pos, "%u %15s", &number, mode) < 2)
+                return -1;
+
+            track = &img->tracks[img->num_tracks++];
+            track->number = number;
+            track->session = session;
+            track->file = file;
+            track->file_offset = 0;
+            track->fad = file_fad + pregap;
+
+            if (!strcmp(mode, "AUDIO")) {
+                track->ctrl = 0;
+                track->sector_size = 2352;
+                track->data_offset = 0;
+            } else if (!strcmp(mode, "MODE1/2048")) {
+                track->ctrl = 4;
+                track->sector_size = 2048;
+                track->data_offset = 0;
+            } else if (!strcmp(mode, "MODE1/2352")) {
+                track->ctrl = 4;
+                track->sector_size = 2352;
+                track->data_offset = 16;
+            } else if (!strcmp(mode, "MODE2/2352")) {
+                track->ctrl = 4;
+                track->sector_size = 2352;
+                track->data_offset = 24;
+            } else if (!strcmp(mode, "MODE2/2336")) {
+                track->ctrl = 4;
+                track->sector_size = 2336;
+                track->data_offset = 8;
+            } else {
+                fprintf(stderr, "CUE track %u: unsupported mode %s\n", number, mode);
+                return -1;
+            }
+        } else if (!strcmp(keyword, "INDEX")) {
+            if (!track || (sscanf(line + pos, "%u %n", &index, &pos) < 1))
+                continue;
+
+            /* Index 1 is where the track's data actually starts */
+            if (index == 1) {
+                char *msf = strchr(line, ':');
+                while (msf && (msf > line) && isdigit((unsigned char)msf[-1]))
+                    msf--;
+                if (!msf)
+                    return -1;
+
+                track->file_offset = (unsigned long long)cue_msf(msf) * track->sector_size;
+                track->fad = file_fad + pregap + cue_msf(msf);
+            }
+        } else if (!strcmp(keyword, "PREGAP")) {
+            /* Pregaps that aren't stored in the file still take up FADs */
+            pregap += cue_msf(line + pos);
+            if (track)
+                track->fad = file_fad + pregap;
+        } else if (!strcmp(keyword, "REM")) {
+            /* GD-ROM sheets (Redump's) mark where the high density area
+               starts. It's session 1, and its first track is at LBA 45000 no
+               matter where the low density area left off. */
+            if (!strncmp(line + pos, "HIGH-DENSITY AREA", 17)) {
+                cue_finish_file(img, file_first_track, file_fad);
+                file_first_track = img->num_tracks;
+                file_fad = GD_HIGH_DENSITY_LBA + 150;
+                pregap = 0;
+                session = 1;
+                file = NULL;
+                track = NULL;
+            }
+        }
+    }
+
+    cue_finish_file(img, file_first_track, file_fad);
+
+    return img->num_tracks ? 0 : -1;
+}
+
+static int parse_flat(cdimage_t *img, const char *path)
+{
+    cdtrack_t *track = &img->tracks[0];
+
+    track->file = image_add_file(img, "", path);
+    if (!track->file)
+        return -1;
+
+    track->number = 1;
+    track->session = 0;
+    track->ctrl = 4;
+    track->fad = 150;
+    track->file_offset = 0;
+
+    /* A raw 2352-byte image starts with a sector sync pattern */
+    if (is_raw_sector(track->file)) {
+        track->sector_size = 2352;
+        track->data_offset = raw_data_offset(track->file, 0);
+    } else {
+        track->sector_size = 2048;
+        track->data_offset = 0;
+    }
+
+    track->sectors = track->file->size / track->sector_size;
+    img->num_tracks = 1;
+
+    return 0;
+}
+
+static int has_extension(const char *path, const char *ext)
+{
+    size_t plen = strlen(path);
+    size_t elen = strlen(ext);
+    size_t i;
+
+    if (plen <= elen)
+        return 0;
+
+    for (i = 0; i < elen; i++)
+        if (tolower((unsigned char)path[plen - elen + i]) != ext[i])
+            return 0;
+
+    return 1;
+}
+
+cdimage_t *cdimage_open(const char *path)
+{
+    cdimage_t *img;
+    char dir[CDIMAGE_MAX_PATH];
+    char *slash;
+    FILE *sheet;
+    int retval;
+
+    img = calloc(1, sizeof(cdimage_t));
+    if (!img)
+        return NULL;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    slash = strrchr(dir, '/');
+    if (!slash)
+        slash = strrchr(dir, '\\');
+    if (slash)
+        slash[1] = '\0';
+    else
+        dir[0] = '\0';
+
+    if (has_extension(path, ".gdi") || has_extension(path, ".cue")) {
+        sheet = fopen(path, "r");
+        if (!sheet) {
+            log_error(path);
+            free(img);
+            return NULL;
+        }
+
+        if (has_extension(path, ".gdi"))
+            retval = parse_gdi(img, sheet, dir);
+        else
+            retval = parse_cue(img, sheet, dir);
+
+        fclose(sheet);
+    } else {
+        retval = parse_flat(img, path);
+    }
+
+    if (retval) {
+        fprintf(stderr, "%s: unable to load disc image\n", path);
+        cdimage_close(img);
+        return NULL;
+    }
+
+    return img;
+}
+
+void cdimage_close(cdimage_t *img)
+{
+    unsigned int i;
+
+    if (!img)
+        return;
+
+    for (i = 0; i < img->num_files; i++)
+        cdfile_close(img->files[i]);
+
+    free(img);
+}
+
+static cdtrack_t *find_track(cdimage_t *img, unsigned int fad)
+{
+    unsigned int i;
+
+    for (i = 0; i < img->num_tracks; i++)
+        if ((fad >= img->tracks[i].fad) && (fad < img->tracks[i].fad + img->tracks[i].sectors))
+            return &img->tracks[i];
+
+    return NULL;
+}
+
+int cdimage_read_sectors(cdimage_t *img, unsigned int fad, unsigned int count, unsigned char *out)
+{
+    cdtrack_t *track;
+    unsigned int run, i;
+    unsigned long long offset;
+    unsigned char *raw;
+
+    while (count) {
+        track = find_track(img, fad);
+
+        /* Gaps between tracks and anything past the end */
+        if (!track) {
+            memset(out, 0, 2048);
+            out += 2048;
+            fad++;
+            count--;
+            continue;
+        }
+
+        run = track->fad + track->sectors - fad;
+        if (run > count)
+            run = count;
+
+        offset = track->file_offset + (unsigned long long)(fad - track->fad) * track->sector_size;
+
+        if (track->sector_size == 2048) {
+            if (cdfile_read(track->file, offset, out, run * 2048))
+                return -1;
+        } else {
+            raw = malloc(run * track->sector_size);
+            if (cdfile_read(track->file, offset, raw, run * track->sector_size)) {
+                free(raw);
+                return -1;
+            }
+            for (i = 0; i < run; i++)
+                memcpy(out + i * 2048, raw + i * track->sector_size + track->data_offset, 2048);
+            free(raw);
+        }
+
+        out += run * 2048;
+        fad += run;
+        count -= run;
+    }
+
+    return 0;
+}
+
+int cdimage_read_toc(cdimage_t *img, unsigned int session, unsigned int *toc)
+{
+    cdtrack_t *first = NULL;
+    cdtrack_t *last = NULL;
+    cdtrack_t *track;
+    unsigned int i;
+
+    for (i = 0; i < 99; i++)
+        toc[i] = 0xffffffff;
+
+    for (i = 0; i < img->num_tracks; i++) {
+        track = &img->tracks[i];
+        if (track->session != session)
+            continue;
+
+        /* CTRL in the top nibble, ADR (always 1) in the next, then the FAD */
+        toc[track->number - 1] = (track->ctrl << 28) | (1 << 24) | track->fad;
+
+        if (!first || (track->number < first->number))
+            first = track;
+        if (!last || (track->number > last->number))
+            last = track;
+    }
+
+    if (!first)
+        return -1;
+
+    toc[99] = (first->ctrl << 28) | (1 << 24) | (first->number << 16);
+    toc[100] = (last->ctrl << 28) | (1 << 24) | (last->number << 16);
+    toc[101] = (last->ctrl << 28) | (1 << 24) | (last->fad + last->sectors); /* Leadout */
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * This file is part of the dcload Dreamcast ethernet loader
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef __CDIMAGE_H__
+#define __CDIMAGE_H__
+
+/* Disc images for cdfs redirection
+ *
+ * Handles flat ISOs (2048 or raw 2352-byte sectors), multi-track GDI and CUE
+ * layouts, and CSO block-compressed track files in any of those. Everything is
+ * addressed by FAD (frame address, LBA + 150) like the GD-ROM syscalls do.
+ */
+
+typedef struct cdimage cdimage_t;
+
+/* Number of words in a GD-ROM TOC: 99 track entries, first, last, leadout */
+#define CDIMAGE_TOC_WORDS 102
+
+cdimage_t *cdimage_open(const char *path);
+void cdimage_close(cdimage_t *img);
+
+/* Reads count 2048-byte sectors of user data starting at fad into out.
+   Sectors not covered by any track read back as zeroes. */
+int cdimage_read_sectors(cdimage_t *img, unsigned int fad, unsigned int count, unsigned char *out);
+
+/* Fills toc (host byte order) for session 0 (low density/CD area) or 1 (GD-ROM
+   high density area). Returns -1 if the image has no tracks in that session. */
+int cdimage_read_toc(cdimage_t *img, unsigned int session, unsigned int *toc);
+
+#endif /* __CDIMAGE_H__ */
@@ -23,8 +23,52 @@ typedef struct _command_t command_t;
 #define CMD_REBOOT   "RBOT"  /* reboot */
 
 #define CMD_MAPLE		 "MAPL" /* Maple packet */
+#define CMD_MAPLEBATCH "MAPB" /* Several maple packets in one DMA list */
+#define CMD_MAPLESUB   "MAPS" /* Subscribe to maple responses */
 #define CMD_PMCR		 "PMCR" /* Performance counter packet */
+#define CMD_NETSTATS "NSTA" /* network statistics */
+#define CMD_TRACE    "TRAC" /* packet trace records */
 
 #define COMMAND_LEN  12
 
+/* Optional data word on LOADBIN, SENDBIN/SENDBINQ and their replies. Bulk
+   transfers can go out without UDP checksums, and get checked end to end with a
+   CRC-32 sent along with DONEBIN instead. */
+#define BULK_NOCSUM      0x00000001
+#define BULK_CRC_FAILED  0x00000002
+
+/* LOADBIN can also ask for PARTBINs of up to PARTBIN_FRAG_MAX bytes, which go
+   out as one datagram and get split into IP fragments on the way. dcload only
+   puts them back together when they arrive in order, so this is for a direct
+   cable or a quiet switch. The fragments arrive back to back, so the size is
+   kept to 10 full frames, which is what fits in the BBA's 16kB receive ring. */
+#define BULK_FRAGMENTS   0x00000004
+#define PARTBIN_FRAG_MAX (10 * 1440)
+
+/* With -k the same commands go over a TCP connection instead, each one as a
+   record: a 2-byte big endian length, 2 zero bytes, the command, then zeroes up
+   to a multiple of 4. dcload only has room for one full PARTBIN per segment, so
+   nothing bigger than that goes this way. */
+#define TCP_RECORD_H_LEN 4
+
+/* CMD_NETSTATS reply: big endian words, first the NETSTATS_COUNTERS counters
+   below, then a call count for each command dcload keeps track of, then the
+   PMCR cycles spent in each as high/low word pairs. The reply's address field
+   says how many commands there are. Sending address 1 resets them. */
+#define NETSTATS_COUNTERS 10
+#define NETSTATS_COUNTER_NAMES \
+    "rx frames", "tx frames", "rx errors", "rx oversize", "rx overflows", \
+    "ip checksum bad", "ip fragments dropped", "udp checksum bad", "tx stalls", "unknown commands"
+#define NETSTATS_CMD_IDS \
+    CMD_PARTBIN, CMD_MAPLE, CMD_PMCR, CMD_DONEBIN, CMD_RETVAL, CMD_LOADBIN, \
+    CMD_SENDBINQ, CMD_SENDBIN, CMD_EXECUTE, CMD_VERSION, CMD_NETSTATS, CMD_TRACE, \
+    CMD_MAPLEBATCH, CMD_MAPLESUB
+
+/* CMD_TRACE: ask with the number of the first record wanted, or size 1 to
+   empty dcload's ring and start it recording again. The reply's data is
+   dcload's cycle counter at the time, how many records it has written, and up
+   to TRACE_RECORDS_PER_REPLY records as event/timestamp word pairs, all big
+   endian. Its address is the number of its first record. */
+#define TRACE_RECORDS_PER_REPLY 128
+
 #endif
@@ -49,10 +49,17 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #endif
+#include <signal.h>
+#include <zlib.h>
 
 #include "syscalls.h"
+#include "cdfsprof.h"
+#include "systrace.h"
+#include "mapleinput.h"
+#include "pkttrace.h"
 #include "dc-io.h"
 #include "commands.h"
 
@@ -223,6 +230,13 @@ void cleanup(char **fnames)
 {
     int counter = 0;
 
+    // Make sure any deferred writes hit the disk before we go
+    dc_write_behind_stop();
+    cdfs_profile_stop();
+    systrace_stop();
+    mapleinput_stop();
+    pkttrace_finish();
+
     for(; counter < 4; counter++)
     {
       if(fnames[counter] != 0)
@@ -291,6 +305,27 @@ unsigned int time_in_usec()
 
 /* 250000 = 0.25 seconds */
 #define PACKET_TIMEOUT 250000
+
+/* A DONEBIN with a CRC in it (see -z) can take dcload a while if it has to go
+   over much of the binary, like when packets came in out of order. Rather than
+   taking that as lost and starting over, wait this long for it. */
+#define CRC_TIMEOUT (PACKET_TIMEOUT * 16)
+
+/* Over TCP nothing is resent, so a read just waits for the next record. If
+   none turns up for this long, dcload isn't coming back and we give up. */
+#define TCP_STALL_TIMEOUT (PACKET_TIMEOUT * 40)
+
+/* Time spent in and bytes moved by send_data(), recv_data() and
+   send_command(), for the console syscall profile */
+static unsigned long long net_usec = 0;
+static unsigned long long net_bytes = 0;
+
+/* Last value sent back in CMD_RETVAL, for syscall traces */
+static unsigned int last_retval = 0;
+
+/* When replaying a syscall trace nothing goes out on the network: sends are
+   dropped and receives read back as zeroes */
+static unsigned int replay_transport = 0;
 struct timeval starttime = {0}, endtime = {0};
 
 // Adapter type detection
@@ -302,6 +337,9 @@ unsigned int installed_adapter = 0;
 unsigned int legacy = 0; // To know if this should use old 1024-byte sizes for packets or new 1440-sizes
 unsigned int force_legacy = 0; // To force dcload and dc-tool into legacy mode with -l flag
 unsigned int fast_mode = 0; // to force dc-tool to not use any delays for higher speed
+unsigned int bulk_nocsum = 0; // -z: bulk transfers without UDP checksums, CRC-checked at DONEBIN instead
+unsigned int bulk_frags = 0; // -F: uploads in PARTBIN_FRAG_MAX-sized datagrams, IP fragmented
+unsigned int tcp_transport = 0; // -k: everything over a TCP connection instead of UDP
 
 // How long to wait for DC to empty its RX FIFO, in microseconds
 #define BBA_RX_FIFO_DELAY_TIME DREAMCAST_BBA_RX_FIFO_DELAY_TIME
@@ -386,7 +424,7 @@ int prepare_comms(unsigned char *buffer)
       {
         // Alternate checking each socket
         flip ^= 0x1;
-        if(flip)
+        if(flip && !tcp_transport)
         {
           global_socket = dcsocket_legacy;
         }
@@ -400,7 +438,11 @@ int prepare_comms(unsigned char *buffer)
     }
 
     // Close the socket we don't need, then set parameters
-    if(global_socket == dcsocket)
+    if(tcp_transport)
+    {
+      // There's only the one
+    }
+    else if(global_socket == dcsocket)
     {
 #ifdef __MINGW32__
       closesocket(dcsocket_legacy);
@@ -430,7 +472,7 @@ int prepare_comms(unsigned char *buffer)
         legacy = 1;
       }
 
-      if(!fast_mode)
+      if(!fast_mode && !tcp_transport) // TCP paces itself
       {
         rx_fifo_delay = BBA_RX_FIFO_DELAY_TIME; // microseconds
         rx_fifo_delay_count = BBA_RX_FIFO_DELAY_COUNT; // packets per burst
@@ -449,7 +491,7 @@ int prepare_comms(unsigned char *buffer)
         legacy = 1;
       }
 
-      if(!fast_mode)
+      if(!fast_mode && !tcp_transport) // TCP paces itself
       {
         rx_fifo_delay = LAN_RX_FIFO_DELAY_TIME; // microseconds
         rx_fifo_delay_count = LAN_RX_FIFO_DELAY_COUNT; // packets per burst
@@ -470,8 +512,182 @@ int prepare_comms(unsigned char *buffer)
   }
 }
 
+/* Turns UDP checksums on outgoing packets on or off. Only Linux lets us do this,
+   elsewhere PARTBINs just keep theirs. */
+static void set_udp_checksums(int on)
+{
+#ifdef SO_NO_CHECK
+    int no_check = !on;
+
+    setsockopt(global_socket, SOL_SOCKET, SO_NO_CHECK, (void *)&no_check, sizeof(no_check));
+#endif
+}
+
+/* Fragmenting happens in the host IP stack, but Linux would rather set DF and
+   refuse datagrams over the path MTU */
+static void allow_fragments(void)
+{
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_DONT)
+    int pmtudisc = IP_PMTUDISC_DONT;
+
+    setsockopt(global_socket, IPPROTO_IP, IP_MTU_DISCOVER, (void *)&pmtudisc, sizeof(pmtudisc));
+#endif
+}
+
+/* The data word after a reply's command header (BULK_* flags or a CRC), 0 if
+   there isn't one */
+static unsigned int reply_word(unsigned char *buffer, int len)
+{
+    unsigned int word;
+
+    if (len < COMMAND_LEN + 4)
+	return 0;
+
+    memcpy(&word, buffer + COMMAND_LEN, 4);
+    return ntohl(word);
+}
+
+/* Takes the next whole record out of what's come in over TCP so far. Returns
+   -1 if there isn't one yet, or -2 if the connection has closed or failed */
+static int tcp_next_record(unsigned char *buffer)
+{
+    static unsigned char stream[2 * 2048];
+    static unsigned int have = 0;
+    unsigned int len, total;
+    int rv;
+
+    rv = recv(global_socket, (void *)(stream + have), sizeof(stream) - have, 0);
+    if (rv == 0) {
+	fprintf(stderr, "dcload closed the connection\n");
+	return -2;
+    }
+    if (rv > 0)
+	have += rv;
+#ifndef __MINGW32__
+    else if ((errno != EAGAIN) && (errno != EINTR)) {
+	fprintf(stderr, "error: %s\n", strerror(errno));
+	return -2;
+    }
+#else
+    else if (WSAGetLastError() != WSAEWOULDBLOCK) {
+	fprintf(stderr, "error: %d\n", WSAGetLastError());
+	return -2;
+    }
+#endif
+
+    if (have < TCP_RECORD_H_LEN)
+	return -1;
+
+    len = (stream[0] << 8) | stream[1];
+    total = (TCP_RECORD_H_LEN + len + 3) & ~3;
+    if (len > 2048) {
+	fprintf(stderr, "dcload sent a record too big to be one\n");
+	exit(1);
+    }
+    if (have < total)
+	return -1;
+
+    memcpy(buffer, stream + TCP_RECORD_H_LEN, len);
+    have -= total;
+    memmove(stream, stream + total, have);
+
+    return len;
+}
+
+/* Nothing can be done without the connection anywhere else */
+static int recv_record(unsigned char *buffer)
+{
+    int rv = tcp_next_record(buffer);
+
+    if (rv == -2)
+	exit(1);
+
+    return rv;
+}
+
+/* Every receive goes through here, so -E sees it */
+static int recv_packet(unsigned char *buffer)
+{
+    int rv = tcp_transport ? recv_record(buffer) : recv(global_socket, (void *)buffer, 2048, 0);
+
+    if (rv != -1)
+	pkttrace_recv(buffer, rv);
+
+    return rv;
+}
+
+/* Over TCP, SENDBIN data all arrives, in order, before the DONEBIN. Keep going
+   until that, the connection going away, or dcload going quiet for longer
+   than TCP_STALL_TIMEOUT. */
+static int tcp_recv_data(void *data, unsigned int dcaddr, unsigned int total, unsigned int quiet)
+{
+  unsigned char buffer[2048];
+  unsigned int addr, size;
+  unsigned int received = 0;
+  int got_donebin = 0;
+  fd_set fds;
+  struct timeval tv;
+  int len;
+
+  gettimeofday(&starttime, 0);
+
+  send_cmd(quiet ? CMD_SENDBINQ : CMD_SENDBIN, dcaddr, total, NULL, 0);
+
+  while ((len = tcp_next_record(buffer)) != -2)
+  {
+    if (len == -1)
+    {
+      FD_ZERO(&fds);
+      FD_SET(global_socket, &fds);
+      tv.tv_sec = TCP_STALL_TIMEOUT / 1000000;
+      tv.tv_usec = TCP_STALL_TIMEOUT % 1000000;
+      if (select(global_socket + 1, &fds, NULL, NULL, &tv) == 0)
+        break;
+      continue;
+    }
+
+    pkttrace_recv(buffer, len);
+
+    if (len < COMMAND_LEN)
+    {
+      printf("Obviously bad packet, avoiding segfault\n");
+      fflush(stdout);
+      continue;
+    }
+
+    if (!memcmp(((command_t *)buffer)->id, CMD_DONEBIN, 4))
+    {
+      got_donebin = 1;
+      break;
+    }
+
+    addr = ntohl(((command_t *)buffer)->address);
+    size = ntohl(((command_t *)buffer)->size);
+
+    if ((addr < dcaddr) || (size > (unsigned int)len - COMMAND_LEN) || (addr - dcaddr + size > total))
+    {
+      printf("Obviously bad packet, avoiding segfault\n");
+      fflush(stdout);
+      continue;
+    }
+
+    memcpy((unsigned char *)data + (addr - dcaddr), buffer + COMMAND_LEN, size);
+    received += size;
+  }
+
+  gettimeofday(&endtime, 0);
+
+  if (!got_donebin || (received < total))
+  {
+    fprintf(stderr, "Only received %u of %u bytes\n", received, total);
+    return -1;
+  }
+
+  return 0;
+}
+
 /* receive total bytes from dc and store in data */
-int recv_data(void *data, unsigned int dcaddr, unsigned int total, unsigned int quiet)
+static int do_recv_data(void *data, unsigned int dcaddr, unsigned int total, unsigned int quiet)
 {
   unsigned char buffer[2048];
   unsigned char *i;
@@ -479,10 +695,17 @@ int recv_data(void *data, unsigned int dcaddr, unsigned int total, unsigned int
   int packets = 0;
   unsigned int start;
   int retval;
+  unsigned int flags = htonl(BULK_NOCSUM);
+  unsigned int crc = 0;
+  unsigned int timeout;
+  int got_donebin = 0, got_crc = 0;
 
   // v2.0.0: set up the socket, do version and adapter identification, set globals
   prepare_comms(buffer);
 
+  if (tcp_transport)
+    return tcp_recv_data(data, dcaddr, total, quiet);
+
   // old 1024 sizes
   // This if() looks awful because some ARM chips don't have integer divide, so
   // hardcoding 1024 and 1440 sizes removes those divides. This is because GCC
@@ -513,7 +736,7 @@ int recv_data(void *data, unsigned int dcaddr, unsigned int total, unsigned int
     {
       memset(buffer, 0, 2048);
 
-      while(((retval = recv(global_socket, (void *)buffer, 2048, 0)) == -1)&&((time_in_usec() - start) < PACKET_TIMEOUT));
+      while(((retval = recv_packet(buffer)) == -1)&&((time_in_usec() - start) < PACKET_TIMEOUT));
 
       if (retval > 0)
       {
@@ -551,7 +774,7 @@ int recv_data(void *data, unsigned int dcaddr, unsigned int total, unsigned int
         }
 
         start = time_in_usec();
-        while(((retval = recv(global_socket, (void *)buffer, 2048, 0)) == -1)&&((time_in_usec() - start) < PACKET_TIMEOUT));
+        while(((retval = recv_packet(buffer)) == -1)&&((time_in_usec() - start) < PACKET_TIMEOUT));
 
         if (retval > 0)
         {
@@ -568,7 +791,7 @@ int recv_data(void *data, unsigned int dcaddr, unsigned int total, unsigned int
           }
 
           // Get the DONEBIN
-          while(((retval = recv(global_socket, (void *)buffer, 2048, 0)) == -1)&&((time_in_usec() - start) < PACKET_TIMEOUT));
+          while(((retval = recv_packet(buffer)) == -1)&&((time_in_usec() - start) < PACKET_TIMEOUT));
         }
 
         // Force us to go back and recheck
@@ -591,22 +814,25 @@ int recv_data(void *data, unsigned int dcaddr, unsigned int total, unsigned int
 
     // Receive the data!
 
+    // With -z, dcload sends these without UDP checksums and puts a CRC of the
+    // whole thing in the DONEBIN
     if (!quiet)
     {
-      send_cmd(CMD_SENDBIN, dcaddr, total, NULL, 0);
+      send_cmd(CMD_SENDBIN, dcaddr, total, bulk_nocsum ? (unsigned char *)&flags : NULL, bulk_nocsum ? 4 : 0);
     }
     else
     {
-      send_cmd(CMD_SENDBINQ, dcaddr, total, NULL, 0);
+      send_cmd(CMD_SENDBINQ, dcaddr, total, bulk_nocsum ? (unsigned char *)&flags : NULL, bulk_nocsum ? 4 : 0);
     }
 
     start = time_in_usec();
+    timeout = bulk_nocsum ? CRC_TIMEOUT : PACKET_TIMEOUT;
 
-    while (((time_in_usec() - start) < PACKET_TIMEOUT)&&(packets < ((total+1439)/1440 + 1)))
+    while (((time_in_usec() - start) < timeout)&&(packets < ((total+1439)/1440 + 1)))
     {
       memset(buffer, 0, 2048);
 
-      while(((retval = recv(global_socket, (void *)buffer, 2048, 0)) == -1)&&((time_in_usec() - start) < PACKET_TIMEOUT));
+      while(((retval = recv_packet(buffer)) == -1)&&((time_in_usec() - start) < timeout));
 
       if (retval > 0)
       {
@@ -626,6 +852,13 @@ int recv_data(void *data, unsigned int dcaddr, unsigned int total, unsigned int
             memcpy(i, buffer + 12, ntohl(((command_t *)buffer)->size));
           }
         }
+        else
+        {
+          got_donebin = 1;
+          got_crc = (retval >= COMMAND_LEN + 4);
+          crc = reply_word(buffer, retval);
+          timeout = PACKET_TIMEOUT;
+        }
         packets++;
       }
     }
@@ -643,7 +876,7 @@ int recv_data(void *data, unsigned int dcaddr, unsigned int total, unsigned int
       }
 
       start = time_in_usec();
-      while(((retval = recv(global_socket, (void *)buffer, 2048, 0)) == -1)&&((time_in_usec() - start) < PACKET_TIMEOUT));
+      while(((retval = recv_packet(buffer)) == -1)&&((time_in_usec() - start) < PACKET_TIMEOUT));
 
       if (retval > 0)
       {
@@ -660,7 +893,7 @@ int recv_data(void *data, unsigned int dcaddr, unsigned int total, unsigned int
         }
 
         // Get the DONEBIN
-        while(((retval = recv(global_socket, (void *)buffer, 2048, 0)) == -1)&&((time_in_usec() - start) < PACKET_TIMEOUT));
+        while(((retval = recv_packet(buffer)) == -1)&&((time_in_usec() - start) < PACKET_TIMEOUT));
       }
 
       // Force us to go back and recheck
@@ -671,19 +904,34 @@ int recv_data(void *data, unsigned int dcaddr, unsigned int total, unsigned int
     gettimeofday(&endtime, 0);
 
     free(map);
+
+    // If the DONEBIN went missing there's no telling whether dcload skipped the
+    // checksums, so that gets the same treatment as a bad CRC
+    if (bulk_nocsum && (!got_donebin || (got_crc && (crc32(0, data, total) != crc))))
+    {
+      printf("recv_data: couldn't verify a transfer without UDP checksums, receiving it again with them\n");
+      bulk_nocsum = 0;
+      return do_recv_data(data, dcaddr, total, quiet);
+    }
   }
 
   return 0;
 }
 
 /* send size bytes to dc from addr to dcaddr*/
-int send_data(unsigned char * addr, unsigned int dcaddr, unsigned int size)
+static int do_send_data(unsigned char * addr, unsigned int dcaddr, unsigned int size)
 {
     unsigned char buffer[2048] = {0};
     unsigned char * i = 0;
     unsigned int a = dcaddr;
     unsigned int start = 0;
     unsigned int count = 0;
+    unsigned int flags;
+    unsigned int crc = 0;
+    unsigned int nocsum;
+    unsigned int stride = 1440;
+    unsigned int frames;
+    int len;
 
     if (!size)
 	   return -1;
@@ -691,18 +939,37 @@ int send_data(unsigned char * addr, unsigned int dcaddr, unsigned int size)
      // v2.0.0: Set up the socket, do version and adapter identification, set globals
      prepare_comms(buffer);
 
+    // Neither is any use over TCP
+    if (!tcp_transport)
+	flags = (bulk_nocsum ? BULK_NOCSUM : 0) | ((bulk_frags && !legacy) ? BULK_FRAGMENTS : 0);
+    else
+	flags = 0;
+    flags = htonl(flags);
+
     // Send the data!
     do
     {
-	send_cmd(CMD_LOADBIN, dcaddr, size, NULL, 0);
+	send_cmd(CMD_LOADBIN, dcaddr, size, flags ? (unsigned char *)&flags : NULL, flags ? 4 : 0);
     }
-    while(recv_response(buffer, PACKET_TIMEOUT) == -1);
+    while((len = recv_response(buffer, PACKET_TIMEOUT)) == -1);
 
     while(memcmp(((command_t *)buffer)->id, CMD_LOADBIN, 4)) {
 	printf("send_data: error in response to CMD_LOADBIN, retrying... %c%c%c%c\n",buffer[0],buffer[1],buffer[2],buffer[3]);
 	do
-	    send_cmd(CMD_LOADBIN, dcaddr, size, NULL, 0);
-	while (recv_response(buffer, PACKET_TIMEOUT) == -1);
+	    send_cmd(CMD_LOADBIN, dcaddr, size, flags ? (unsigned char *)&flags : NULL, flags ? 4 : 0);
+	while ((len = recv_response(buffer, PACKET_TIMEOUT)) == -1);
+    }
+
+    // dcload echoes the flags back if it's going along with them
+    nocsum = reply_word(buffer, len) & BULK_NOCSUM;
+    if (nocsum) {
+	crc = htonl(crc32(0, addr, size));
+	set_udp_checksums(0);
+    }
+
+    if (reply_word(buffer, len) & BULK_FRAGMENTS) {
+	stride = PARTBIN_FRAG_MAX;
+	allow_fragments();
     }
 
     // Start throughput timer
@@ -736,26 +1003,32 @@ int send_data(unsigned char * addr, unsigned int dcaddr, unsigned int size)
         }
       }
     }
-    else // 1440 sizes
+    else // 1440 sizes, or multiples of them with -F
     {
-      for(i = addr; i < (addr + size); i += 1440)
+      for(i = addr; i < (addr + size); i += stride)
       {
-        if ((addr + size - i) >= 1440)
+        if ((addr + size - i) >= stride)
         {
-           send_cmd(CMD_PARTBIN, dcaddr, 1440, i, 1440);
+           send_cmd(CMD_PARTBIN, dcaddr, stride, i, stride);
+           frames = stride;
         }
         else
         {
            send_cmd(CMD_PARTBIN, dcaddr, (addr + size) - i, i, (addr + size) - i);
+           frames = (addr + size) - i;
         }
 
-        dcaddr += 1440;
+        dcaddr += stride;
+
+        // A fragmented PARTBIN is that many frames on the wire as far as the
+        // DC's rx fifo is concerned (1480 bytes of the datagram in each)
+        frames = (frames + COMMAND_LEN + 8 + 1479) / 1480;
 
         /* give the DC a chance to empty its rx fifo
          * this prevents buffer overflows and dropped packets
          */
-        count++;
-        if (count == rx_fifo_delay_count)
+        count += frames;
+        if (count >= rx_fifo_delay_count)
         {
           start = time_in_usec();
           while ((time_in_usec() - start) < rx_fifo_delay);
@@ -764,8 +1037,12 @@ int send_data(unsigned char * addr, unsigned int dcaddr, unsigned int size)
       }
     }
 
+    // Resends and everything else get checksums as usual
+    if (nocsum)
+	set_udp_checksums(1);
+
     // Finish up sending and check for dropped packets (if not in fast mode)
-    if(!fast_mode)
+    if(!fast_mode && !tcp_transport)
     {
       start = time_in_usec();
       /* delay a bit to try to make sure all data goes out before CMD_DONEBIN */
@@ -773,8 +1050,8 @@ int send_data(unsigned char * addr, unsigned int dcaddr, unsigned int size)
     }
 
     do
-	send_cmd(CMD_DONEBIN, 0, 0, NULL, 0);
-    while (recv_response(buffer, PACKET_TIMEOUT) == -1);
+	send_cmd(CMD_DONEBIN, 0, 0, nocsum ? (unsigned char *)&crc : NULL, nocsum ? 4 : 0);
+    while ((len = recv_response(buffer, nocsum ? CRC_TIMEOUT : PACKET_TIMEOUT)) == -1);
 
     while(memcmp(((command_t *)buffer)->id, CMD_DONEBIN, 4)) {
 	printf("send_data: error in response to CMD_DONEBIN, retrying...\n");
@@ -785,12 +1062,18 @@ int send_data(unsigned char * addr, unsigned int dcaddr, unsigned int size)
     }
 
     while ( ntohl(((command_t *)buffer)->size) != 0) {
+	if (reply_word(buffer, len) & BULK_CRC_FAILED) {
+	    printf("send_data: CRC mismatch on a transfer without UDP checksums, sending it again with them\n");
+	    bulk_nocsum = 0;
+	    return do_send_data(addr, a, size);
+	}
+
 /*	printf("%d bytes at 0x%x were missing, resending\n", ntohl(((command_t *)buffer)->size),ntohl(((command_t *)buffer)->address)); */
 	send_cmd(CMD_PARTBIN, ntohl(((command_t *)buffer)->address), ntohl(((command_t *)buffer)->size), addr + (ntohl(((command_t *)buffer)->address) - a), ntohl(((command_t *)buffer)->size));
 
 	do
-	    send_cmd(CMD_DONEBIN, 0, 0, NULL, 0);
-	while (recv_response(buffer, PACKET_TIMEOUT) == -1);
+	    send_cmd(CMD_DONEBIN, 0, 0, nocsum ? (unsigned char *)&crc : NULL, nocsum ? 4 : 0);
+	while ((len = recv_response(buffer, nocsum ? CRC_TIMEOUT : PACKET_TIMEOUT)) == -1);
 
 	while(memcmp(((command_t *)buffer)->id, CMD_DONEBIN, 4)) {
 	    printf("send_data: error in response to CMD_DONEBIN, retrying...\n");
@@ -806,6 +1089,33 @@ int send_data(unsigned char * addr, unsigned int dcaddr, unsigned int size)
     return 0;
 }
 
+int recv_data(void *data, unsigned int dcaddr, unsigned int total, unsigned int quiet)
+{
+    unsigned int start = time_in_usec();
+    int retval = 0;
+
+    if (replay_transport)
+	memset(data, 0, total);
+    else
+	retval = do_recv_data(data, dcaddr, total, quiet);
+
+    net_usec += time_in_usec() - start;
+    net_bytes += total;
+
+    return retval;
+}
+
+int send_data(unsigned char * addr, unsigned int dcaddr, unsigned int size)
+{
+    unsigned int start = time_in_usec();
+    int retval = replay_transport ? 0 : do_send_data(addr, dcaddr, size);
+
+    net_usec += time_in_usec() - start;
+    net_bytes += size;
+
+    return retval;
+}
+
 void usage(void)
 {
     printf("\n%s %s by Andrew \"ADK\" Kieschnick\nAugmented by Moopthehedgehog\n\n", PACKAGE, VERSION);
@@ -821,11 +1131,30 @@ void usage(void)
     printf("-m <path>      Map /pc/ on KOS side to <path> (no chroot or super-user requirement)\n");
     printf("-c <path>      Chroot to <path> (must be super-user)\n");
 #endif
-    printf("-i <isofile>   Enable cdfs redirection using iso image <isofile>\n");
+    printf("-i <image>     Enable cdfs redirection using disc image <image> (ISO, GDI, CUE, CSO)\n");
+    printf("-p <file>      Record a trace of cdfs sector reads to <file>\n");
+    printf("-A <file>      Turn cdfs trace <file> into a prefetch plan (written to stdout)\n");
+    printf("-P <file>      Read ahead on cdfs using prefetch plan <file> (does nothing unless\n");
+    printf("               dcload was built with CDFS_STAGING_SIZE set in Makefile.cfg)\n");
     printf("-r             Reset (only works when dcload is in control)\n");
+    printf("-N             Print dcload's network statistics and reset them\n");
     printf("-g             Start a GDB server\n");
     printf("-l             Force legacy 1024-byte payload size (dcload-ip v2+ only)\n");
     printf("-f             Disable FIFO delays for MUCH faster speeds (may increase packet loss)\n");
+    printf("-z             Skip UDP checksums on bulk transfers and CRC-check each one instead\n");
+    printf("               (direct cable or a trusted switch only)\n");
+    printf("-F             Upload in %d-byte datagrams split into IP fragments (fewer packets for\n", PARTBIN_FRAG_MAX);
+    printf("               dcload to handle, direct cable or a quiet switch only). That's 10 frames,\n");
+    printf("               the most the BBA's 16kB receive ring can take in one burst\n");
+    printf("-k             Talk to dcload over TCP instead of UDP (dcload needs DCLOAD_TCP)\n");
+    printf("-S             Print a syscall profile when the program exits or on Ctrl-C\n");
+    printf("-T <file>      Record a trace of console syscalls to <file>\n");
+    printf("-E <file>      Write a Chrome/Perfetto trace of the packets going each way to <file>\n");
+    printf("               (dcload needs DCLOAD_TRACE for its side of them)\n");
+    printf("-R <file>      Replay syscall trace <file> against the host with no Dreamcast attached\n");
+    printf("-I <file>      Record the controller input the program reports to <file>\n");
+    printf("-J <file>      Play back controller input from <file> to the program\n");
+    printf("-w             Write-behind: reply to file writes before they reach the disk\n");
     printf("-h             Usage information (you\'re looking at it)\n\n");
 }
 
@@ -855,8 +1184,13 @@ int open_sockets(char *hostname)
     struct sockaddr_in sin_legacy;
     struct hostent *host = 0;
 
-    dcsocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
-    dcsocket_legacy = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (tcp_transport) {
+	// dcload v2.0.0+ only, on the same port
+	dcsocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    } else {
+	dcsocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+	dcsocket_legacy = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    }
 
 #ifndef __MINGW32__
     if ((dcsocket < 0) || (dcsocket_legacy < 0)) {
@@ -898,7 +1232,7 @@ int open_sockets(char *hostname)
     memcpy((char *)&sin_legacy.sin_addr, host->h_addr, host->h_length);
 
     // Connect legacy port first so that v2.0.0+ port won't conflict
-    if (connect(dcsocket_legacy, (struct sockaddr *)&sin_legacy, sizeof(sin_legacy)) < 0) {
+    if (!tcp_transport && (connect(dcsocket_legacy, (struct sockaddr *)&sin_legacy, sizeof(sin_legacy)) < 0)) {
 	log_error("connect_legacy");
 	return -1;
     }
@@ -906,22 +1240,34 @@ int open_sockets(char *hostname)
     // Connect v2.0.0+ port
     if (connect(dcsocket, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
   log_error("connect");
+  if (tcp_transport)
+    fprintf(stderr, "dcload needs to be built with DCLOAD_TCP for -k\n");
   return -1;
     }
 
+    if (tcp_transport) {
+	// Commands are small and each one waits on the last, so Nagle would
+	// only hold them up
+	int nodelay = 1;
+
+	setsockopt(dcsocket, IPPROTO_TCP, TCP_NODELAY, (void *)&nodelay, sizeof(nodelay));
+    }
+
 #ifdef __MINGW32__
     unsigned long flags = 1;
 	  int failed = 0;
     int failed_legacy = 0;
     failed = ioctlsocket(dcsocket, FIONBIO, &flags);
-    failed_legacy = ioctlsocket(dcsocket_legacy, FIONBIO, &flags);
+    if (dcsocket_legacy)
+      failed_legacy = ioctlsocket(dcsocket_legacy, FIONBIO, &flags);
     if ((failed == SOCKET_ERROR) || (failed_legacy == SOCKET_ERROR)) {
 	log_error("ioctlsocket");
 	return -1;
     }
 #else
     fcntl(dcsocket, F_SETFL, O_NONBLOCK);
-    fcntl(dcsocket_legacy, F_SETFL, O_NONBLOCK);
+    if (dcsocket_legacy)
+      fcntl(dcsocket_legacy, F_SETFL, O_NONBLOCK);
 #endif
 
     return 0;
@@ -935,9 +1281,11 @@ int recv_response(unsigned char *buffer, int timeout)
     struct timespec pausetime = {0}, pauseremain = {0};
 #endif
 
-    while( ((time_in_usec() - start) < timeout) && (rv == -1))
+    /* Nothing gets lost over TCP, so there's no point giving up and sending
+       the command again (which dcload would then answer twice) */
+    while( (tcp_transport || ((time_in_usec() - start) < timeout)) && (rv == -1))
 	  {
-       rv = recv(global_socket, (void *)buffer, 2048, 0);
+       rv = recv_packet(buffer);
        // 100Mbit/s is 10 nanoseconds, but that's reportedly a little slow.
        // 5 is better, but still a bit slow. So let's do 1 nanosecond.
        // There's no picosecond sleep, so this is about as good as it gets.
@@ -953,12 +1301,63 @@ int recv_response(unsigned char *buffer, int timeout)
     return rv;
 }
 
+/* Sends the command at record + TCP_RECORD_H_LEN as a record. The socket is
+   non-blocking, but all of it has to go. */
+static int send_record(unsigned char *record, unsigned int len)
+{
+    unsigned int sent = 0;
+    int rv;
+    fd_set fds;
+
+    record[0] = len >> 8;
+    record[1] = len & 0xff;
+    record[2] = 0;
+    record[3] = 0;
+
+    len += TCP_RECORD_H_LEN;
+    while (len & 3)
+	record[len++] = 0;
+
+    while (sent < len) {
+	rv = send(global_socket, (void *)(record + sent), len - sent, 0);
+
+	if (rv == -1) {
+#ifndef __MINGW32__
+	    if (errno != EAGAIN)
+#else
+	    if (WSAGetLastError() != WSAEWOULDBLOCK)
+#endif
+		return -1;
+
+	    FD_ZERO(&fds);
+	    FD_SET(global_socket, &fds);
+	    select(global_socket + 1, NULL, &fds, NULL, NULL);
+	    continue;
+	}
+
+	sent += rv;
+    }
+
+    return len;
+}
+
 int send_command(char *command, unsigned int addr, unsigned int size, unsigned char *data, unsigned int dsize)
 {
-    unsigned char c_buff[2048];
+    /* Room in front for a TCP record header, and after for its padding */
+    static unsigned char c_record[TCP_RECORD_H_LEN + COMMAND_LEN + PARTBIN_FRAG_MAX + 3];
+    unsigned char *c_buff = c_record + TCP_RECORD_H_LEN;
     unsigned int tmp;
+    unsigned int start = time_in_usec();
     int error = 0;
 
+    if (!memcmp(command, CMD_RETVAL, 4))
+	last_retval = addr;
+
+    if (replay_transport) {
+	net_bytes += dsize;
+	return 0;
+    }
+
     memcpy(c_buff, command, 4);
     tmp = htonl(addr);
     memcpy(c_buff + 4, &tmp, 4);
@@ -967,7 +1366,14 @@ int send_command(char *command, unsigned int addr, unsigned int size, unsigned c
     if (data != 0)
 	memcpy(c_buff + 12, data, dsize);
 
-    error = send(global_socket, (void *)c_buff, 12+dsize, 0);
+    pkttrace_send(c_buff, 12+dsize);
+    if (tcp_transport)
+	error = send_record(c_record, 12+dsize);
+    else
+	error = send(global_socket, (void *)c_buff, 12+dsize, 0);
+
+    net_usec += time_in_usec() - start;
+    net_bytes += dsize;
 
     if(error == -1) {
 #ifndef __MINGW32__
@@ -1167,7 +1573,11 @@ int download(char *filename, unsigned int address,
 
     data = malloc(size);
 
-    recv_data(data, address, size, 0);
+    if (recv_data(data, address, size, 0) == -1) {
+	close(outputfd);
+	free(data);
+	return -1;
+    }
 
     printf("Received %d bytes\n", size);
 
@@ -1198,24 +1608,341 @@ int execute(unsigned int address, unsigned int console, unsigned int cdfsredir)
       printf("Sending execute command (0x%08x, console=%d, cdfsredir=%d)...",address,console,cdfsredir);
     }
 
+    // Bit 2 tells dcload it can ask us for the disc's TOC (CMD_CDFSTOC)
     do
-	send_cmd(CMD_EXECUTE, address, (cdfsredir << 1) | console, NULL, 0);
+	send_cmd(CMD_EXECUTE, address, (cdfsredir << 2) | (cdfsredir << 1) | console, NULL, 0);
     while (recv_response(buffer, PACKET_TIMEOUT) == -1);
 
     printf("executing\n");
     return 0;
 }
 
-int do_console(char *path, char *isofile)
+/* Fetches dcload's network statistics, prints them and has dcload start them
+   over. Versions of dcload without CMD_NETSTATS won't answer. */
+int netstats(void)
 {
-    int isofd = 0;
+    static const char *counter_names[NETSTATS_COUNTERS] = { NETSTATS_COUNTER_NAMES };
+    static const char *cmd_ids[] = { NETSTATS_CMD_IDS };
     unsigned char buffer[2048];
-	struct timespec time = {0},  remain = {0};
+    command_t *reply = (command_t *)buffer;
+    unsigned int words[(sizeof(buffer) - COMMAND_LEN) / 4];
+    unsigned int i, cmds, nwords;
+    unsigned long long cycles;
+    int len = -1, tries;
+
+    prepare_comms(buffer);
+
+    for (tries = 0; (tries < 8) && (len == -1); tries++) {
+	send_cmd(CMD_NETSTATS, 1, 0, NULL, 0);
+	len = recv_response(buffer, PACKET_TIMEOUT);
+	if ((len != -1) && ((len < COMMAND_LEN) || memcmp(reply->id, CMD_NETSTATS, 4)))
+	    len = -1;
+    }
+
+    if (len == -1) {
+	fprintf(stderr, "No network statistics from dcload (needs a version that keeps them)\n");
+	return -1;
+    }
+
+    nwords = (len - COMMAND_LEN) / 4;
+    memcpy(words, reply->data, nwords * 4);
+    for (i = 0; i < nwords; i++)
+	words[i] = ntohl(words[i]);
+
+    /* Only print what this dc-tool has names for */
+    cmds = ntohl(reply->address);
+    if (nwords < NETSTATS_COUNTERS + 3 * cmds) {
+	fprintf(stderr, "Short network statistics reply from dcload\n");
+	return -1;
+    }
+
+    printf("Network statistics:\n");
+    for (i = 0; i < NETSTATS_COUNTERS; i++)
+	printf("  %-18s %10u\n", counter_names[i], words[i]);
+
+    printf("\n  %-8s %10s %16s %12s\n", "command", "count", "pmcr cycles", "avg cycles");
+    for (i = 0; (i < cmds) && (i < sizeof(cmd_ids) / sizeof(cmd_ids[0])); i++) {
+	unsigned int count = words[NETSTATS_COUNTERS + i];
+
+	cycles = ((unsigned long long)words[NETSTATS_COUNTERS + cmds + 2 * i] << 32) |
+	    words[NETSTATS_COUNTERS + cmds + 2 * i + 1];
+	if (!count)
+	    continue;
+
+	printf("  %-8.4s %10u %16llu %12llu\n", cmd_ids[i], count, cycles, cycles / count);
+    }
+
+    fflush(stdout);
+    return 0;
+}
+
+/* Sends CMD_TRACE and waits for its reply, returning its length or -1 */
+static int trace_command(unsigned int first, unsigned int size, unsigned char *buffer)
+{
+    int len = -1, tries;
+
+    for (tries = 0; (tries < 8) && (len == -1); tries++) {
+	send_cmd(CMD_TRACE, first, size, NULL, 0);
+	len = recv_response(buffer, PACKET_TIMEOUT);
+	if ((len != -1) && ((len < COMMAND_LEN + 8) || memcmp(((command_t *)buffer)->id, CMD_TRACE, 4)))
+	    len = -1;
+    }
+
+    return len;
+}
+
+/* Empties dcload's trace ring, so what's fetched at the end starts here */
+static int packet_trace_begin(void)
+{
+    unsigned char buffer[2048];
+
+    prepare_comms(buffer);
+
+    if (trace_command(0, 1, buffer) == -1)
+	printf("dcload didn't answer CMD_TRACE, the packet trace will only have dc-tool's side\n");
+
+    return 0;
+}
+
+/* Pulls dcload's trace ring over. dcload has to be in control for this, so
+   it's done once the upload, download or console session is over. */
+static void packet_trace_fetch(void)
+{
+    unsigned char buffer[2048];
+    command_t *reply = (command_t *)buffer;
+    unsigned int words[2 + 2 * TRACE_RECORDS_PER_REPLY];
+    unsigned int first = 0, count, i;
+    double sent;
+    int len;
+
+    /* Fetching is just more packets, so they're not part of the picture */
+    pkttrace_pause();
+
+    do {
+	sent = pkttrace_now();
+	if ((len = trace_command(first, 0, buffer)) == -1) {
+	    printf("No packet trace from dcload, writing dc-tool's side only\n");
+	    return;
+	}
+
+	count = (len - COMMAND_LEN - 8) / 8;
+	if (count > TRACE_RECORDS_PER_REPLY)
+	    count = TRACE_RECORDS_PER_REPLY;
+	memcpy(words, reply->data, 8 + count * 8);
+	for (i = 0; i < 2 + 2 * count; i++)
+	    words[i] = ntohl(words[i]);
+
+	/* Recording stopped with the first request, so its reply's cycle count
+	   comes after everything in the ring */
+	if (!first)
+	    pkttrace_anchor(words[0], (sent + pkttrace_now()) / 2);
+
+	for (i = 0; i < count; i++)
+	    pkttrace_add_target(words[2 + 2 * i], words[3 + 2 * i]);
+
+	first = ntohl(reply->address) + count;
+    } while (count);
+
+    /* Start recording again */
+    trace_command(0, 1, buffer);
+}
+
+/* Console syscall dispatch
+ *
+ * Commands are looked up by their 4-byte ID. Every handler keeps a count of
+ * calls, the bytes it moved over the network, and how long it took split into
+ * time spent on the network and time spent on the host (disk, image
+ * decompression and so on), plus a log2 histogram of its latencies. The report
+ * gets printed on SIGUSR1, and at exit with -S.
+ */
+#define CONSOLE_HIST_BUCKETS 24
+
+typedef struct {
+    const char *id;
+    const char *name;
+    int (*handler)(unsigned char *buffer);
+    unsigned int key;
+    unsigned int calls;
+    unsigned int max_usec;
+    unsigned long long bytes;
+    unsigned long long host_usec;
+    unsigned long long net_usec;
+    unsigned int hist[CONSOLE_HIST_BUCKETS];
+} console_cmd_t;
+
+static cdimage_t *console_image = NULL;
+
+static int dc_cdfs_read(unsigned char *buffer)
+{
+    return dc_cdfs_redir_read_sectors(console_image, buffer);
+}
+
+static int dc_cdfs_toc(unsigned char *buffer)
+{
+    return dc_cdfs_redir_read_toc(console_image, buffer);
+}
+
+static int dc_bad(unsigned char *buffer)
+{
+    (void)buffer;
+    fprintf(stderr, "command 15 should not happen... (but it did)\n");
+    return 0;
+}
+
+/* Every field spelled out so -Wextra doesn't complain about the counters */
+#define CONSOLE_CMD(id, name, handler) \
+    { id, name, handler, 0, 0, 0, 0, 0, 0, { 0 } }
+
+static console_cmd_t console_cmds[] = {
+    CONSOLE_CMD(CMD_FSTAT,       "fstat",      dc_fstat),
+    CONSOLE_CMD(CMD_WRITE_OLD,   "write_old",  dc_write),
+    CONSOLE_CMD(CMD_WRITE,       "write",      dc_write),
+    CONSOLE_CMD(CMD_READ,        "read",       dc_read),
+    CONSOLE_CMD(CMD_OPEN,        "open",       dc_open),
+    CONSOLE_CMD(CMD_CLOSE,       "close",      dc_close),
+    CONSOLE_CMD(CMD_CREAT,       "creat",      dc_creat),
+    CONSOLE_CMD(CMD_LINK,        "link",       dc_link),
+    CONSOLE_CMD(CMD_UNLINK,      "unlink",     dc_unlink),
+    CONSOLE_CMD(CMD_CHDIR,       "chdir",      dc_chdir),
+    CONSOLE_CMD(CMD_CHMOD,       "chmod",      dc_chmod),
+    CONSOLE_CMD(CMD_LSEEK,       "lseek",      dc_lseek),
+    CONSOLE_CMD(CMD_TIME,        "time",       dc_time),
+    CONSOLE_CMD(CMD_STAT,        "stat",       dc_stat),
+    CONSOLE_CMD(CMD_UTIME,       "utime",      dc_utime),
+    CONSOLE_CMD(CMD_BAD,         "bad",        dc_bad),
+    CONSOLE_CMD(CMD_OPENDIR,     "opendir",    dc_opendir),
+    CONSOLE_CMD(CMD_CLOSEDIR,    "closedir",   dc_closedir),
+    CONSOLE_CMD(CMD_READDIR,     "readdir",    dc_readdir),
+    CONSOLE_CMD(CMD_REWINDDIR,   "rewinddir",  dc_rewinddir),
+    CONSOLE_CMD(CMD_CDFSREAD,    "cdfsread",   dc_cdfs_read),
+    CONSOLE_CMD(CMD_CDFSTOC,     "cdfstoc",    dc_cdfs_toc),
+    CONSOLE_CMD(CMD_GDBPACKET,   "gdbpacket",  dc_gdbpacket),
+    CONSOLE_CMD(CMD_MAPLEINPUT,  "mapleinput", dc_mapleinput),
+};
+
+#define CONSOLE_NUM_CMDS (sizeof(console_cmds) / sizeof(console_cmds[0]))
+
+unsigned int console_profile_on_exit = 0;
+static volatile sig_atomic_t console_report_requested = 0;
+static volatile sig_atomic_t console_interrupted = 0;
+
+#ifndef __MINGW32__
+static void console_report_signal(int sig)
+{
+    if (sig == SIGINT)
+	console_interrupted = 1;
+    else
+	console_report_requested = 1;
+}
+#endif
+
+static void print_usec(unsigned int usec)
+{
+    if (usec < 1000)
+	printf("%uus", usec);
+    else if (usec < 1000000)
+	printf("%ums", usec / 1000);
+    else
+	printf("%us", usec / 1000000);
+}
+
+static void console_report(void)
+{
+    console_cmd_t *c;
+    unsigned int b;
+
+    printf("\nSyscall profile (times in ms):\n");
+    printf("%-10s %8s %12s %10s %10s %8s %8s\n", "command", "calls", "bytes", "host", "net", "avg us", "max us");
+
+    for (c = console_cmds; c < console_cmds + CONSOLE_NUM_CMDS; c++) {
+	if (!c->calls)
+	    continue;
+
+	printf("%-10s %8u %12llu %10.1f %10.1f %8llu %8u\n", c->name, c->calls, c->bytes,
+	       c->host_usec / 1000.0, c->net_usec / 1000.0,
+	       (c->host_usec + c->net_usec) / c->calls, c->max_usec);
+    }
+
+    printf("\nLatency histograms (count of calls under each bound):\n");
+
+    for (c = console_cmds; c < console_cmds + CONSOLE_NUM_CMDS; c++) {
+	if (!c->calls)
+	    continue;
+
+	printf("%-10s", c->name);
+	for (b = 0; b < CONSOLE_HIST_BUCKETS; b++) {
+	    if (!c->hist[b])
+		continue;
+
+	    printf(" <");
+	    print_usec(1u << b);
+	    printf(":%u", c->hist[b]);
+	}
+	printf("\n");
+    }
+
+    fflush(stdout);
+}
+
+static int console_dispatch(unsigned char *buffer, unsigned int len)
+{
+    console_cmd_t *c;
+    unsigned int key;
+    unsigned int start, elapsed, net;
+    unsigned long long net_start, bytes_start;
+    struct timeval arrived;
+    unsigned int b;
+    int retval;
+
+    if (!console_cmds[0].key) {
+	for (c = console_cmds; c < console_cmds + CONSOLE_NUM_CMDS; c++)
+	    memcpy(&c->key, c->id, 4);
+    }
+
+    memcpy(&key, buffer, 4);
+
+    for (c = console_cmds; c < console_cmds + CONSOLE_NUM_CMDS; c++) {
+	if (c->key == key)
+	    break;
+    }
+
+    if (c == console_cmds + CONSOLE_NUM_CMDS)
+	return 0; /* Not a syscall */
+
+    gettimeofday(&arrived, 0);
+    net_start = net_usec;
+    bytes_start = net_bytes;
+    start = time_in_usec();
+    last_retval = -1;
+
+    retval = c->handler(buffer);
+
+    elapsed = time_in_usec() - start;
+    net = (unsigned int)(net_usec - net_start);
+    if (net > elapsed)
+	net = elapsed;
+
+    c->calls++;
+    c->bytes += net_bytes - bytes_start;
+    c->net_usec += net;
+    c->host_usec += elapsed - net;
+    if (elapsed > c->max_usec)
+	c->max_usec = elapsed;
+
+    for (b = 0; (b < CONSOLE_HIST_BUCKETS - 1) && (elapsed >= (1u << b)); b++)
+	;
+    c->hist[b]++;
+
+    systrace_record(buffer, len, &arrived, last_retval, (unsigned int)(net_bytes - bytes_start));
+
+    return retval;
+}
 
+static void console_setup(char *path, char *isofile)
+{
     if (isofile) {
-	isofd = open(isofile, O_RDONLY | O_BINARY);
-	if (isofd < 0)
-	    log_error(isofile);
+	// Opens every track file up front, before any chroot below
+	console_image = cdimage_open(isofile);
     }
 
 #ifndef __MINGW32__
@@ -1224,65 +1951,163 @@ int do_console(char *path, char *isofile)
 	      log_error(path);
     }
 #endif
+}
+
+int do_console(char *path, char *isofile)
+{
+    unsigned char buffer[2048];
+    int len;
+	struct timespec time = {0},  remain = {0};
+
+    console_setup(path, isofile);
+
+#ifndef __MINGW32__
+    signal(SIGUSR1, console_report_signal);
+    if (console_profile_on_exit)
+	signal(SIGINT, console_report_signal);
+#endif
 
     while (1) {
 	fflush(stdout);
 
-	while(recv_response(buffer, PACKET_TIMEOUT) == -1)
+	/* recv_response() doesn't time out over TCP, which would leave these
+	   signals waiting */
+	while((len = (tcp_transport ? recv_packet(buffer) : recv_response(buffer, PACKET_TIMEOUT))) == -1) {
+	    if (console_report_requested) {
+		console_report_requested = 0;
+		console_report();
+	    }
+	    if (console_interrupted) {
+		console_report();
+		return -1;
+	    }
 #if (SAVE_MY_FANS != 0)
-        if(!fast_mode)
-		  nanosleep(&time, &remain); /* Sleep for 0ns, which is just going to yield the thread. */
-#else
-		; /* Spin thread until a packet arrives. */
+	    if(!fast_mode)
+		nanosleep(&time, &remain); /* Sleep for 0ns, which is just going to yield the thread. */
 #endif
+	    /* Otherwise spin thread until a packet arrives. */
+	}
 
-	if (!(memcmp(buffer, CMD_EXIT, 4)))
+	if (!(memcmp(buffer, CMD_EXIT, 4))) {
+	    if (console_profile_on_exit)
+		console_report();
 	    return -1;
-	if (!(memcmp(buffer, CMD_FSTAT, 4)))
-	    CatchError(dc_fstat(buffer));
-	if (!(memcmp(buffer, CMD_WRITE_OLD, 4)))
-	    CatchError(dc_write(buffer));
-  if (!(memcmp(buffer, CMD_WRITE, 4)))
-	    CatchError(dc_write(buffer));
-	if (!(memcmp(buffer, CMD_READ, 4)))
-	    CatchError(dc_read(buffer));
-	if (!(memcmp(buffer, CMD_OPEN, 4)))
-	    CatchError(dc_open(buffer));
-	if (!(memcmp(buffer, CMD_CLOSE, 4)))
-	    CatchError(dc_close(buffer));
-	if (!(memcmp(buffer, CMD_CREAT, 4)))
-	    CatchError(dc_creat(buffer));
-	if (!(memcmp(buffer, CMD_LINK, 4)))
-	    CatchError(dc_link(buffer));
-	if (!(memcmp(buffer, CMD_UNLINK, 4)))
-	    CatchError(dc_unlink(buffer));
-	if (!(memcmp(buffer, CMD_CHDIR, 4)))
-	    CatchError(dc_chdir(buffer));
-	if (!(memcmp(buffer, CMD_CHMOD, 4)))
-	    CatchError(dc_chmod(buffer));
-	if (!(memcmp(buffer, CMD_LSEEK, 4)))
-	    CatchError(dc_lseek(buffer));
-	if (!(memcmp(buffer, CMD_TIME, 4)))
-	    CatchError(dc_time(buffer));
-	if (!(memcmp(buffer, CMD_STAT, 4)))
-	    CatchError(dc_stat(buffer));
-	if (!(memcmp(buffer, CMD_UTIME, 4)))
-	    CatchError(dc_utime(buffer));
-	if (!(memcmp(buffer, CMD_BAD, 4)))
-	    fprintf(stderr, "command 15 should not happen... (but it did)\n");
-	if (!(memcmp(buffer, CMD_OPENDIR, 4)))
-	    CatchError(dc_opendir(buffer));
-	if (!(memcmp(buffer, CMD_CLOSEDIR, 4)))
-	    CatchError(dc_closedir(buffer));
-	if (!(memcmp(buffer, CMD_READDIR, 4)))
-	    CatchError(dc_readdir(buffer));
-	if (!(memcmp(buffer, CMD_CDFSREAD, 4)))
-	    CatchError(dc_cdfs_redir_read_sectors(isofd, buffer));
-	if (!(memcmp(buffer, CMD_GDBPACKET, 4)))
-	    CatchError(dc_gdbpacket(buffer));
-    }
-    if(!(memcmp(buffer, CMD_REWINDDIR, 4)))
-        CatchError(dc_rewinddir(buffer));
+	}
+
+	CatchError(console_dispatch(buffer, len));
+    }
+
+    return 0;
+}
+
+/* Replaying a syscall trace
+ *
+ * Every recorded command goes back through the same handlers at full speed,
+ * with the network swapped out, so the host side can be benchmarked without a
+ * console. Host file and directory handles will generally come out different
+ * from the recorded ones, so they get mapped over as they're opened. Writes,
+ * unlinks and so on really happen, so point -m at a scratch copy of the tree.
+ */
+#define REPLAY_MAX_HANDLES 256
+
+static struct {
+    unsigned int recorded;
+    unsigned int replayed;
+} replay_handles[REPLAY_MAX_HANDLES];
+static unsigned int replay_num_handles = 0;
+
+static unsigned int replay_handle(unsigned int recorded)
+{
+    unsigned int i;
+
+    for (i = 0; i < replay_num_handles; i++) {
+	if (replay_handles[i].recorded == recorded)
+	    return replay_handles[i].replayed;
+    }
+
+    return recorded; /* stdin/stdout/stderr, or it never opened */
+}
+
+static void replay_map_handle(unsigned int recorded, unsigned int replayed)
+{
+    unsigned int i;
+
+    for (i = 0; i < replay_num_handles; i++) {
+	if (replay_handles[i].recorded == recorded)
+	    break;
+    }
+
+    if (i == REPLAY_MAX_HANDLES)
+	return;
+    if (i == replay_num_handles)
+	replay_num_handles++;
+
+    replay_handles[i].recorded = recorded;
+    replay_handles[i].replayed = replayed;
+}
+
+static int replay_has_handle(unsigned char *packet)
+{
+    static const char *ids[] = { CMD_FSTAT, CMD_WRITE_OLD, CMD_WRITE, CMD_READ, CMD_CLOSE,
+				 CMD_LSEEK, CMD_CLOSEDIR, CMD_READDIR, CMD_REWINDDIR };
+    unsigned int i;
+
+    for (i = 0; i < sizeof(ids) / sizeof(ids[0]); i++) {
+	if (!memcmp(packet, ids[i], 4))
+	    return 1;
+    }
+
+    return 0;
+}
+
+int replay_syscalls(char *tracefile, char *path, char *isofile)
+{
+    FILE *fp;
+    systrace_record_t rec;
+    command_int_t *command = (command_int_t *)rec.packet;
+    unsigned int start, elapsed, last_usec = 0;
+    unsigned int count = 0, differ = 0;
+    int opens;
+
+    if (!(fp = systrace_open(tracefile)))
+	return -1;
+
+    console_setup(path, isofile);
+    replay_transport = 1;
+
+    start = time_in_usec();
+
+    while (systrace_next(fp, &rec)) {
+	/* Would sit there waiting on a GDB client */
+	if (!memcmp(rec.packet, CMD_GDBPACKET, 4))
+	    continue;
+
+	if ((rec.len >= 8) && replay_has_handle(rec.packet))
+	    command->value0 = htonl(replay_handle(ntohl(command->value0)));
+
+	console_dispatch(rec.packet, rec.len);
+	count++;
+	last_usec = rec.usec;
+
+	opens = !memcmp(rec.packet, CMD_OPEN, 4) || !memcmp(rec.packet, CMD_CREAT, 4) ||
+		!memcmp(rec.packet, CMD_OPENDIR, 4);
+
+	if (opens && ((int)rec.retval > 0) && ((int)last_retval > 0))
+	    replay_map_handle(rec.retval, last_retval);
+	else if ((last_retval != rec.retval) && memcmp(rec.packet, CMD_TIME, 4))
+	    differ++;
+    }
+
+    elapsed = time_in_usec() - start;
+    fclose(fp);
+    replay_transport = 0;
+
+    printf("Replayed %u syscalls in %.3f s (%.3f s when recorded)\n", count,
+	   elapsed / 1000000.0, last_usec / 1000000.0);
+    if (differ)
+	printf("%u of them returned something other than they did when recorded\n", differ);
+
+    console_report();
 
     return 0;
 }
@@ -1349,9 +2174,9 @@ int open_gdb_socket(int port)
 }
 
 #ifdef __MINGW32__
-#define AVAILABLE_OPTIONS		"x:u:d:a:s:t:i:nlqhrgf"
+#define AVAILABLE_OPTIONS		"x:u:d:a:s:t:i:p:P:A:T:R:E:I:J:nlqhrgfwSzNFk"
 #else
-#define AVAILABLE_OPTIONS		"x:u:d:a:s:t:m:c:i:nlqhrgf"
+#define AVAILABLE_OPTIONS		"x:u:d:a:s:t:m:c:i:p:P:A:T:R:E:I:J:nlqhrgfwSzNFk"
 #endif
 
 int main(int argc, char *argv[])
@@ -1367,6 +2192,7 @@ int main(int argc, char *argv[])
     /* Dynamically allocated, so it should be freed */
     char *filename = 0;
     char *isofile = 0;
+    char *replayfile = 0;
     char *hostname = strdup(DREAMCAST_IP);
     char *cleanlist[4] = { 0, 0, 0, 0 };
 
@@ -1385,7 +2211,7 @@ int main(int argc, char *argv[])
 	switch (someopt) {
 	case 'x':
 	    if (command) {
-		fprintf(stderr, "You can only specify one of -x, -u, -d, and -r\n");
+		fprintf(stderr, "You can only specify one of -x, -u, -d, -r and -N\n");
 		goto doclean;
 	    }
 	    command = 'x';
@@ -1395,7 +2221,7 @@ int main(int argc, char *argv[])
 	    break;
 	case 'u':
 	    if (command) {
-		fprintf(stderr, "You can only specify one of -x, -u, -d, and -r\n");
+		fprintf(stderr, "You can only specify one of -x, -u, -d, -r and -N\n");
 		goto doclean;
 	    }
 	    command = 'u';
@@ -1405,7 +2231,7 @@ int main(int argc, char *argv[])
 	    break;
 	case 'd':
 	    if (command) {
-		fprintf(stderr, "You can only specify one of -x, -u, -d, and -r\n");
+		fprintf(stderr, "You can only specify one of -x, -u, -d, -r and -N\n");
 		goto doclean;
 	    }
 	    command = 'd';
@@ -1445,6 +2271,45 @@ int main(int argc, char *argv[])
 	    cleanlist[2] = isofile;
 	    strcpy(isofile, optarg);
 	    break;
+	case 'p':
+	    if (cdfs_trace_start(optarg))
+		goto doclean;
+	    break;
+	case 'P':
+	    if (cdfs_plan_load(optarg))
+		goto doclean;
+	    break;
+	case 'T':
+	    if (systrace_start(optarg))
+		goto doclean;
+	    break;
+	case 'R':
+	    replayfile = optarg;
+	    break;
+	case 'E':
+	    if (pkttrace_start(optarg))
+		goto doclean;
+	    break;
+	case 'I':
+	    if (mapleinput_replaying()) {
+		fprintf(stderr, "You can only specify one of -I and -J\n");
+		goto doclean;
+	    }
+	    if (mapleinput_record_start(optarg))
+		goto doclean;
+	    break;
+	case 'J':
+	    if (mapleinput_recording()) {
+		fprintf(stderr, "You can only specify one of -I and -J\n");
+		goto doclean;
+	    }
+	    if (mapleinput_replay_start(optarg))
+		goto doclean;
+	    break;
+	case 'A':
+	    someopt = cdfs_analyze_trace(optarg, stdout);
+	    cleanup(cleanlist);
+	    return someopt;
 	case 'a':
 	    address = strtoul(optarg, NULL, 0);
 	    break;
@@ -1493,11 +2358,18 @@ int main(int argc, char *argv[])
 	    break;
 	case 'r':
 	    if (command) {
-		fprintf(stderr, "You can only specify one of -x, -u, -d, and -r\n");
+		fprintf(stderr, "You can only specify one of -x, -u, -d, -r and -N\n");
 		goto doclean;
 	    }
 	    command = 'r';
 	    break;
+	case 'N':
+	    if (command) {
+		fprintf(stderr, "You can only specify one of -x, -u, -d, -r and -N\n");
+		goto doclean;
+	    }
+	    command = 'N';
+	    break;
 	case 'g':
 	    printf("Starting a GDB server on port 2159\n");
 	    open_gdb_socket(2159);
@@ -1507,6 +2379,26 @@ int main(int argc, char *argv[])
         printf("Enabling fast transfer mode\n");
         fast_mode = 1;
         break;
+    case 'S':
+        console_profile_on_exit = 1;
+        break;
+    case 'z':
+        printf("Skipping UDP checksums on bulk transfers\n");
+        bulk_nocsum = 1;
+        break;
+    case 'F':
+        printf("Uploading in fragmented datagrams\n");
+        bulk_frags = 1;
+        break;
+    case 'k':
+        printf("Connecting over TCP\n");
+        tcp_transport = 1;
+        break;
+    case 'w':
+        printf("Enabling write-behind for file writes\n");
+        if (dc_write_behind_start())
+            goto doclean;
+        break;
 	default:
 	/* The user obviously mistyped something */
 	    usage();
@@ -1516,6 +2408,11 @@ int main(int argc, char *argv[])
 	someopt = getopt(argc, argv, AVAILABLE_OPTIONS);
     }
 
+    if (tcp_transport && force_legacy) {
+	fprintf(stderr, "-l can't be used with -k\n");
+	goto doclean;
+    }
+
     if (quiet)
 	printf("Quiet download\n");
 
@@ -1538,12 +2435,21 @@ int main(int argc, char *argv[])
     if (cdfs_redir & (command=='x'))
 	printf("Cdfs redirection enabled\n");
 
+    if (replayfile) {
+	someopt = replay_syscalls(replayfile, path, isofile);
+	cleanup(cleanlist);
+	return someopt;
+    }
+
   if (open_sockets(hostname)<0) // Random port socket for dcload >= 2.0.0
   {
     fprintf(stderr, "Error opening sockets\n");
     goto doclean;
   }
 
+    if (pkttrace_active() && packet_trace_begin())
+	goto doclean;
+
     switch (command) {
     case 'x':
 	printf("Upload <%s>\n", filename);
@@ -1586,11 +2492,18 @@ int main(int argc, char *argv[])
 	if(send_command(CMD_REBOOT, 0, 0, NULL, 0) == -1)
 	    goto doclean;
 	break;
+    case 'N':
+	if(netstats())
+	    goto doclean;
+	break;
     default:
 	usage();
 	break;
     }
 
+    if (pkttrace_active())
+	packet_trace_fetch();
+
     cleanup(cleanlist);
     return 0;
 
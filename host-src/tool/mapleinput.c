@@ -0,0 +1,185 @@
+/*
+ * This file is part of the dcload Dreamcast ethernet loader
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __MINGW32__
+#include <windows.h>
+#else
+#include <netinet/in.h>
+#endif
+
+#include "mapleinput.h"
+#include "utils.h"
+
+#define MAPLEINPUT_MAGIC   "DCMI"
+#define MAPLEINPUT_VERSION 2
+
+typedef struct {
+    unsigned int frame;
+    unsigned int len;
+    unsigned char *cond;
+} mapleinput_rec_t;
+
+static FILE *record_fp = NULL;
+
+/* Replay keeps the whole file in memory and walks it forward as the program's
+   frames go by */
+static mapleinput_rec_t *replay_recs = NULL;
+static unsigned int replay_count = 0;
+static unsigned int replay_next = 0;
+static unsigned int replay_last = 0;
+static int replay_loaded = 0;
+
+static void put32(uint32_t value)
+{
+    value = htonl(value);
+    fwrite(&value, 4, 1, record_fp);
+}
+
+static uint32_t get32(unsigned char *p)
+{
+    uint32_t value;
+
+    memcpy(&value, p, 4);
+    return ntohl(value);
+}
+
+int mapleinput_record_start(const char *path)
+{
+    uint32_t version = htonl(MAPLEINPUT_VERSION);
+
+    if (!(record_fp = fopen(path, "wb"))) {
+        log_error(path);
+        return -1;
+    }
+
+    fwrite(MAPLEINPUT_MAGIC, 4, 1, record_fp);
+    fwrite(&version, 4, 1, record_fp);
+
+    return 0;
+}
+
+int mapleinput_replay_start(const char *path)
+{
+    FILE *fp;
+    unsigned char header[8];
+    mapleinput_rec_t *rec;
+
+    if (!(fp = fopen(path, "rb"))) {
+        log_error(path);
+        return -1;
+    }
+
+    if (fread(header, 8, 1, fp) != 1 || memcmp(header, MAPLEINPUT_MAGIC, 4) ||
+        get32(header + 4) != MAPLEINPUT_VERSION) {
+        fprintf(stderr, "%s is not a maple input recording\n", path);
+        fclose(fp);
+        return -1;
+    }
+
+    while (fread(header, 8, 1, fp) == 1) {
+        if (get32(header + 4) > MAPLEINPUT_MAX) {
+            fprintf(stderr, "%s is damaged\n", path);
+            break;
+        }
+
+        replay_recs = realloc(replay_recs, (replay_count + 1) * sizeof(mapleinput_rec_t));
+        rec = &replay_recs[replay_count];
+        rec->frame = get32(header);
+        rec->len = get32(header + 4);
+        rec->cond = malloc(rec->len ? rec->len : 1);
+
+        if (rec->len && fread(rec->cond, rec->len, 1, fp) != 1) {
+            free(rec->cond);
+            break;
+        }
+
+        replay_count++;
+    }
+
+    fclose(fp);
+    replay_loaded = 1;
+
+    return 0;
+}
+
+void mapleinput_stop(void)
+{
+    unsigned int i;
+
+    if (record_fp) {
+        fclose(record_fp);
+        record_fp = NULL;
+    }
+
+    for (i = 0; i < replay_count; i++)
+        free(replay_recs[i].cond);
+
+    free(replay_recs);
+    replay_recs = NULL;
+    replay_count = 0;
+    replay_loaded = 0;
+}
+
+int mapleinput_recording(void)
+{
+    return record_fp != NULL;
+}
+
+int mapleinput_replaying(void)
+{
+    return replay_loaded;
+}
+
+int mapleinput_record(unsigned int frame, unsigned char *cond, unsigned int len)
+{
+    if (!record_fp || len > MAPLEINPUT_MAX)
+        return -1;
+
+    put32(frame);
+    put32(len);
+    fwrite(cond, len, 1, record_fp);
+
+    return 0;
+}
+
+int mapleinput_lookup(unsigned int frame, unsigned char *cond, unsigned int len)
+{
+    mapleinput_rec_t *rec;
+
+    /* The count going back means the program was started again */
+    if (frame < replay_last)
+        replay_next = 0;
+    replay_last = frame;
+
+    while (replay_next < replay_count && replay_recs[replay_next].frame <= frame)
+        replay_next++;
+
+    if (!replay_next)
+        return 0;
+
+    rec = &replay_recs[replay_next - 1];
+    if (len > rec->len)
+        len = rec->len;
+    memcpy(cond, rec->cond, len);
+
+    return len;
+}
@@ -0,0 +1,55 @@
+/*
+ * This file is part of the dcload Dreamcast ethernet loader
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef __MAPLEINPUT_H__
+#define __MAPLEINPUT_H__
+
+#include <stdint.h>
+
+/* Maple input recording and replay
+ *
+ * A program that wants repeatable input calls dcload's mapleinput syscall once
+ * a frame with the conditions it just got from the controllers, one block of
+ * the same size for each of MAPLEINPUT_PORTS ports. dcload passes them on
+ * along with the frame number, which is how many calls came before it since
+ * the program was started. With -I dc-tool writes these to a file as they
+ * come, and with -J it answers each call with what that file has for that
+ * frame, which the program uses in place of its own.
+ *
+ * The file is a "DCMI" magic and a version word, then for each frame the frame
+ * number, the length of the conditions and the conditions themselves, all in
+ * network byte order.
+ */
+
+/* All ports together, a whole maple response frame's worth */
+#define MAPLEINPUT_MAX 1024
+#define MAPLEINPUT_PORTS 4
+
+int mapleinput_record_start(const char *path);
+int mapleinput_replay_start(const char *path);
+void mapleinput_stop(void);
+int mapleinput_recording(void);
+int mapleinput_replaying(void);
+
+int mapleinput_record(unsigned int frame, unsigned char *cond, unsigned int len);
+/* Copies the conditions recorded for the last frame at or before frame into
+   cond, and returns their length (at most len), or 0 if there aren't any yet */
+int mapleinput_lookup(unsigned int frame, unsigned char *cond, unsigned int len);
+
+#endif /* __MAPLEINPUT_H__ */
@@ -0,0 +1,212 @@
+/*
+ * This file is part of the dcload Dreamcast ethernet loader
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "pkttrace.h"
+#include "utils.h"
+
+typedef struct {
+    double usec;
+    unsigned char host;     /* 1 for dc-tool's own, 0 for dcload's */
+    unsigned char event;    /* dcload event, or 's'/'r' for send/receive */
+    unsigned char id[4];    /* Command ID sent or received */
+    unsigned int arg;       /* Frame length, or command/packet length */
+    unsigned int cycles;    /* dcload's timestamp, placed by the anchor later */
+} pkttrace_event_t;
+
+static char *trace_path = NULL;
+static struct timeval trace_start;
+static int trace_paused = 0;
+
+static pkttrace_event_t *events = NULL;
+static unsigned int events_len = 0, events_size = 0;
+
+static unsigned int anchor_cycles = 0;
+static double anchor_usec = 0;
+
+int pkttrace_start(const char *path)
+{
+    FILE *fp;
+
+    /* Find out now rather than after the whole transfer */
+    if (!(fp = fopen(path, "w"))) {
+        log_error(path);
+        return -1;
+    }
+    fclose(fp);
+
+    trace_path = strdup(path);
+    gettimeofday(&trace_start, 0);
+
+    return 0;
+}
+
+int pkttrace_active(void)
+{
+    return trace_path != NULL;
+}
+
+double pkttrace_now(void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, 0);
+    return (now.tv_sec - trace_start.tv_sec) * 1000000.0 + (now.tv_usec - trace_start.tv_usec);
+}
+
+static pkttrace_event_t *add_event(void)
+{
+    if (events_len == events_size) {
+        events_size = events_size ? events_size * 2 : 4096;
+        events = realloc(events, events_size * sizeof(pkttrace_event_t));
+    }
+
+    return &events[events_len++];
+}
+
+static void host_event(unsigned char what, const unsigned char *packet, unsigned int len)
+{
+    pkttrace_event_t *e;
+    unsigned int i;
+
+    if (!trace_path || trace_paused)
+        return;
+
+    e = add_event();
+    e->usec = pkttrace_now();
+    e->host = 1;
+    e->event = what;
+    e->arg = len;
+
+    /* IDs are plain ASCII, but this ends up inside JSON strings */
+    for (i = 0; i < 4; i++)
+        e->id[i] = ((i < len) && (packet[i] >= ' ') && (packet[i] <= '~') &&
+                    (packet[i] != '"') && (packet[i] != '\\')) ? packet[i] : '?';
+}
+
+void pkttrace_send(const unsigned char *command, unsigned int len)
+{
+    host_event('s', command, len);
+}
+
+void pkttrace_recv(const unsigned char *packet, unsigned int len)
+{
+    host_event('r', packet, len);
+}
+
+void pkttrace_pause(void)
+{
+    trace_paused = 1;
+}
+
+void pkttrace_anchor(unsigned int now_cycles, double host_usec)
+{
+    anchor_cycles = now_cycles;
+    anchor_usec = host_usec;
+}
+
+void pkttrace_add_target(unsigned int event_arg, unsigned int cycles)
+{
+    pkttrace_event_t *e;
+
+    if (!trace_path)
+        return;
+
+    e = add_event();
+    e->host = 0;
+    e->event = event_arg >> 24;
+    e->arg = event_arg & 0x00ffffff;
+    e->cycles = cycles;
+}
+
+static const char *target_event_name(unsigned char event)
+{
+    switch (event & ~PKTTRACE_END) {
+    case PKTTRACE_RX:
+        return "rx";
+    case PKTTRACE_RX_COPY:
+        return "rx copy";
+    case PKTTRACE_PROCESS:
+        return "process";
+    case PKTTRACE_TX:
+        return "tx";
+    }
+
+    return "unknown";
+}
+
+int pkttrace_finish(void)
+{
+    FILE *fp;
+    pkttrace_event_t *e;
+    unsigned int depth = 0;
+
+    if (!trace_path)
+        return 0;
+
+    if (!(fp = fopen(trace_path, "w"))) {
+        log_error(trace_path);
+        return -1;
+    }
+
+    fprintf(fp, "{\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"dcload\"}},\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"dc-tool\"}}");
+
+    for (e = events; e < events + events_len; e++) {
+        if (e->host) {
+            fprintf(fp, ",\n{\"name\":\"%s %.4s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":2,\"tid\":1,\"args\":{\"bytes\":%u}}",
+                    (e->event == 's') ? "send" : "recv", e->id, e->usec, e->arg);
+            continue;
+        }
+
+        /* Everything dcload logged happened before the fetch, so count back
+           from there */
+        e->usec = anchor_usec - (unsigned int)(anchor_cycles - e->cycles) / PKTTRACE_CYCLES_PER_USEC;
+
+        /* The ring may have lost the beginning of the oldest ones */
+        if (e->event & PKTTRACE_END) {
+            if (!depth)
+                continue;
+            depth--;
+        }
+        else
+            depth++;
+
+        fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":1,\"args\":{\"len\":%u}}",
+                target_event_name(e->event), (e->event & PKTTRACE_END) ? 'E' : 'B', e->usec, e->arg);
+    }
+
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+
+    printf("Wrote packet trace with %u events to %s\n", events_len, trace_path);
+
+    free(events);
+    events = NULL;
+    events_len = events_size = 0;
+    free(trace_path);
+    trace_path = NULL;
+
+    return 0;
+}
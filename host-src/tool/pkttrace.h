@@ -0,0 +1,64 @@
+/*
+ * This file is part of the dcload Dreamcast ethernet loader
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef __PKTTRACE_H__
+#define __PKTTRACE_H__
+
+/* Packet timelines
+ *
+ * While a trace is on, every command dc-tool sends and every packet it gets
+ * back is logged with a timestamp. Afterwards dcload's own trace ring (built
+ * with DCLOAD_TRACE) is fetched with CMD_TRACE and both end up in one
+ * Chrome/Perfetto JSON trace, dcload's events shifted onto dc-tool's clock.
+ *
+ * dcload only keeps the low 32 bits of its cycle counter, which wraps every 21
+ * seconds or so, so its events get placed by how long before the fetch they
+ * happened. Anything older than one wrap lands in the wrong place.
+ */
+
+/* dcload's records: event << 24 | argument, plus a timestamp. The low bit of
+   the event marks the end of a begin/end pair. */
+#define PKTTRACE_END     0x01
+#define PKTTRACE_RX      0x02
+#define PKTTRACE_RX_COPY 0x04
+#define PKTTRACE_PROCESS 0x06
+#define PKTTRACE_TX      0x08
+
+/* DCLOAD_PMCR counts CPU cycles */
+#define PKTTRACE_CYCLES_PER_USEC 199.5
+
+int pkttrace_start(const char *path);
+int pkttrace_active(void);
+
+/* Host side events. Ignored unless a trace is on and not paused. */
+void pkttrace_send(const unsigned char *command, unsigned int len);
+void pkttrace_recv(const unsigned char *packet, unsigned int len);
+/* Stops logging host events, for while dcload's ring is being fetched */
+void pkttrace_pause(void);
+/* Microseconds since the trace started */
+double pkttrace_now(void);
+
+/* dcload's cycle counter read now_cycles at host time host_usec */
+void pkttrace_anchor(unsigned int now_cycles, double host_usec);
+void pkttrace_add_target(unsigned int event_arg, unsigned int cycles);
+
+/* Writes out the JSON trace and stops tracing */
+int pkttrace_finish(void);
+
+#endif /* __PKTTRACE_H__ */
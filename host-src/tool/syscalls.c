@@ -34,6 +34,7 @@
 #include <string.h>
 #include <errno.h>
 #include <libgen.h>
+#include <pthread.h>
 #ifdef __MINGW32__
 #include <windows.h>
 #include <limits.h>
@@ -41,9 +42,11 @@
 #include <netinet/in.h>
 #endif
 #include "syscalls.h"
+#include "cdfsprof.h"
 #include "dc-io.h"
 #include "dcload-types.h"
 #include "commands.h"
+#include "mapleinput.h"
 
 #include "utils.h"
 
@@ -120,6 +123,189 @@ static inline char *map_path(char *path, int check_only_dirname) {
   return path_result_buffer;
 }
 
+/* Write-behind for dc_write()
+ *
+ * When enabled with -w, dc_write() replies RETVAL as soon as the payload is in
+ * host memory and hands the buffer to a writer thread, which flushes queued
+ * writes to disk in the order they were received. The Dreamcast then only
+ * waits on the network, not on the host's disk.
+ *
+ * A failed deferred write is latched against its fd and reported as -1 by the
+ * next syscall on that fd, or by close. Syscalls that depend on the file's
+ * contents or offset (read, lseek, fstat, close) drain that fd's queue first,
+ * so the target never sees stale data. Console fds (0-2) are always written
+ * synchronously to keep output interleaved with dc-tool's own messages.
+ */
+
+#define WRITE_BEHIND_MAX_FD     1024
+/* Once this much is queued, dc_write() blocks until the writer catches up */
+#define WRITE_BEHIND_MAX_QUEUED (32 * 1024 * 1024)
+
+typedef struct wb_entry {
+    struct wb_entry *next;
+    int fd;
+    unsigned int size;
+    unsigned char *data;
+} wb_entry_t;
+
+static int wb_running = 0;
+static pthread_t wb_thread;
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wb_done = PTHREAD_COND_INITIALIZER;
+static wb_entry_t *wb_head = NULL;
+static wb_entry_t *wb_tail = NULL;
+static unsigned int wb_queued_bytes = 0;
+static unsigned int wb_pending[WRITE_BEHIND_MAX_FD];
+static unsigned char wb_error[WRITE_BEHIND_MAX_FD];
+
+static void *wb_writer(void *arg)
+{
+    wb_entry_t *entry;
+    unsigned int done;
+    ssize_t written;
+    int failed;
+
+    (void)arg;
+
+    pthread_mutex_lock(&wb_lock);
+    while (1) {
+        while (!wb_head && wb_running)
+            pthread_cond_wait(&wb_work, &wb_lock);
+
+        /* Only exit once everything queued has hit the disk */
+        if (!wb_head)
+            break;
+
+        entry = wb_head;
+        wb_head = entry->next;
+        if (!wb_head)
+            wb_tail = NULL;
+
+        /* Once a write on this fd has failed, don't write anything after it */
+        failed = wb_error[entry->fd];
+        pthread_mutex_unlock(&wb_lock);
+
+        done = 0;
+        while (!failed && (done < entry->size)) {
+            written = write(entry->fd, entry->data + done, entry->size - done);
+            if (written > 0)
+                done += written;
+            else if ((written < 0) && (errno == EINTR))
+                continue;
+            else {
+                fprintf(stderr, "write-behind: write to fd %d failed: %s\n",
+                        entry->fd, written ? strerror(errno) : "short write");
+                failed = 1;
+            }
+        }
+
+        free(entry->data);
+
+        pthread_mutex_lock(&wb_lock);
+        if (failed)
+            wb_error[entry->fd] = 1;
+        wb_pending[entry->fd]--;
+        wb_queued_bytes -= entry->size;
+        pthread_cond_broadcast(&wb_done);
+        free(entry);
+    }
+    pthread_mutex_unlock(&wb_lock);
+
+    return NULL;
+}
+
+int dc_write_behind_start(void)
+{
+    if (wb_running)
+        return 0;
+
+    wb_running = 1;
+    if (pthread_create(&wb_thread, NULL, wb_writer, NULL)) {
+        wb_running = 0;
+        log_error("write-behind thread");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Flushes everything still queued and stops the writer thread */
+void dc_write_behind_stop(void)
+{
+    if (!wb_running)
+        return;
+
+    pthread_mutex_lock(&wb_lock);
+    wb_running = 0;
+    pthread_cond_signal(&wb_work);
+    pthread_mutex_unlock(&wb_lock);
+
+    pthread_join(wb_thread, NULL);
+}
+
+static inline int wb_handles_fd(int fd)
+{
+    return wb_running && (fd > 2) && (fd < WRITE_BEHIND_MAX_FD);
+}
+
+/* Waits for all queued writes on fd to complete. Returns -1 (and clears the
+   latch) if any deferred write on it failed since the last report. */
+static int wb_sync_fd(int fd)
+{
+    int retval;
+
+    if (!wb_handles_fd(fd))
+        return 0;
+
+    pthread_mutex_lock(&wb_lock);
+    while (wb_pending[fd])
+        pthread_cond_wait(&wb_done, &wb_lock);
+    retval = wb_error[fd] ? -1 : 0;
+    wb_error[fd] = 0;
+    pthread_mutex_unlock(&wb_lock);
+
+    return retval;
+}
+
+/* Takes ownership of data. Returns -1 instead of queueing if an earlier
+   deferred write on fd failed, in which case the caller still owns data. */
+static int wb_queue_write(int fd, unsigned char *data, unsigned int size)
+{
+    wb_entry_t *entry;
+
+    pthread_mutex_lock(&wb_lock);
+
+    if (wb_error[fd]) {
+        wb_error[fd] = 0;
+        pthread_mutex_unlock(&wb_lock);
+        return -1;
+    }
+
+    while (wb_queued_bytes && (wb_queued_bytes + size > WRITE_BEHIND_MAX_QUEUED))
+        pthread_cond_wait(&wb_done, &wb_lock);
+
+    entry = malloc(sizeof(wb_entry_t));
+    entry->next = NULL;
+    entry->fd = fd;
+    entry->size = size;
+    entry->data = data;
+
+    if (wb_tail)
+        wb_tail->next = entry;
+    else
+        wb_head = entry;
+    wb_tail = entry;
+
+    wb_pending[fd]++;
+    wb_queued_bytes += size;
+    pthread_cond_signal(&wb_work);
+
+    pthread_mutex_unlock(&wb_lock);
+
+    return 0;
+}
+
 /* syscalls for dcload-ip
  *
  * 1. receive all parameters from dc
@@ -144,7 +330,10 @@ int dc_fstat(unsigned char * buffer)
     command_3int_t *command = (command_3int_t *)buffer;
     /* value0 = fd, value1 = addr, value2 = size */
 
-    retval = fstat(ntohl(command->value0), &filestat);
+    if (wb_sync_fd(ntohl(command->value0)))
+        retval = -1;
+    else
+        retval = fstat(ntohl(command->value0), &filestat);
 
     dcstat.st_dev = dc_order(filestat.st_dev);
     dcstat.st_ino = dc_order(filestat.st_ino);
@@ -204,6 +393,19 @@ int dc_write(unsigned char * buffer)
       retval = write(out_file, data, ntohl(command->value2));
       close(out_file);
     }
+    else if (wb_handles_fd(ntohl(command->value0)))
+    {
+      // Write-behind: the writer thread owns the buffer once it's queued
+      if (wb_queue_write(ntohl(command->value0), data, ntohl(command->value2)))
+      {
+        retval = -1;
+      }
+      else
+      {
+        retval = ntohl(command->value2);
+        data = NULL;
+      }
+    }
     else
     {
       retval = write(ntohl(command->value0), data, ntohl(command->value2));
@@ -218,6 +420,165 @@ int dc_write(unsigned char * buffer)
     return 0;
 }
 
+/* Pipelined reads
+ *
+ * A big read used to be read() in full into one malloc'd buffer before the
+ * first PARTBIN left, so disk time and network time added up. Reads larger
+ * than one chunk are now split up: a reader thread fills chunk N+1 from disk
+ * while send_data() has chunk N on the wire. Each chunk goes out as its own
+ * LOADBIN/PARTBIN/DONEBIN sequence at the matching offset in the target's
+ * buffer, and host memory is bounded by the pipeline depth regardless of the
+ * size of the read.
+ */
+
+#define READ_PIPELINE_CHUNK (1024 * 1024)
+#define READ_PIPELINE_DEPTH 2
+
+typedef struct {
+    int fd;
+    unsigned int size;
+    unsigned char *buf[READ_PIPELINE_DEPTH];
+    int len[READ_PIPELINE_DEPTH];       /* bytes read into slot, -1 on error */
+    int full[READ_PIPELINE_DEPTH];
+    int stop;                           /* set by the sender on a send failure */
+    unsigned int done;                  /* bytes read from fd so far */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} read_pipeline_t;
+
+static void *read_pipeline_reader(void *arg)
+{
+    read_pipeline_t *rp = (read_pipeline_t *)arg;
+    unsigned int offset = 0;
+    unsigned int chunk = 0;
+    unsigned int want, got;
+    ssize_t n = 0;
+    int slot;
+
+    while (offset < rp->size) {
+        slot = chunk % READ_PIPELINE_DEPTH;
+
+        pthread_mutex_lock(&rp->lock);
+        while (rp->full[slot] && !rp->stop)
+            pthread_cond_wait(&rp->cond, &rp->lock);
+        pthread_mutex_unlock(&rp->lock);
+
+        if (rp->stop)
+            break;
+
+        want = rp->size - offset;
+        if (want > READ_PIPELINE_CHUNK)
+            want = READ_PIPELINE_CHUNK;
+
+        /* Fill the whole chunk unless we hit EOF */
+        got = 0;
+        while (got < want) {
+            n = read(rp->fd, rp->buf[slot] + got, want - got);
+            if (n > 0)
+                got += n;
+            else if ((n < 0) && (errno == EINTR))
+                continue;
+            else
+                break;
+        }
+
+        pthread_mutex_lock(&rp->lock);
+        rp->len[slot] = ((n < 0) && !got) ? -1 : (int)got;
+        rp->full[slot] = 1;
+        rp->done += got;
+        pthread_cond_broadcast(&rp->cond);
+        pthread_mutex_unlock(&rp->lock);
+
+        /* Short chunk means EOF or an error, either way we're done */
+        if (got < want)
+            break;
+
+        offset += got;
+        chunk++;
+    }
+
+    return NULL;
+}
+
+static int dc_read_pipelined(int fd, unsigned int dcaddr, unsigned int size)
+{
+    read_pipeline_t rp;
+    pthread_t reader;
+    unsigned int chunk = 0, sent;
+    int retval = 0;
+    int len, slot;
+
+    memset(&rp, 0, sizeof(rp));
+    rp.fd = fd;
+    rp.size = size;
+    pthread_mutex_init(&rp.lock, NULL);
+    pthread_cond_init(&rp.cond, NULL);
+
+    for (slot = 0; slot < READ_PIPELINE_DEPTH; slot++)
+        rp.buf[slot] = malloc(READ_PIPELINE_CHUNK);
+
+    if (pthread_create(&reader, NULL, read_pipeline_reader, &rp)) {
+        log_error("read pipeline thread");
+        retval = -1;
+        goto out;
+    }
+
+    while (1) {
+        slot = chunk % READ_PIPELINE_DEPTH;
+
+        pthread_mutex_lock(&rp.lock);
+        while (!rp.full[slot])
+            pthread_cond_wait(&rp.cond, &rp.lock);
+        len = rp.len[slot];
+        pthread_mutex_unlock(&rp.lock);
+
+        if (len < 0) {
+            /* Only report the error if nothing was read before it */
+            if (!retval)
+                retval = -1;
+            break;
+        }
+
+        if (len && send_data(rp.buf[slot], dcaddr + chunk * READ_PIPELINE_CHUNK, len)) {
+            /* The chunks before this one made it, so that's a short read */
+            if (!retval)
+                retval = -1;
+            pthread_mutex_lock(&rp.lock);
+            rp.stop = 1;
+            pthread_cond_broadcast(&rp.cond);
+            pthread_mutex_unlock(&rp.lock);
+            break;
+        }
+        retval += len;
+
+        if ((len < READ_PIPELINE_CHUNK) || ((unsigned int)retval == size))
+            break;
+
+        /* Hand the slot back to the reader */
+        pthread_mutex_lock(&rp.lock);
+        rp.full[slot] = 0;
+        pthread_cond_broadcast(&rp.cond);
+        pthread_mutex_unlock(&rp.lock);
+
+        chunk++;
+    }
+
+    pthread_join(reader, NULL);
+
+    /* Don't leave the file position past what the target actually got */
+    sent = (retval > 0) ? (unsigned int)retval : 0;
+    if (rp.done > sent)
+        lseek(fd, (off_t)sent - (off_t)rp.done, SEEK_CUR);
+
+out:
+    for (slot = 0; slot < READ_PIPELINE_DEPTH; slot++)
+        free(rp.buf[slot]);
+    pthread_mutex_destroy(&rp.lock);
+    pthread_cond_destroy(&rp.cond);
+
+    return retval;
+}
+
 int dc_read(unsigned char * buffer)
 {
     unsigned char *data;
@@ -225,6 +586,17 @@ int dc_read(unsigned char * buffer)
     command_3int_t *command = (command_3int_t *)buffer;
     /* value0 = fd, value1 = addr, value2 = size */
 
+    if (wb_sync_fd(ntohl(command->value0))) {
+        send_cmd(CMD_RETVAL, -1, -1, NULL, 0);
+        return 0;
+    }
+
+    if (ntohl(command->value2) > READ_PIPELINE_CHUNK) {
+        retval = dc_read_pipelined(ntohl(command->value0), ntohl(command->value1), ntohl(command->value2));
+        send_cmd(CMD_RETVAL, retval, retval, NULL, 0);
+        return 0;
+    }
+
     data = malloc(ntohl(command->value2));
     retval = read(ntohl(command->value0), data, ntohl(command->value2));
 
@@ -273,7 +645,10 @@ int dc_close(unsigned char * buffer)
     int retval;
     command_int_t *command = (command_int_t *)buffer;
 
-    retval = close(ntohl(command->value0));
+    // Report a failed deferred write, but close the fd regardless
+    retval = wb_sync_fd(ntohl(command->value0));
+    if (close(ntohl(command->value0)))
+        retval = -1;
 
     send_cmd(CMD_RETVAL, retval, retval, NULL, 0);
 
@@ -355,7 +730,10 @@ int dc_lseek(unsigned char * buffer)
     int retval;
     command_3int_t *command = (command_3int_t *)buffer;
 
-    retval = lseek(ntohl(command->value0), ntohl(command->value1), ntohl(command->value2));
+    if (wb_sync_fd(ntohl(command->value0)))
+        retval = -1;
+    else
+        retval = lseek(ntohl(command->value0), ntohl(command->value1), ntohl(command->value2));
 
     send_cmd(CMD_RETVAL, retval, retval, NULL, 0);
 
@@ -520,7 +898,6 @@ int dc_rewinddir(unsigned char * buffer)
 
     if(i >= DIRENT_OFFSET && i < MAX_OPEN_DIRS + DIRENT_OFFSET) {
         rewinddir(opendirs[i - DIRENT_OFFSET]);
-        opendirs[i - DIRENT_OFFSET] = NULL;
         retval = 0;
     }
     else {
@@ -532,28 +909,84 @@ int dc_rewinddir(unsigned char * buffer)
     return 0;
 }
 
-int dc_cdfs_redir_read_sectors(int isofd, unsigned char * buffer)
+/* CDFS read-ahead: the RETVAL for a sector read tells the target how many
+   sectors are worth staging next (address field) and where they start (size
+   field). dcload (if it has a staging area set up) requests those right away
+   and they stream in while the program polls for completion, so the next read
+   is served locally. Without a prefetch plan to go by that only happens for
+   sequential access. Older dcload versions ignore this return value.
+   If the image can't be read, the RETVAL is -1 and no data gets sent. */
+#define CDFS_READAHEAD_MAX_SECTORS 256
+
+static unsigned int cdfs_next_lba = 0;
+
+int dc_cdfs_redir_read_sectors(cdimage_t *image, unsigned char * buffer)
 {
-    int start;
     unsigned char * buf;
+    unsigned int fad, sectors;
+    unsigned int readahead_fad = 0;
+    int readahead = 0;
     command_3int_t *command = (command_3int_t *)buffer;
+    /* value0 = FAD, value1 = addr, value2 = size */
 
-    start = ntohl(command->value0) - 150;
+    fad = ntohl(command->value0) & ~CDFS_READ_PREFETCH;
+    sectors = ntohl(command->value2) / 2048;
 
-    lseek(isofd, start * 2048, SEEK_SET);
+    /* dcload's own read-ahead requests don't get hints */
+    if (!(ntohl(command->value0) & CDFS_READ_PREFETCH)) {
+        readahead = cdfs_profile_read(fad, sectors, &readahead_fad);
 
-    buf = malloc(ntohl(command->value2));
+        if ((readahead < 0) && (fad == cdfs_next_lba)) {
+            readahead = sectors * 2;
+            readahead_fad = fad + sectors;
+        }
+
+        if (readahead < 0)
+            readahead = 0;
+        if (readahead > CDFS_READAHEAD_MAX_SECTORS)
+            readahead = CDFS_READAHEAD_MAX_SECTORS;
+    }
+    cdfs_next_lba = fad + sectors;
 
-    read(isofd, buf, ntohl(command->value2));
+    buf = calloc(1, ntohl(command->value2));
+
+    if (image && cdimage_read_sectors(image, fad, sectors, buf)) {
+        fprintf(stderr, "cdfs: unable to read %u sectors at FAD %u\n", sectors, fad);
+        send_cmd(CMD_RETVAL, -1, -1, NULL, 0);
+        free(buf);
+        return 0;
+    }
 
     send_data(buf, ntohl(command->value1), ntohl(command->value2));
 
-    send_cmd(CMD_RETVAL, 0, 0, NULL, 0);
+    send_cmd(CMD_RETVAL, readahead, readahead_fad, NULL, 0);
 
     free(buf);
     return 0;
 }
 
+int dc_cdfs_redir_read_toc(cdimage_t *image, unsigned char * buffer)
+{
+    unsigned int toc[CDIMAGE_TOC_WORDS];
+    int retval = -1;
+    int i;
+    command_3int_t *command = (command_3int_t *)buffer;
+    /* value0 = session, value1 = addr, value2 = size */
+
+    if (image && (ntohl(command->value2) == sizeof(toc)) &&
+        !cdimage_read_toc(image, ntohl(command->value0), toc)) {
+        for (i = 0; i < CDIMAGE_TOC_WORDS; i++)
+            toc[i] = dc_order(toc[i]);
+
+        send_data((unsigned char *)toc, ntohl(command->value1), sizeof(toc));
+        retval = 0;
+    }
+
+    send_cmd(CMD_RETVAL, retval, retval, NULL, 0);
+
+    return 0;
+}
+
 #define GDBBUFSIZE 1024
 #ifdef __MINGW32__
 extern SOCKET gdb_server_socket;
@@ -619,3 +1052,26 @@ int dc_gdbpacket(unsigned char * buffer)
 
     return 0;
 }
+
+int dc_mapleinput(unsigned char * buffer)
+{
+    command_3int_t *command = (command_3int_t *)buffer;
+    /* value0 = frame, value1 = size per port, value2 = ports, then the conditions */
+    unsigned int frame = ntohl(command->value0);
+    unsigned int size = ntohl(command->value1);
+    unsigned int ports = ntohl(command->value2);
+    static unsigned char cond[MAPLEINPUT_MAX];
+    int retval = -1;
+
+    /* 0 tells the program to keep its own conditions */
+    if ((ports <= MAPLEINPUT_PORTS) && (size <= MAPLEINPUT_MAX / MAPLEINPUT_PORTS)) {
+        if (mapleinput_recording())
+            retval = mapleinput_record(frame, buffer + sizeof(command_3int_t), size * ports) ? -1 : 0;
+        else if (mapleinput_replaying())
+            retval = mapleinput_lookup(frame, cond, size * ports);
+    }
+
+    send_cmd(CMD_RETVAL, retval, retval, cond, (retval > 0) ? retval : 0);
+
+    return 0;
+}
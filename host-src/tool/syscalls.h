@@ -22,6 +22,8 @@
 #ifndef __SYSCALLS_H__
 #define __SYSCALLS_H__
 
+#include "cdimage.h"
+
 void set_mappath(char *path);
 
 int dc_fstat(unsigned char *buffer);
@@ -44,9 +46,14 @@ int dc_readdir(unsigned char * buffer);
 int dc_closedir(unsigned char * buffer);
 int dc_rewinddir(unsigned char * buffer);
 
-int dc_cdfs_redir_read_sectors(int isofd, unsigned char * buffer);
+int dc_cdfs_redir_read_sectors(cdimage_t *image, unsigned char * buffer);
+int dc_cdfs_redir_read_toc(cdimage_t *image, unsigned char * buffer);
 
 int dc_gdbpacket(unsigned char * buffer);
+int dc_mapleinput(unsigned char * buffer);
+
+int dc_write_behind_start(void);
+void dc_write_behind_stop(void);
 
 #define CMD_EXIT     "DC00"
 #define CMD_FSTAT    "DC01"
@@ -71,6 +78,8 @@ int dc_gdbpacket(unsigned char * buffer);
 #define CMD_CDFSREAD "DC19"
 #define CMD_GDBPACKET "DC20"
 #define CMD_REWINDDIR "DC21"
+#define CMD_CDFSTOC   "DC22"
+#define CMD_MAPLEINPUT "DC23"
 
 // Special definition for exception handler data
 #define CMD_EXCEPTION "EXPT"
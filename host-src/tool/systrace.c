@@ -0,0 +1,163 @@
+/*
+ * This file is part of the dcload Dreamcast ethernet loader
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#ifdef __MINGW32__
+#include <windows.h>
+#else
+#include <netinet/in.h>
+#endif
+
+#include "systrace.h"
+#include "syscalls.h"
+#include "utils.h"
+
+#define SYSTRACE_MAGIC   "DCST"
+#define SYSTRACE_VERSION 1
+
+/* File offsets are followed here from the calls themselves instead of asking
+   the OS, so that write-behind doesn't have to be flushed for every record */
+#define SYSTRACE_MAX_FD 1024
+
+static FILE *trace_fp = NULL;
+static struct timeval trace_start;
+static uint64_t trace_offsets[SYSTRACE_MAX_FD];
+
+int systrace_start(const char *path)
+{
+    uint32_t version = htonl(SYSTRACE_VERSION);
+
+    if (!(trace_fp = fopen(path, "wb"))) {
+        log_error(path);
+        return -1;
+    }
+
+    fwrite(SYSTRACE_MAGIC, 4, 1, trace_fp);
+    fwrite(&version, 4, 1, trace_fp);
+    gettimeofday(&trace_start, 0);
+
+    return 0;
+}
+
+void systrace_stop(void)
+{
+    if (trace_fp) {
+        fclose(trace_fp);
+        trace_fp = NULL;
+    }
+}
+
+int systrace_active(void)
+{
+    return trace_fp != NULL;
+}
+
+static void put32(uint32_t value)
+{
+    value = htonl(value);
+    fwrite(&value, 4, 1, trace_fp);
+}
+
+static uint32_t get32(unsigned char *p)
+{
+    uint32_t value;
+
+    memcpy(&value, p, 4);
+    return ntohl(value);
+}
+
+void systrace_record(unsigned char *packet, unsigned int len, const struct timeval *arrived,
+                     unsigned int retval, unsigned int payload)
+{
+    uint64_t offset = SYSTRACE_NO_OFFSET;
+    uint32_t fd = (len >= 8) ? get32(packet + 4) : SYSTRACE_MAX_FD;
+    uint16_t len16;
+
+    if (!trace_fp)
+        return;
+
+    if (!memcmp(packet, CMD_OPEN, 4) || !memcmp(packet, CMD_CREAT, 4)) {
+        if ((int)retval >= 0 && retval < SYSTRACE_MAX_FD)
+            trace_offsets[retval] = 0;
+    }
+    else if (fd < SYSTRACE_MAX_FD) {
+        if (!memcmp(packet, CMD_READ, 4) || !memcmp(packet, CMD_WRITE, 4) ||
+            !memcmp(packet, CMD_WRITE_OLD, 4)) {
+            offset = trace_offsets[fd];
+            if ((int)retval > 0)
+                trace_offsets[fd] += retval;
+        }
+        else if (!memcmp(packet, CMD_LSEEK, 4)) {
+            offset = trace_offsets[fd];
+            if ((int)retval >= 0)
+                trace_offsets[fd] = retval;
+        }
+    }
+
+    put32((arrived->tv_sec - trace_start.tv_sec) * 1000000 + (arrived->tv_usec - trace_start.tv_usec));
+    put32(retval);
+    put32(payload);
+    put32(offset >> 32);
+    put32(offset & 0xffffffff);
+    len16 = htons(len);
+    fwrite(&len16, 2, 1, trace_fp);
+    fwrite(packet, len, 1, trace_fp);
+}
+
+FILE *systrace_open(const char *path)
+{
+    FILE *fp;
+    unsigned char header[8];
+
+    if (!(fp = fopen(path, "rb"))) {
+        log_error(path);
+        return NULL;
+    }
+
+    if (fread(header, 8, 1, fp) != 1 || memcmp(header, SYSTRACE_MAGIC, 4) ||
+        get32(header + 4) != SYSTRACE_VERSION) {
+        fprintf(stderr, "%s is not a syscall trace\n", path);
+        fclose(fp);
+        return NULL;
+    }
+
+    return fp;
+}
+
+int systrace_next(FILE *fp, systrace_record_t *rec)
+{
+    unsigned char header[22];
+
+    if (fread(header, 22, 1, fp) != 1)
+        return 0;
+
+    rec->usec = get32(header);
+    rec->retval = get32(header + 4);
+    rec->payload = get32(header + 8);
+    rec->offset = ((uint64_t)get32(header + 12) << 32) | get32(header + 16);
+    rec->len = (header[20] << 8) | header[21];
+
+    if (rec->len > sizeof(rec->packet) || fread(rec->packet, rec->len, 1, fp) != 1)
+        return 0;
+
+    return 1;
+}
@@ -0,0 +1,59 @@
+/*
+ * This file is part of the dcload Dreamcast ethernet loader
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef __SYSTRACE_H__
+#define __SYSTRACE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+/* Console syscall traces
+ *
+ * A trace holds every command packet the target sent during a console session,
+ * as received (so IDs, arguments and path strings), along with when it came
+ * in, the value that went back in CMD_RETVAL, how many payload bytes the
+ * handler moved, and for read/write/lseek the host file offset the call
+ * started at. Everything is stored in network byte order.
+ */
+
+#define SYSTRACE_NO_OFFSET 0xffffffffffffffffULL
+
+typedef struct {
+    uint32_t usec;          /* Since the trace was started */
+    uint32_t retval;
+    uint32_t payload;       /* Bytes sent or received besides the command */
+    uint64_t offset;        /* SYSTRACE_NO_OFFSET if not a file access */
+    uint16_t len;           /* Of the command packet */
+    unsigned char packet[2048];
+} systrace_record_t;
+
+int systrace_start(const char *path);
+void systrace_stop(void);
+int systrace_active(void);
+/* arrived is when the packet came in, taken before its handler ran */
+void systrace_record(unsigned char *packet, unsigned int len, const struct timeval *arrived,
+                     unsigned int retval, unsigned int payload);
+
+/* Returns NULL if path isn't a syscall trace */
+FILE *systrace_open(const char *path);
+/* Returns 1 if a record was read, 0 at the end of the trace */
+int systrace_next(FILE *fp, systrace_record_t *rec);
+
+#endif /* __SYSTRACE_H__ */
@@ -43,6 +43,17 @@ start:
     mov.l       disable_cache, r4
     jsr         @r4
      nop
+    ! Hang on to the DHCP lease the last dcload left behind in its crt0 (it's
+    ! garbage after a power cycle, dcload checks it before trusting it)
+    mov.l       lease_cache, r0
+    mov.l       @r0+, r5
+    mov.l       @r0+, r6
+    mov.l       @r0+, r7
+    mov.l       @r0+, r8
+    mov.l       @r0+, r9
+    mov.l       @r0+, r10
+    mov.l       @r0+, r11
+    mov.l       @r0+, r12
     ! Clear out the whole area
     mov.l       dcload_base, r2
     mov.l       dcload_max_sz, r1
@@ -72,6 +83,16 @@ loop:
     mov.l       r3, @r2
     bf/s        loop
      add         #4, r2
+    ! And put the lease back
+    mov.l       lease_cache_end, r0
+    mov.l       r12, @-r0
+    mov.l       r11, @-r0
+    mov.l       r10, @-r0
+    mov.l       r9, @-r0
+    mov.l       r8, @-r0
+    mov.l       r7, @-r0
+    mov.l       r6, @-r0
+    mov.l       r5, @-r0
     ! Jump to the main dcload binary.
     mov.l       dcload_base, r4
     jmp         @r4
@@ -97,6 +118,11 @@ disable_cache:
     .long       _disable_cache
 dcload_max_sz:
     .long       (0x8c010000 - 0x8c004000) >> 2
+! _dhcp_lease_cache in dcload-crt0.s, 32 bytes
+lease_cache:
+    .long       0xac004020
+lease_cache_end:
+    .long       0xac004040
 
 ! Include the binaries here, making sure they're aligned to 4 byte boundaries
 ! and that they're a multiple of 4 bytes in size.
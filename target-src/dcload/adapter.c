@@ -6,6 +6,7 @@
 volatile unsigned char escape_loop = 0;
 int timeout_loop = 0;
 int loop_secs_elapsed = 0;
+volatile unsigned char loop_single_pass = 0;
 
 // The currently configured driver.
 adapter_t * bb;
@@ -62,6 +62,10 @@ extern volatile unsigned char escape_loop;
 // Else, leave it as zero. If loop times out, it will be set to -1 and need resetting.
 extern int timeout_loop;
 extern int loop_secs_elapsed;
+// Set this to make the loop do a single pass and return, e.g. to service the
+// network while the running program polls an async CDFS read. escape_loop is
+// left as-is on return so the caller can tell whether a RETVAL came in.
+extern volatile unsigned char loop_single_pass;
 
 // All adapter drivers should use this shared buffer to receive.
 extern __attribute__((aligned(32))) unsigned char raw_current_pkt[RAW_RX_PKT_BUF_SIZE];
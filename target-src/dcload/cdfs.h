@@ -6,4 +6,8 @@ void cdfs_redir_save(void);
 void cdfs_redir_disable(void);
 void cdfs_redir_enable(void);
 
+extern volatile unsigned char cdfs_read_pending;
+extern unsigned char cdfs_toc_from_host;
+void cdfs_redir_finish_read(void);
+
 #endif
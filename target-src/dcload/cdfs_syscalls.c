@@ -25,39 +25,271 @@
 #include "net.h"
 #include "adapter.h"
 #include "commands.h"
+#include "cdfs.h"
+#include "dcload.h"
+#include "perfctr.h"
 
 // Leave this as an int.
 static int gdStatus = 0;
 
+// Set while a CMD_CDFSREAD is out and dc-tool hasn't sent its RETVAL yet
+volatile unsigned char cdfs_read_pending = 0;
+
+// Set by cmd_execute when dc-tool understands CMD_CDFSTOC, otherwise the TOC is
+// faked as a single data track at LBA 150
+unsigned char cdfs_toc_from_host = 0;
+
+#define CDFS_ASYNC_SLICE ((unsigned long long int)PERFCOUNTER_SCALE * CDFS_ASYNC_SLICE_US / 1000000)
+
+// Read-ahead
+//
+// When dc-tool expects more reads it replies to CMD_CDFSREAD with the number of
+// sectors it thinks are worth reading ahead in the RETVAL address field, and
+// where they start in the size field (older versions just send 0). Normally
+// that's right after the read, but with a prefetch plan loaded it can be
+// wherever the program went next last time. Once the program's own read
+// completes those sectors are requested into the staging area, and they stream
+// in while the program keeps polling. A later read that falls entirely inside
+// the staging area is then copied locally without going out on the network at
+// all.
+// Read-ahead goes out CDFS_PREFETCH_PIECE sectors at a time, one piece chained
+// off the last as the program polls. A read that misses the staging area has
+// to wait for the piece in flight, but no longer than that: the rest of the
+// read-ahead is dropped.
+#define CDFS_STAGING_SECTORS (CDFS_STAGING_SIZE / 2048)
+#define CDFS_PREFETCH_PIECE 32
+
+// Set in the FAD of reads dcload makes on its own, so dc-tool can leave them
+// out of access traces. A FAD never gets anywhere near this.
+#define CDFS_READ_PREFETCH 0x80000000
+
+// RETVAL address field for a read dc-tool couldn't do (no data comes with it)
+#define CDFS_READ_FAILED 0xffffffff
+
+static unsigned int staged_lba = 0;
+static unsigned int staged_count = 0; // In sectors, asked for so far. 0 means nothing is staged
+static unsigned int prefetch_left = 0; // Sectors of the read-ahead still to ask for after those
+static unsigned char cdfs_read_is_prefetch = 0;
+
 struct TOC {
 	unsigned int entry[99];
 	unsigned int first, last;
 	unsigned int dunno;
 };
 
-int gdGdcReqCmd(int cmd, int *param)
+static void cdfs_send_read(unsigned int lba, unsigned int count, unsigned int buf)
+{
+	command_3int_t * command = (command_3int_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN + UDP_H_LEN);
+
+	memcpy(command->id, CMD_CDFSREAD, 4);
+	command->value0 = htonl(lba | (cdfs_read_is_prefetch ? CDFS_READ_PREFETCH : 0));
+	command->value1 = htonl(buf);
+	command->value2 = htonl(count*2048);
+	build_send_packet(sizeof(command_3int_t));
+
+	// Don't wait for it, data streams in as gdGdcGetCmdStat gets polled
+	cdfs_read_pending = 1;
+}
+
+// The staging area counts as holding a piece from when it's asked for, a hit
+// just has to wait for the rest of the transfer if it's still in flight.
+static void cdfs_prefetch_next(void)
+{
+	unsigned int count = prefetch_left;
+
+	if(count > CDFS_PREFETCH_PIECE)
+	{
+		count = CDFS_PREFETCH_PIECE;
+	}
+
+	cdfs_read_is_prefetch = 1;
+	cdfs_send_read(staged_lba + staged_count, count, CDFS_STAGING_ADDR + staged_count * 2048);
+
+	staged_count += count;
+	prefetch_left -= count;
+}
+
+static void cdfs_start_prefetch(unsigned int lba, unsigned int count)
+{
+	if(count > CDFS_STAGING_SECTORS)
+	{
+		count = CDFS_STAGING_SECTORS;
+	}
+
+	staged_lba = lba;
+	staged_count = 0;
+	prefetch_left = count;
+
+	cdfs_prefetch_next();
+}
+
+// RETVAL for the outstanding read came in. Only the polling path is allowed to
+// chain a prefetch off of it, since cdfs_redir_finish_read() runs from inside
+// build_send_packet() with another command parked.
+static void cdfs_read_done(int allow_prefetch)
+{
+	unsigned int hint = syscall_retval;
+	unsigned int hint_lba = syscall_retsize;
+
+	cdfs_read_pending = 0;
+
+	if(cdfs_read_is_prefetch)
+	{
+		cdfs_read_is_prefetch = 0;
+		if(hint == CDFS_READ_FAILED)
+		{
+			staged_count = 0; // Nothing good in there after all
+			prefetch_left = 0;
+		}
+		else if(allow_prefetch && prefetch_left)
+		{
+			cdfs_prefetch_next();
+		}
+		return; // The program's request finished a while ago
+	}
+
+	if(hint == CDFS_READ_FAILED)
+	{
+		gdStatus = -1;
+		return;
+	}
+
+	gdStatus = 2;
+
+	if(CDFS_STAGING_SECTORS && allow_prefetch && hint)
+	{
+		cdfs_start_prefetch(hint_lba, hint);
+	}
+}
+
+// Service the network for a bit so the data for an outstanding read can stream
+// in. Real GD-ROM reads don't block, and games are written around polling
+// gdGdcGetCmdStat while they get on with other work, so only spend up to
+// CDFS_ASYNC_SLICE here per poll instead of sitting in bb->loop() until the
+// whole transfer is done. Any packets that don't fit in the adapter's RX buffer
+// in the meantime get resent by dc-tool at DONEBIN time.
+// If the program has stopped the dcload perf counter the slice never runs out,
+// which just degrades to the old blocking behavior.
+static void cdfs_service_read(void)
+{
+	unsigned long long int slice_start;
+
+	if(!cdfs_read_pending)
+	{
+		return;
+	}
+
+	slice_start = PMCR_RegRead(DCLOAD_PMCR);
+	loop_single_pass = 1;
+
+	do {
+		bb->loop(0);
+
+		if(escape_loop) // RETVAL came in, so all the data is here
+		{
+			escape_loop = 0;
+			loop_single_pass = 0; // In case a prefetch goes out
+			cdfs_read_done(1);
+			break;
+		}
+	} while((PMCR_RegRead(DCLOAD_PMCR) - slice_start) < CDFS_ASYNC_SLICE);
+
+	loop_single_pass = 0;
+}
+
+// Block until any outstanding read completes. This needs to happen before
+// anything else goes out over the syscall port, since dc-tool handles commands
+// in order and the read's RETVAL would otherwise get mistaken for the reply to
+// the next syscall. Note that this uses pkt_buf.
+void cdfs_redir_finish_read(void)
+{
+	if(cdfs_read_pending)
+	{
+		bb->loop(0);
+		cdfs_read_done(0);
+	}
+}
+
+// Serve a read out of the staging area if all of it is there, or will be once
+// the rest of the read-ahead is in
+static int cdfs_staged_read(unsigned int lba, unsigned int count, unsigned char *buf)
+{
+	if(!CDFS_STAGING_SECTORS || !staged_count || (lba < staged_lba) || (lba + count > staged_lba + staged_count + prefetch_left))
+	{
+		return 0;
+	}
+
+	cdfs_redir_finish_read(); // Prefetch might still be streaming in
+	while(staged_count && (lba + count > staged_lba + staged_count))
+	{
+		cdfs_prefetch_next();
+		cdfs_redir_finish_read();
+	}
+
+	if(!staged_count) // And it might have failed
+	{
+		return 0;
+	}
+
+	memcpy(buf, (unsigned char *)CDFS_STAGING_ADDR + (lba - staged_lba) * 2048, count * 2048);
+
+	// Used up everything that was staged, so go get the next batch
+	if((lba + count == staged_lba + staged_count) && !prefetch_left)
+	{
+		cdfs_start_prefetch(lba + count, staged_count);
+	}
+
+	return 1;
+}
+
+// Ask dc-tool for the image's TOC. Returns 0 if it had one for that session.
+static int cdfs_read_toc(unsigned int session, struct TOC *toc)
 {
 	command_3int_t * command = (command_3int_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN + UDP_H_LEN);
+
+	memcpy(command->id, CMD_CDFSTOC, 4);
+	command->value0 = htonl(session);
+	command->value1 = htonl((unsigned int)toc);
+	command->value2 = htonl(sizeof(struct TOC));
+	build_send_packet(sizeof(command_3int_t));
+	bb->loop(0);
+
+	return syscall_retval;
+}
+
+int gdGdcReqCmd(int cmd, int *param)
+{
 	struct TOC *toc;
 	int i;
 
 	switch (cmd) {
 	case 16: /* read sectors */
+		param[3] = 0;
 
-		memcpy(command->id, CMD_CDFSREAD, 4);
-		command->value0 = htonl(param[0]);
-		command->value1 = htonl(param[2]);
-		command->value2 = htonl(param[1]*2048);
-		build_send_packet(sizeof(command_3int_t));
-		bb->loop(0);
+		if(cdfs_staged_read(param[0], param[1], (unsigned char *)param[2]))
+		{
+			gdStatus = 2;
+			return 0;
+		}
 
-		param[3] = 0;
-		gdStatus = 2;
+		// Missed, so the rest of the read-ahead isn't worth waiting for
+		cdfs_redir_finish_read();
+		prefetch_left = 0;
+		cdfs_send_read(param[0], param[1], param[2]);
+		gdStatus = 1;
 
 		return 0;
 		break;
 	case 19: /* read toc */
+		cdfs_redir_finish_read();
 		toc = (struct TOC *)param[1];
+
+		if(cdfs_toc_from_host && !cdfs_read_toc(param[0], toc))
+		{
+			gdStatus = 2;
+			return 0;
+		}
+
 		toc->entry[0] = 0x41000096; /* CTRL = 4, ADR = 1, LBA = 150 */
 		for(i=1; i<99; i++)
 			toc->entry[i] = -1;
@@ -67,10 +299,14 @@ int gdGdcReqCmd(int cmd, int *param)
 		return 0;
 		break;
 	case 24: /* init disc */
+		cdfs_redir_finish_read();
+		staged_count = 0;
+		prefetch_left = 0;
 		gdStatus = 2;
 		return 0;
 		break;
 	default:
+		cdfs_redir_finish_read();
 		gdStatus = 0;
 		return -1;
 		break;
@@ -80,14 +316,19 @@ int gdGdcReqCmd(int cmd, int *param)
 
 void gdGdcExecServer(void)
 {
+	cdfs_service_read();
 }
 
 int gdGdcGetCmdStat(int f, int *status)
 {
 	(void) f; // unused
 
+	cdfs_service_read();
+
 	if (gdStatus == 0)
 		status[0] = 0;
+	else if (gdStatus == -1)
+		status[0] = 3; // Medium error
 	return gdStatus;
 }
 
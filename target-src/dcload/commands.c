@@ -15,15 +15,50 @@
 
 #include "perfctr.h"
 #include "memfuncs.h"
+#include "trace.h"
+#include "tcp.h"
 
 __attribute__((aligned(4))) volatile unsigned int our_ip = 0; // To be clear, this needs to be zero for init. Make that explicit here. Also, this value should be kept LE.
 unsigned int tool_ip = 0;
 unsigned char tool_mac[6] = {0};
 unsigned short tool_port = 0;
 unsigned int tool_version = 0;
+unsigned int tool_tcp = 0;
+unsigned int tool_console_tcp = 0;
 
 static unsigned int cached_dest = 0;
 static int payload1024 = 0;
+static unsigned int bulk_nocsum = 0; // Current LOADBIN gets checked by CRC at DONEBIN
+static unsigned int bulk_frags = 0; // Current LOADBIN may send fragmented PARTBINs
+static unsigned int bulk_crc = 0; // CRC-32 of the binary from its load address up to bulk_crc_next
+static unsigned int bulk_crc_next = 0;
+
+// MAPLESUB subscription, polled by maplesub_poll(). The frames are kept the way
+// they came in. Rather than a copy of each frame's last response, only its CRC
+// is kept to tell whether it changed.
+static struct {
+	unsigned int count; // 0 if there's no subscription
+	unsigned int size; // Of frames[]
+	unsigned int ip;
+	unsigned short port;
+	unsigned short src_port;
+	unsigned char mac[6];
+	unsigned int seen; // Frames that have a last_crc yet, one bit each
+	unsigned long long int interval; // In DCLOAD_PMCR cycles
+	unsigned long long int last; // When the frames last went out
+	unsigned int last_crc[MAPLE_BATCH_MAX];
+	__attribute__((aligned(4))) unsigned char frames[MAPLESUB_FRAMES_SIZE];
+} maplesub; // Here's a global array
+
+// Data word dc-tool sent after the command header, 0 if there isn't one
+// (BULK_* flags on LOADBIN/SENDBIN, the CRC on DONEBIN)
+static inline unsigned int command_word(udp_header_t * udp, command_t * command)
+{
+	if (ntohs(udp->length) >= UDP_H_LEN + COMMAND_LEN + 4)
+		return ntohl(*(unsigned int *)command->data);
+
+	return 0;
+}
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
@@ -65,6 +100,7 @@ void cmd_execute(ether_header_t * ether, ip_header_t * ip, udp_header_t * udp, c
 		tool_ip = ntohl(ip->src);
 		tool_port = ntohs(udp->src);
 		memcpy(tool_mac, ether->src, 6);
+		tool_console_tcp = tool_tcp;
 		our_ip = ntohl(ip->dest);
 
 		unsigned int cmd_size = ntohl(command->size);
@@ -75,7 +111,7 @@ void cmd_execute(ether_header_t * ether, ip_header_t * ip, udp_header_t * udp, c
 
 		make_ip(tool_ip, our_ip, UDP_H_LEN + COMMAND_LEN, IP_UDP_PROTOCOL, (ip_header_t *)(pkt_buf + ETHER_H_LEN), ip->packet_id);
 		make_udp(tool_port, ntohs(udp->dest), COMMAND_LEN, (ip_header_t *)(pkt_buf + ETHER_H_LEN), (udp_header_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN));
-		bb->tx(pkt_buf, ETHER_H_LEN + IP_H_LEN + UDP_H_LEN + COMMAND_LEN);
+		net_tx_command(COMMAND_LEN);
 
 		if (!booted)
 			disp_info();
@@ -90,6 +126,12 @@ void cmd_execute(ether_header_t * ether, ip_header_t * ip, udp_header_t * udp, c
 		if (cmd_size>>1)
 			cdfs_redir_enable();
 
+		// dc-tool can serve the disc image's real TOC
+		cdfs_toc_from_host = (cmd_size >> 2) & 1;
+
+		// mapleinput() counts the program's frames from here
+		mapleinput_frame = 0;
+
 		running = 1;
 
 //		CacheBlockPurge((void*)0x0c004000, 1536);
@@ -140,6 +182,20 @@ void cmd_loadbin(ip_header_t * ip, udp_header_t * udp, command_t * command)
 	command_t * response = (command_t *)buffer;
 	memcpy(response, command, COMMAND_LEN);
 
+	// Agree to skip checksums and to take fragments by echoing the flags back,
+	// old dcloads just don't
+	unsigned int response_len = COMMAND_LEN;
+	unsigned int flags = command_word(udp, command);
+	bulk_nocsum = flags & BULK_NOCSUM;
+	bulk_frags = flags & BULK_FRAGMENTS;
+	bulk_crc = 0;
+	bulk_crc_next = bin_info.load_address;
+	if(bulk_nocsum || bulk_frags)
+	{
+		*(unsigned int *)response->data = htonl(bulk_nocsum | bulk_frags);
+		response_len += 4;
+	}
+
 	// Check for P0, P1, or P3, all of which could be cacheable and would need OCBP or OCBWB
 	// Faster to check for neither P2 nor P4
 	unsigned int cacheable_check = bin_info.load_address >> 29;
@@ -162,9 +218,9 @@ void cmd_loadbin(ip_header_t * ip, udp_header_t * udp, command_t * command)
 		payload1024 = 0;
 	}
 
-	make_ip(ntohl(ip->src), our_ip, UDP_H_LEN + COMMAND_LEN, IP_UDP_PROTOCOL, (ip_header_t *)(pkt_buf + ETHER_H_LEN), ip->packet_id);
-	make_udp(ntohs(udp->src), ntohs(udp->dest), COMMAND_LEN, (ip_header_t *)(pkt_buf + ETHER_H_LEN), (udp_header_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN));
-	bb->tx(pkt_buf, ETHER_H_LEN + IP_H_LEN + UDP_H_LEN + COMMAND_LEN);
+	make_ip(ntohl(ip->src), our_ip, UDP_H_LEN + response_len, IP_UDP_PROTOCOL, (ip_header_t *)(pkt_buf + ETHER_H_LEN), ip->packet_id);
+	make_udp(ntohs(udp->src), ntohs(udp->dest), response_len, (ip_header_t *)(pkt_buf + ETHER_H_LEN), (udp_header_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN));
+	net_tx_command(response_len);
 
 	if (!running) {
 		if (!booted)
@@ -173,9 +229,63 @@ void cmd_loadbin(ip_header_t * ip, udp_header_t * udp, command_t * command)
 	}
 }
 
+static inline int partbin_index(unsigned int cmd_addr)
+{
+	// Legacy check for versions < 2.0.0
+	if(__builtin_expect(payload1024, 0))
+	{
+		return (cmd_addr - bin_info.load_address) / 1024; // /1024 = >> 10
+	}
+	else
+	{
+		return (cmd_addr - bin_info.load_address) / 1440; // /1440 = 64-bit multiplication trick
+	}
+}
+
+// Uncacheable P2 destinations get written through the store queues in 32-byte
+// bursts instead of one uncached store at a time, as long as dcload has the
+// store queues to itself: not while a program's running, and not with the MMU
+// on. P4 is left alone, the store queues can only reach external memory and
+// P4 is on-chip registers (including the store queues themselves).
+static inline int partbin_use_sq(unsigned int cmd_addr)
+{
+	return ((bin_info.load_address >> 29) == 5) && (!(cmd_addr & 0x1f)) && (!running) && SQ_usable();
+}
+
+// With no UDP checksums, the CRC dc-tool sends with DONEBIN gets built up as
+// the PARTBINs come in, while each payload is still in the cache, so DONEBIN
+// doesn't have to go over the whole binary. Whatever comes in out of order is
+// left for DONEBIN to pick up from memory, and anything written over what's
+// been counted already means starting over.
+static inline void partbin_crc(unsigned int cmd_addr, unsigned char * data, unsigned int cmd_size)
+{
+	if(!bulk_nocsum)
+	{
+		return;
+	}
+
+	if(cmd_addr == bulk_crc_next)
+	{
+		bulk_crc = crc32_update(bulk_crc, data, cmd_size);
+		bulk_crc_next += cmd_size;
+	}
+	else if(cmd_addr < bulk_crc_next)
+	{
+		bulk_crc = 0;
+		bulk_crc_next = bin_info.load_address;
+	}
+}
+
+static void partbin_sq_copy(unsigned int cmd_addr, unsigned char * data, unsigned int cmd_size)
+{
+	unsigned int bulk = cmd_size & -32;
+
+	SQ_memcpy((void*)cmd_addr, data, bulk / 32);
+	SH4_aligned_memcpy((void*)(cmd_addr + bulk), data + bulk, cmd_size - bulk);
+}
+
 void cmd_partbin(command_t * command)
 {
-	int index = 0;
 	unsigned int cmd_addr = ntohl(command->address);
 	unsigned int cmd_size = ntohl(command->size);
 
@@ -185,25 +295,164 @@ void cmd_partbin(command_t * command)
 
 	// cmd_addr needs to honor whatever dc-tool sends. Use P0 addresses for cache boost when writing to RAM.
 	// Something great for alignment reasons is that, in addition to being the max payload size, 1440 bytes is an even multiple of 32 bytes.
-	SH4_aligned_memcpy((void*)cmd_addr, to_p1(command->data), cmd_size);
-	if(cached_dest)
+	if(partbin_use_sq(cmd_addr))
+	{
+		partbin_sq_copy(cmd_addr, to_p1(command->data), cmd_size);
+	}
+	else
 	{
-		CacheBlockPurge((void*)cmd_addr, (cmd_size + 31)/32 + 2); // +1 for misalignment, +1 again for prefetch
+		SH4_aligned_memcpy((void*)cmd_addr, to_p1(command->data), cmd_size);
+		if(cached_dest)
+		{
+			CacheBlockPurge((void*)cmd_addr, (cmd_size + 31)/32 + 2); // +1 for misalignment, +1 again for prefetch
+		}
+		// Ensure physical memory is actually written to from the cache, since we don't know how it might be used.
+		// Purge instead of writeback to avoid cache conflicts/trashing.
 	}
-	// Ensure physical memory is actually written to from the cache, since we don't know how it might be used.
-	// Purge instead of writeback to avoid cache conflicts/trashing.
 
-	// Legacy check for versions < 2.0.0
-	if(__builtin_expect(payload1024, 0))
+	partbin_crc(cmd_addr, to_p1(command->data), cmd_size);
+	bin_info.map[partbin_index(cmd_addr)] = 1;
+}
+
+// cmd_partbin() for a packet whose UDP checksum hasn't been verified yet, so
+// the payload only gets walked once: it's summed on its way into place. 'sum'
+// is the partial sum of the pseudo header and command header so far, and
+// 'data' is where the payload is (not necessarily right after the command, the
+// BBA hands this a pointer into its RX ring). A checksum of 0 means the packet
+// doesn't have one, and it's just copied.
+// Returns -1 without touching anything if the destination isn't inside the
+// binary being loaded, since a corrupt address could point anywhere; the caller
+// then checks the checksum first the old way. If the checksum turns out bad,
+// the chunk gets marked as missing (even if an earlier copy of it had arrived
+// fine, it just got written over) and dc-tool resends it at DONEBIN time.
+int cmd_partbin_csum(command_t * command, unsigned char * data, unsigned int sum, unsigned short udp_checksum, unsigned int payload_size)
+{
+	unsigned int cmd_addr = ntohl(command->address);
+	unsigned int cmd_size = ntohl(command->size);
+
+	if((cmd_size != payload_size) || (cmd_addr < bin_info.load_address) || (cmd_addr + cmd_size > bin_info.load_address + bin_info.load_size))
+	{
+		return -1;
+	}
+
+	if(partbin_use_sq(cmd_addr))
+	{
+		// The store queues can't sum on the way, but the packet side is still
+		// in the cache, so sum that first
+		if(udp_checksum)
+		{
+			sum = memsum_16bit(data, cmd_size >> 1, sum);
+			if(cmd_size & 1)
+			{
+				sum += data[cmd_size - 1];
+			}
+		}
+		partbin_sq_copy(cmd_addr, data, cmd_size);
+	}
+	else
+	{
+		if(!udp_checksum)
+		{
+			SH4_aligned_memcpy((void*)cmd_addr, data, cmd_size);
+		}
+		else
+		{
+			sum = SH4_aligned_memcpy_csum((void*)cmd_addr, data, cmd_size, sum);
+		}
+
+		if(cached_dest)
+		{
+			CacheBlockPurge((void*)cmd_addr, (cmd_size + 31)/32 + 2); // +1 for misalignment, +1 again for prefetch
+		}
+	}
+
+	partbin_crc(cmd_addr, data, cmd_size);
+
+	if(!udp_checksum)
+	{
+		bin_info.map[partbin_index(cmd_addr)] = 1;
+		return 0;
+	}
+
+	/* checksum == 0xffff means checksum was really 0 */
+	if (udp_checksum == 0xffff)
+		udp_checksum = 0;
+
+	if(checksum_fold(sum) == udp_checksum)
 	{
-		index = (cmd_addr - bin_info.load_address) / 1024; // /1024 = >> 10
+		bin_info.map[partbin_index(cmd_addr)] = 1;
 	}
 	else
 	{
-		index = (cmd_addr - bin_info.load_address) / 1440; // /1440 = 64-bit multiplication trick
+		bin_info.map[partbin_index(cmd_addr)] = 0;
+		net_stats.udp_csum_bad++;
+	}
+
+	return 0;
+}
+
+// Fragmented PARTBINs (see process_fragment() in net.c) and PARTBINs over TCP
+// (see tcp.c) come in pieces, so they get handled in three steps.
+
+static void partbin_mark(unsigned int cmd_addr, unsigned int cmd_size, unsigned char received)
+{
+	unsigned int i = partbin_index(cmd_addr);
+	unsigned int last = partbin_index(cmd_addr + cmd_size - 1);
+
+	for(; i <= last; i++)
+	{
+		bin_info.map[i] = received;
+	}
+}
+
+// Checks the PARTBIN from the first piece. Everything it covers gets marked
+// missing until the last piece checks out, since the ones in between go over
+// whatever was there. Returns -1 if it can't be taken; fragments also need
+// LOADBIN to have agreed to them.
+int cmd_partbin_split_begin(command_t * command, unsigned int payload_size, int fragmented)
+{
+	unsigned int cmd_addr = ntohl(command->address);
+	unsigned int cmd_size = ntohl(command->size);
+
+	// Has to start on a chunk so the map lines up
+	if((fragmented && (!bulk_frags)) || (!cmd_size) || (cmd_size != payload_size) || (cmd_size > PARTBIN_FRAG_MAX)
+		|| (cmd_addr < bin_info.load_address) || (cmd_addr + cmd_size > bin_info.load_address + bin_info.load_size)
+		|| ((cmd_addr - bin_info.load_address) % 1440))
+	{
+		return -1;
 	}
 
-	bin_info.map[index] = 1;
+	partbin_mark(cmd_addr, cmd_size, 0);
+	return 0;
+}
+
+// Puts one piece of the payload in place, returning 'sum' with it
+// added in if csum is set
+unsigned int cmd_partbin_split_copy(unsigned int cmd_addr, unsigned char * data, unsigned int len, unsigned int sum, int csum)
+{
+	if(csum)
+	{
+		sum = SH4_aligned_memcpy_csum((void*)cmd_addr, data, len, sum);
+	}
+	else
+	{
+		SH4_aligned_memcpy((void*)cmd_addr, data, len);
+	}
+
+	if(cached_dest)
+	{
+		CacheBlockPurge((void*)cmd_addr, (len + 31)/32 + 2); // +1 for misalignment, +1 again for prefetch
+	}
+
+	partbin_crc(cmd_addr, data, len);
+
+	return sum;
+}
+
+// All of it arrived and the checksum was good
+void cmd_partbin_split_done(unsigned int cmd_addr, unsigned int cmd_size)
+{
+	partbin_mark(cmd_addr, cmd_size, 1);
 }
 
 void cmd_donebin(ip_header_t * ip, udp_header_t * udp, command_t * command)
@@ -214,6 +463,7 @@ void cmd_donebin(ip_header_t * ip, udp_header_t * udp, command_t * command)
 	memcpy(response, command, COMMAND_LEN);
 
 	unsigned int map_index_verify, payload_size;
+	unsigned int response_len = COMMAND_LEN;
 
 	// Legacy check for versions < 2.0.0
 	// Need to hardcode these divides so that GCC can optimize them out (and
@@ -234,6 +484,28 @@ void cmd_donebin(ip_header_t * ip, udp_header_t * udp, command_t * command)
 		if (!bin_info.map[i])
 			break;
 
+	// Everything's here, but with no per-packet checksums it still has to
+	// match the CRC dc-tool sent. Most of that CRC is normally done already
+	// (see partbin_crc()), only what came in out of order is left. If it
+	// doesn't match, ask for it all again; dc-tool will go back to checksummed
+	// packets.
+	unsigned int load_end = bin_info.load_address + bin_info.load_size;
+	if((i == map_index_verify) && bulk_nocsum && (bulk_crc_next < load_end))
+	{
+		bulk_crc = crc32_update(bulk_crc, (unsigned char *)bulk_crc_next, load_end - bulk_crc_next);
+		bulk_crc_next = load_end;
+	}
+
+	if((i == map_index_verify) && bulk_nocsum && (command_word(udp, command) != bulk_crc))
+	{
+		memset_zeroes_64bit(bin_info.map, BIN_INFO_MAP_SIZE/8);
+		bulk_nocsum = 0;
+		i = 0;
+
+		*(unsigned int *)response->data = htonl(BULK_CRC_FAILED);
+		response_len += 4;
+	}
+
 	if(i == map_index_verify)
 	{
 		response->address = 0;
@@ -245,9 +517,9 @@ void cmd_donebin(ip_header_t * ip, udp_header_t * udp, command_t * command)
 		response->size = htonl(min(bin_info.load_size - i * payload_size, payload_size));
 	}
 
-	make_ip(ntohl(ip->src), ntohl(ip->dest), UDP_H_LEN + COMMAND_LEN, IP_UDP_PROTOCOL, (ip_header_t *)(pkt_buf + ETHER_H_LEN), ip->packet_id);
-	make_udp(ntohs(udp->src), ntohs(udp->dest), COMMAND_LEN, (ip_header_t *)(pkt_buf + ETHER_H_LEN), (udp_header_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN));
-	bb->tx(pkt_buf, ETHER_H_LEN + IP_H_LEN + UDP_H_LEN + COMMAND_LEN);
+	make_ip(ntohl(ip->src), ntohl(ip->dest), UDP_H_LEN + response_len, IP_UDP_PROTOCOL, (ip_header_t *)(pkt_buf + ETHER_H_LEN), ip->packet_id);
+	make_udp(ntohs(udp->src), ntohs(udp->dest), response_len, (ip_header_t *)(pkt_buf + ETHER_H_LEN), (udp_header_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN));
+	net_tx_command(response_len);
 
 	if (!running) {
 		if (!booted)
@@ -260,8 +532,21 @@ void cmd_sendbinq(ip_header_t * ip, udp_header_t * udp, command_t * command)
 {
 	our_ip = ntohl(ip->dest);
 
+#if DCLOAD_TCP
+	// TCP takes care of checksums and lost packets, and sends it as the acks
+	// come back
+	if(tool_tcp)
+	{
+		tcp_tx_bin(ntohl(command->address), ntohl(command->size));
+		return;
+	}
+#endif
+
 	unsigned int payload_size, numpackets, i;
 	unsigned int bytes_thistime;
+	unsigned int sum;
+	unsigned int crc = 0;
+	udp_stream_t stream;
 
 	unsigned char *buffer = pkt_buf + ETHER_H_LEN + IP_H_LEN + UDP_H_LEN;
 	command_t * response = (command_t *)buffer;
@@ -290,6 +575,10 @@ void cmd_sendbinq(ip_header_t * ip, udp_header_t * udp, command_t * command)
 
 	memcpy(response->id, CMD_SENDBIN, 4);
 
+	// Only the payload, its length and the address change from packet to packet
+	udp_stream_init(&stream, ip_src, our_ip, udp_src, udp_dest, COMMAND_LEN + payload_size, (ip_header_t *)(pkt_buf + ETHER_H_LEN), (udp_header_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN), ip->packet_id);
+	stream.nocsum = command_word(udp, command) & BULK_NOCSUM;
+
 	for(i = 0; i < numpackets; i++)
 	{
 		if (bytes_left >= payload_size)
@@ -304,12 +593,24 @@ void cmd_sendbinq(ip_header_t * ip, udp_header_t * udp, command_t * command)
 
 		// cmd_addr needs to honor whatever dc-tool sends. Use P0 addresses for cache boost when reading from RAM.
 		// Something great for alignment reasons is that, in addition to being the max payload size, 1440 bytes is an even multiple of 32 bytes.
-		SH4_aligned_memcpy(to_p1(response->data), (void*)cmd_addr, bytes_thistime);
+		if(stream.nocsum)
+		{
+			// The CRC for DONEBIN gets done a packet at a time, while it's
+			// in the cache, rather than all at once at the end
+			SH4_aligned_memcpy(to_p1(response->data), (void*)cmd_addr, bytes_thistime);
+			crc = crc32_update(crc, to_p1(response->data), bytes_thistime);
+			sum = 0;
+		}
+		else
+		{
+			// The UDP checksum of the payload gets worked out as it's copied.
+			sum = SH4_aligned_memcpy_csum(to_p1(response->data), (void*)cmd_addr, bytes_thistime, 0);
+		}
 
 		response->address = htonl(cmd_addr);
 		response->size = htonl(bytes_thistime);
-		make_ip(ip_src, our_ip, UDP_H_LEN + COMMAND_LEN + bytes_thistime, IP_UDP_PROTOCOL, (ip_header_t *)(pkt_buf + ETHER_H_LEN), ip->packet_id);
-		make_udp(udp_src, udp_dest, COMMAND_LEN + bytes_thistime, (ip_header_t *)(pkt_buf + ETHER_H_LEN), (udp_header_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN));
+		sum = memsum_16bit(response, COMMAND_LEN/2, sum);
+		udp_stream_packet(&stream, COMMAND_LEN + bytes_thistime, sum);
 		bb->tx(pkt_buf, ETHER_H_LEN + IP_H_LEN + UDP_H_LEN + COMMAND_LEN + bytes_thistime);
 		cmd_addr += bytes_thistime;
 	}
@@ -317,9 +618,18 @@ void cmd_sendbinq(ip_header_t * ip, udp_header_t * udp, command_t * command)
 	memcpy(response->id, CMD_DONEBIN, 4);
 	response->address = 0;
 	response->size = 0;
-	make_ip(ip_src, our_ip, UDP_H_LEN + COMMAND_LEN, IP_UDP_PROTOCOL, (ip_header_t *)(pkt_buf + ETHER_H_LEN), ip->packet_id);
-	make_udp(udp_src, udp_dest, COMMAND_LEN, (ip_header_t *)(pkt_buf + ETHER_H_LEN), (udp_header_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN));
-	bb->tx(pkt_buf, ETHER_H_LEN + IP_H_LEN + UDP_H_LEN + COMMAND_LEN);
+
+	// dc-tool checks the whole thing against this instead
+	unsigned int response_len = COMMAND_LEN;
+	if(stream.nocsum)
+	{
+		*(unsigned int *)response->data = htonl(crc);
+		response_len += 4;
+		stream.nocsum = 0;
+	}
+
+	udp_stream_packet(&stream, response_len, memsum_16bit(response, response_len/2, 0));
+	net_tx_command(response_len);
 }
 
 void cmd_sendbin(ip_header_t * ip, udp_header_t * udp, command_t * command)
@@ -383,7 +693,7 @@ void cmd_version(ip_header_t * ip, udp_header_t * udp, command_t * command)
 
 	make_ip(ntohl(ip->src), ntohl(ip->dest), UDP_H_LEN + COMMAND_LEN + datalength, IP_UDP_PROTOCOL, (ip_header_t *)(pkt_buf + ETHER_H_LEN), ip->packet_id);
 	make_udp(ntohs(udp->src), dcload_syscall_port, COMMAND_LEN + datalength, (ip_header_t *)(pkt_buf + ETHER_H_LEN), (udp_header_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN));
-	bb->tx(pkt_buf, ETHER_H_LEN + IP_H_LEN + UDP_H_LEN + COMMAND_LEN + datalength);
+	net_tx_command(COMMAND_LEN + datalength);
 }
 
 void cmd_retval(ip_header_t * ip, udp_header_t * udp, command_t * command)
@@ -392,16 +702,22 @@ void cmd_retval(ip_header_t * ip, udp_header_t * udp, command_t * command)
 	{
 		bb->stop(); // Disable packet RX
 
-		unsigned char *buffer = pkt_buf + ETHER_H_LEN + IP_H_LEN + UDP_H_LEN;
-		command_t * response = (command_t *)buffer;
-		memcpy(response, command, COMMAND_LEN);
+		// dc-tool doesn't wait for this, so over TCP it'd only hold up the
+		// next syscall until it got acked
+		if(!tool_tcp)
+		{
+			unsigned char *buffer = pkt_buf + ETHER_H_LEN + IP_H_LEN + UDP_H_LEN;
+			command_t * response = (command_t *)buffer;
+			memcpy(response, command, COMMAND_LEN);
 
-		make_ip(ntohl(ip->src), ntohl(ip->dest), UDP_H_LEN + COMMAND_LEN, IP_UDP_PROTOCOL, (ip_header_t *)(pkt_buf + ETHER_H_LEN), ip->packet_id);
-		make_udp(ntohs(udp->src), ntohs(udp->dest), COMMAND_LEN, (ip_header_t *)(pkt_buf + ETHER_H_LEN), (udp_header_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN));
-		bb->tx(pkt_buf, ETHER_H_LEN + IP_H_LEN + UDP_H_LEN + COMMAND_LEN);
+			make_ip(ntohl(ip->src), ntohl(ip->dest), UDP_H_LEN + COMMAND_LEN, IP_UDP_PROTOCOL, (ip_header_t *)(pkt_buf + ETHER_H_LEN), ip->packet_id);
+			make_udp(ntohs(udp->src), ntohs(udp->dest), COMMAND_LEN, (ip_header_t *)(pkt_buf + ETHER_H_LEN), (udp_header_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN));
+			bb->tx(pkt_buf, ETHER_H_LEN + IP_H_LEN + UDP_H_LEN + COMMAND_LEN);
+		}
 
 		syscall_retval = ntohl(command->address);
 		syscall_data = command->data;
+		syscall_retsize = ntohl(command->size);
 		escape_loop = 1;
 	}
 }
@@ -429,7 +745,187 @@ void cmd_maple(ip_header_t * ip, udp_header_t * udp, command_t * command)
 
 	make_ip(ntohl(ip->src), ntohl(ip->dest), UDP_H_LEN + COMMAND_LEN + i, IP_UDP_PROTOCOL, (ip_header_t *)(pkt_buf + ETHER_H_LEN), ip->packet_id);
 	make_udp(ntohs(udp->src), ntohs(udp->dest), COMMAND_LEN + i, (ip_header_t *)(pkt_buf + ETHER_H_LEN), (udp_header_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN));
-	bb->tx(pkt_buf, ETHER_H_LEN + IP_H_LEN + UDP_H_LEN + COMMAND_LEN + i);
+	net_tx_command(COMMAND_LEN + i);
+}
+
+// Reads up to count MAPLEBATCH frames from data, and returns how many were
+// there in full
+static unsigned int maple_frames_parse(maple_frame_t *frames, unsigned int count, unsigned char *data, unsigned char *end)
+{
+	unsigned int n;
+
+	for(n = 0; (n < count) && (n < MAPLE_BATCH_MAX) && (data + MAPLEBATCH_FRAME_H_LEN <= end); n++)
+	{
+		frames[n].port = data[0];
+		frames[n].unit = data[1];
+		frames[n].cmd = data[2];
+		frames[n].datalen = data[3];
+		frames[n].resplen = data[4];
+		frames[n].data = data + MAPLEBATCH_FRAME_H_LEN;
+
+		data += MAPLEBATCH_FRAME_H_LEN + (data[3] << 2);
+		if(data > end)
+		{
+			break;
+		}
+	}
+
+	return n;
+}
+
+// The reply has the frame count in address (0 if the frames didn't parse or
+// didn't fit) and each frame's response room in order, as laid out by
+// maple_docmd_batch()
+void cmd_maplebatch(ip_header_t * ip, udp_header_t * udp, command_t * command)
+{
+	maple_frame_t frames[MAPLE_BATCH_MAX];
+	unsigned int count = ntohl(command->address);
+	unsigned char *buffer = pkt_buf + ETHER_H_LEN + IP_H_LEN + UDP_H_LEN;
+	command_t * response = (command_t *)buffer;
+	int i = -1;
+	void *res;
+
+	memcpy(response, command, COMMAND_LEN);
+
+	if(maple_frames_parse(frames, count, command->data, command->data + ntohl(command->size)) == count)
+	{
+		i = maple_docmd_batch(frames, count, &res);
+	}
+
+	if(i < 0)
+	{
+		i = 0;
+		count = 0;
+	}
+	else
+	{
+		// res is uncached, and has to stay that way: a cached copy of it would go
+		// stale with the next DMA
+		SH4_aligned_memcpy(to_p1(response->data), res, i);
+	}
+
+	response->address = htonl(count);
+	response->size = htonl(i);
+
+	make_ip(ntohl(ip->src), ntohl(ip->dest), UDP_H_LEN + COMMAND_LEN + i, IP_UDP_PROTOCOL, (ip_header_t *)(pkt_buf + ETHER_H_LEN), ip->packet_id);
+	make_udp(ntohs(udp->src), ntohs(udp->dest), COMMAND_LEN + i, (ip_header_t *)(pkt_buf + ETHER_H_LEN), (udp_header_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN));
+	net_tx_command(COMMAND_LEN + i);
+}
+
+// Replaces the subscription with the one in command, or just ends it if there
+// are no frames. The reply's address is the number of frames subscribed.
+void cmd_maplesub(ether_header_t * ether, ip_header_t * ip, udp_header_t * udp, command_t * command)
+{
+	maple_frame_t frames[MAPLE_BATCH_MAX];
+	unsigned int count = ntohl(command->address);
+	unsigned int size = ntohl(command->size);
+	unsigned char *buffer = pkt_buf + ETHER_H_LEN + IP_H_LEN + UDP_H_LEN;
+	command_t * response = (command_t *)buffer;
+
+	memcpy(response, command, COMMAND_LEN);
+
+	maplesub.count = 0;
+
+	// Updates only go out over UDP. Over TCP they'd get in the way of replies
+	// waiting to be acked in pkt_buf.
+	if(count && (!tool_tcp) && (size >= 4) && (size - 4 <= MAPLESUB_FRAMES_SIZE))
+	{
+		memcpy(maplesub.frames, command->data + 4, size - 4);
+
+		if((maple_frames_parse(frames, count, maplesub.frames, maplesub.frames + size - 4) == count) && (maple_batch_size(frames, count) >= 0))
+		{
+			maplesub.size = size - 4;
+			maplesub.ip = ntohl(ip->src);
+			maplesub.port = ntohs(udp->src);
+			maplesub.src_port = ntohs(udp->dest);
+			memcpy(maplesub.mac, ether->src, 6);
+			maplesub.seen = 0;
+			maplesub.interval = (unsigned long long int)ntohl(*(unsigned int *)command->data) * (PERFCOUNTER_SCALE / 1000);
+			maplesub.last = PMCR_RegRead(DCLOAD_PMCR) - maplesub.interval; // Due right away
+			maplesub.count = count;
+		}
+	}
+
+	response->address = htonl(maplesub.count);
+	response->size = 0;
+
+	make_ip(ntohl(ip->src), ntohl(ip->dest), UDP_H_LEN + COMMAND_LEN, IP_UDP_PROTOCOL, (ip_header_t *)(pkt_buf + ETHER_H_LEN), ip->packet_id);
+	make_udp(ntohs(udp->src), ntohs(udp->dest), COMMAND_LEN, (ip_header_t *)(pkt_buf + ETHER_H_LEN), (udp_header_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN));
+	net_tx_command(COMMAND_LEN);
+}
+
+// Called from the main loop while dcload is idle. Runs the subscribed frames
+// once the interval is up, and sends the subscriber the response room of each
+// one whose response changed, with a bit set for each in address.
+void maplesub_poll(void)
+{
+	maple_frame_t frames[MAPLE_BATCH_MAX];
+	ether_header_t * ether = (ether_header_t *)pkt_buf;
+	ip_header_t * ip = (ip_header_t *)(pkt_buf + ETHER_H_LEN);
+	udp_header_t * udp = (udp_header_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN);
+	command_t * update = (command_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN + UDP_H_LEN);
+	unsigned long long int now;
+	unsigned int i, room, crc, changed = 0, len = 0;
+	unsigned char *res;
+
+	if(__builtin_expect(!maplesub.count, 1))
+	{
+		return;
+	}
+
+	// A DHCP ACK restarts the counter, which just makes this due
+	now = PMCR_RegRead(DCLOAD_PMCR);
+	if((now >= maplesub.last) && (now - maplesub.last < maplesub.interval))
+	{
+		return;
+	}
+
+#if DCLOAD_TCP
+	// pkt_buf has a reply in it that still might need resending
+	if(tcp_tx_pending())
+	{
+		return;
+	}
+#endif
+
+	maplesub.last = now;
+
+	maple_frames_parse(frames, maplesub.count, maplesub.frames, maplesub.frames + maplesub.size);
+	if(maple_docmd_batch(frames, maplesub.count, (void **)&res) < 0)
+	{
+		return;
+	}
+
+	for(i = 0; i < maplesub.count; i++)
+	{
+		room = (1 + frames[i].resplen) << 2;
+		crc = crc32_update(0, res, room);
+
+		if(!(maplesub.seen & (1 << i)) || (crc != maplesub.last_crc[i]))
+		{
+			maplesub.last_crc[i] = crc;
+			memcpy(update->data + len, res, room);
+			len += room;
+			changed |= 1 << i;
+		}
+
+		res += room;
+	}
+	maplesub.seen |= changed;
+
+	if(!changed)
+	{
+		return;
+	}
+
+	memcpy(update->id, CMD_MAPLESUB, 4);
+	update->address = htonl(changed);
+	update->size = htonl(len);
+
+	make_ether(maplesub.mac, bb->mac, ether);
+	make_ip(maplesub.ip, our_ip, UDP_H_LEN + COMMAND_LEN + len, IP_UDP_PROTOCOL, ip, 0);
+	make_udp(maplesub.port, maplesub.src_port, COMMAND_LEN + len, ip, udp);
+	bb->tx(pkt_buf, ETHER_H_LEN + IP_H_LEN + UDP_H_LEN + COMMAND_LEN + len);
 }
 
 // The 6 performance counter control functions are:
@@ -628,7 +1124,91 @@ void cmd_pmcr(ip_header_t * ip, udp_header_t * udp, command_t * command)
 	// make_ether was run in net.c already
 	make_ip(ntohl(ip->src), ntohl(ip->dest), UDP_H_LEN + COMMAND_LEN + i, IP_UDP_PROTOCOL, (ip_header_t *)(pkt_buf + ETHER_H_LEN), ip->packet_id);
 	make_udp(ntohs(udp->src), ntohs(udp->dest), COMMAND_LEN + i, (ip_header_t *)(pkt_buf + ETHER_H_LEN), (udp_header_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN));
-	bb->tx(pkt_buf, ETHER_H_LEN + IP_H_LEN + UDP_H_LEN + COMMAND_LEN + i);
+	net_tx_command(COMMAND_LEN + i);
+}
+
+// Sends back net_stats as big endian words: the NETSTATS_COUNTERS counters in
+// struct order, then the per-command counts, then the per-command cycle counts
+// (high word first). The address field of the reply says how many commands
+// there are. If the address dc-tool sent is 1, the stats start over from 0 once
+// they're sent.
+void cmd_netstats(ip_header_t * ip, udp_header_t * udp, command_t * command)
+{
+	unsigned char *buffer = pkt_buf + ETHER_H_LEN + IP_H_LEN + UDP_H_LEN;
+	command_t * response = (command_t *)buffer;
+	unsigned int *out = (unsigned int *)response->data;
+	unsigned int *counters = (unsigned int *)&net_stats;
+	unsigned int i, datalength;
+
+	memcpy(response, command, COMMAND_LEN);
+
+	for(i = 0; i < NETSTATS_COUNTERS; i++)
+	{
+		*out++ = htonl(counters[i]);
+	}
+
+	for(i = 0; i < NETSTATS_CMDS; i++)
+	{
+		*out++ = htonl(net_stats.cmd_count[i]);
+	}
+
+	for(i = 0; i < NETSTATS_CMDS; i++)
+	{
+		*out++ = htonl((unsigned int)(net_stats.cmd_cycles[i] >> 32));
+		*out++ = htonl((unsigned int)net_stats.cmd_cycles[i]);
+	}
+
+	datalength = (unsigned int)((unsigned char *)out - response->data);
+	response->address = htonl(NETSTATS_CMDS);
+	response->size = htonl(datalength);
+
+	if(ntohl(command->address) == 1)
+	{
+		memset(&net_stats, 0, sizeof(net_stats));
+	}
+
+	make_ip(ntohl(ip->src), ntohl(ip->dest), UDP_H_LEN + COMMAND_LEN + datalength, IP_UDP_PROTOCOL, (ip_header_t *)(pkt_buf + ETHER_H_LEN), ip->packet_id);
+	make_udp(ntohs(udp->src), ntohs(udp->dest), COMMAND_LEN + datalength, (ip_header_t *)(pkt_buf + ETHER_H_LEN), (udp_header_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN));
+	net_tx_command(COMMAND_LEN + datalength);
+}
+
+// Sends back trace records (see trace.h), starting from record number address.
+// The reply's data is the low word of DCLOAD_PMCR right now, the number of
+// records written so far, and then the records as pairs of words, all big
+// endian. The reply's address is the number of its first record, and when
+// there are none left dc-tool has the lot. Fetching pauses recording; sending
+// size 1 instead empties the ring and starts it again.
+void cmd_trace(ip_header_t * ip, udp_header_t * udp, command_t * command)
+{
+	unsigned char *buffer = pkt_buf + ETHER_H_LEN + IP_H_LEN + UDP_H_LEN;
+	command_t * response = (command_t *)buffer;
+	unsigned int *out = (unsigned int *)response->data;
+	unsigned int first = ntohl(command->address);
+	unsigned int count = 0;
+	unsigned int datalength;
+
+	memcpy(response, command, COMMAND_LEN);
+
+	if(ntohl(command->size) == 1)
+	{
+		trace_clear();
+	}
+	else
+	{
+		trace_paused = 1;
+		count = trace_copy(&first, out + 2, TRACE_RECORDS_PER_REPLY);
+	}
+
+	out[0] = htonl((unsigned int)PMCR_RegRead(DCLOAD_PMCR));
+	out[1] = htonl(trace_head);
+	datalength = 8 + count * sizeof(trace_record_t);
+
+	response->address = htonl(first);
+	response->size = htonl(datalength);
+
+	make_ip(ntohl(ip->src), ntohl(ip->dest), UDP_H_LEN + COMMAND_LEN + datalength, IP_UDP_PROTOCOL, (ip_header_t *)(pkt_buf + ETHER_H_LEN), ip->packet_id);
+	make_udp(ntohs(udp->src), ntohs(udp->dest), COMMAND_LEN + datalength, (ip_header_t *)(pkt_buf + ETHER_H_LEN), (udp_header_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN));
+	net_tx_command(COMMAND_LEN + datalength);
 }
 
 /*
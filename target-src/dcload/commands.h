@@ -20,15 +20,65 @@ typedef struct __attribute__ ((packed, aligned(4))) {
 #define CMD_RETVAL   "RETV" /* return value */
 #define CMD_REBOOT   "RBOT" /* reboot */
 #define CMD_MAPLE    "MAPL" /* Maple packet */
+#define CMD_MAPLEBATCH "MAPB" /* Several maple packets in one DMA list */
+#define CMD_MAPLESUB "MAPS" /* Subscribe to maple responses */
 #define CMD_PMCR 		 "PMCR" /* Performance counter packet */
+#define CMD_NETSTATS "NSTA" /* network statistics */
+#define CMD_TRACE    "TRAC" /* packet trace records */
 
 #define COMMAND_LEN  12
 
+// Each frame of a MAPLEBATCH is port, unit, command, parameter longwords and
+// response longwords (1 byte each), 3 zero bytes, then the parameters
+#define MAPLEBATCH_FRAME_H_LEN 8
+// MAPLESUB is a 4-byte interval in milliseconds, then MAPLEBATCH frames with up
+// to this many bytes between them: enough for every unit to get a GETCOND with
+// its one parameter word
+#define MAPLESUB_FRAMES_SIZE (24 * (MAPLEBATCH_FRAME_H_LEN + 4))
+
+// Optional data word on LOADBIN, SENDBIN/SENDBINQ and their replies. dc-tool can
+// ask for bulk transfers to go out without UDP checksums (only worth it on a
+// direct cable or a switch it trusts), with the whole transfer checked by a
+// CRC-32 at DONEBIN time instead. If that ever fails dc-tool goes back to
+// per-packet checksums.
+#define BULK_NOCSUM      0x00000001
+#define BULK_CRC_FAILED  0x00000002
+// dc-tool can also send PARTBINs of up to PARTBIN_FRAG_MAX bytes (a multiple of
+// the 1440-byte chunk size) as one UDP datagram, which its IP stack splits into
+// fragments, so headers and per-packet overhead get paid once per 10 chunks.
+// The fragments come in back to back, and 10 full-size frames is about as many
+// as the BBA's 16kB RX ring holds (the LAN adapter's buffer is bigger).
+#define BULK_FRAGMENTS   0x00000004
+#define PARTBIN_FRAG_MAX (10 * 1440)
+
+// Which slot of net_stats.cmd_count/cmd_cycles each command is counted in. This
+// is also the order they go out in the CMD_NETSTATS reply, so dc-tool has to
+// agree with it.
+#define NETSTATS_CMD_PARTBIN  0
+#define NETSTATS_CMD_MAPLE    1
+#define NETSTATS_CMD_PMCR     2
+#define NETSTATS_CMD_DONEBIN  3
+#define NETSTATS_CMD_RETVAL   4
+#define NETSTATS_CMD_LOADBIN  5
+#define NETSTATS_CMD_SENDBINQ 6
+#define NETSTATS_CMD_SENDBIN  7
+#define NETSTATS_CMD_EXECUTE  8
+#define NETSTATS_CMD_VERSION  9
+#define NETSTATS_CMD_NETSTATS 10
+#define NETSTATS_CMD_TRACE    11
+#define NETSTATS_CMD_MAPLEBATCH 12
+#define NETSTATS_CMD_MAPLESUB 13
+#define NETSTATS_CMDS         14
+
 extern unsigned int tool_ip;
 extern unsigned char tool_mac[6];
 extern unsigned short tool_port;
 // Format is a uint, encoded like this: (major << 16) | (minor << 8) | patch
 extern unsigned int tool_version;
+// The command being handled came over TCP (see tcp.h), so replies go back that way
+extern unsigned int tool_tcp;
+// Same, but for the program EXEC started, so the console goes back that way too
+extern unsigned int tool_console_tcp;
 
 #define DCTOOL_MAJOR ((tool_version & 0x00ff0000) >> 16)
 #define DCTOOL_MINOR ((tool_version & 0x0000ff00) >> 8)
@@ -39,12 +89,21 @@ void cmd_execute(ether_header_t * ether, ip_header_t * ip, udp_header_t * udp, c
 void cmd_loadbin(ip_header_t * ip, udp_header_t * udp, command_t * command);
 void cmd_highspeed_partbin(udp_header_t * udp, unsigned int udp_data_size);
 void cmd_partbin(command_t * command);
+int cmd_partbin_csum(command_t * command, unsigned char * data, unsigned int sum, unsigned short udp_checksum, unsigned int payload_size);
+int cmd_partbin_split_begin(command_t * command, unsigned int payload_size, int fragmented);
+unsigned int cmd_partbin_split_copy(unsigned int cmd_addr, unsigned char * data, unsigned int len, unsigned int sum, int csum);
+void cmd_partbin_split_done(unsigned int cmd_addr, unsigned int cmd_size);
 void cmd_donebin(ip_header_t * ip, udp_header_t * udp, command_t * command);
 void cmd_sendbinq(ip_header_t * ip, udp_header_t * udp, command_t * command);
 void cmd_sendbin(ip_header_t * ip, udp_header_t * udp, command_t * command);
 void cmd_version(ip_header_t * ip, udp_header_t * udp, command_t * command);
 void cmd_retval(ip_header_t * ip, udp_header_t * udp, command_t * command);
 void cmd_maple(ip_header_t * ip, udp_header_t * udp, command_t * command);
+void cmd_maplebatch(ip_header_t * ip, udp_header_t * udp, command_t * command);
+void cmd_maplesub(ether_header_t * ether, ip_header_t * ip, udp_header_t * udp, command_t * command);
+void maplesub_poll(void);
 void cmd_pmcr(ip_header_t * ip, udp_header_t * udp, command_t * command);
+void cmd_netstats(ip_header_t * ip, udp_header_t * udp, command_t * command);
+void cmd_trace(ip_header_t * ip, udp_header_t * udp, command_t * command);
 
 #endif
@@ -33,6 +33,7 @@
 	.extern _gethostinfo
 	.extern _gdbpacket
 	.extern _rewinddir
+	.extern _mapleinput
 
 	.section .text
 	.global	start
@@ -66,6 +67,13 @@ uint_to_string_k:
 exc_to_string_k:
 	.long _exception_code_to_string
 
+! last DHCP lease (dhcp_lease_cache_t in dhcp.h). The 1st_read loader puts this
+! back after it reloads dcload, so it has to stay at 0x8c004020 and 32 bytes.
+
+	.global _dhcp_lease_cache
+_dhcp_lease_cache:
+	.long 0, 0, 0, 0, 0, 0, 0, 0
+
 ! end of dcload hardcoded stuff
 
 realstart:
@@ -181,7 +189,7 @@ _dcloadsyscall:
 	mov	r6,r5
 	mov	r7,r6
 
-	mov	#22,r1 ! There are 22 syscalls
+	mov	#22,r1 ! There are 23 syscalls, 0-22
 	cmp/hs	r0,r1 ! Check r1 >= r0 ?
 	bf	badsyscall
 
@@ -247,3 +255,5 @@ gdbpacket_k:
 	.long _gdbpacket
 rewinddir_k:
 	.long _rewinddir
+mapleinput_k:
+	.long _mapleinput
@@ -27,6 +27,26 @@
 // String color (0xffff = white)
 #define STR_COLOR 0xffff
 
+// CDFS redirection reads are asynchronous, like a real GD-ROM: the program
+// gets "busy" back and the data streams in whenever it polls the GD-ROM
+// syscalls. This is how long each poll may spend servicing the network, in
+// microseconds. Longer transfers faster, shorter gives more time back to the
+// program between polls.
+#define CDFS_ASYNC_SLICE_US 2000
+
+// CDFS read-ahead staging area. When dc-tool detects a program reading the
+// disc sequentially (or has a prefetch plan, dc-tool -P), the sectors after
+// each read get pushed here ahead of time so the next read can be served
+// locally. This memory has to be left alone by the program being run, so it's
+// off by default: set CDFS_STAGING_SIZE in Makefile.cfg to turn it on. It ends
+// at CDFS_STAGING_END, which by default is 64kB short of the top of RAM to
+// leave room for a stack up there.
+#ifndef CDFS_STAGING_SIZE
+#define CDFS_STAGING_SIZE 0
+#endif
+#define CDFS_STAGING_END 0x8cff0000
+#define CDFS_STAGING_ADDR (CDFS_STAGING_END - CDFS_STAGING_SIZE)
+
 // -- WARNING: --
 //
 // The below definitions are for configuring specific system functionality.
@@ -32,6 +32,8 @@
 // Need to uniquely identify renewal in build_send_dhcp_packet(),
 // so for internal purposes use an invalid DHCP type for that.
 #define DHCP_RENEW_TYPE 0
+// Same deal for INIT-REBOOT, which is a DHCP Request for the cached lease
+#define DHCP_INIT_REBOOT_TYPE 0xff
 // For a list of all valid DHCP message type values, see:
 // https://www.iana.org/assignments/bootp-dhcp-parameters/bootp-dhcp-parameters.xhtml#message-type-53
 // Some of them are implemented in dhcp.h by virtue of KOS.
@@ -52,8 +54,20 @@
 // Minimum size in bytes for the DHCP options area
 #define DHCP_MIN_OPTIONS_SIZE 64
 
+// The lease cache goes through P2 so that none of it is left dirty in the
+// operand cache if the console gets reset
+#define LEASE_CACHE ((dhcp_lease_cache_t *)((unsigned int)&dhcp_lease_cache | 0xa0000000))
+// AICA RTC, seconds split into two 16-bit halves
+#define RTC_HIGH ((volatile unsigned int *)0xa0710000)
+#define RTC_LOW ((volatile unsigned int *)0xa0710004)
+
 static unsigned int get_some_time(int which);
+static unsigned int rtc_seconds(void);
+static int lease_cache_valid(void);
+static void lease_cache_save(void);
+static void lease_cache_forget(void);
 static void build_send_dhcp_packet(unsigned char kind);
+static int dhcp_has_option(dhcp_pkt_t *pkt, uint8 opt, int len);
 static int kos_net_dhcp_fill_options(unsigned char *bbmac, dhcp_pkt_t *req, uint8 msgtype);
 static int kos_net_dhcp_get_message_type(dhcp_pkt_t *pkt, int len);
 static uint32 kos_net_dhcp_get_32bit(dhcp_pkt_t *pkt, uint8 opt, int len); // Returns BE networking packet values converted to LE format (well, uint32 format, which is endian-agnostic from C code perspective)
@@ -65,6 +79,7 @@ static unsigned int dhcpoffer_xid = 0; // BE
 volatile unsigned int dhcp_lease_time = 0; // LE
 static unsigned int renewal_increment = 0;
 
+static unsigned char dhcp_state = DHCP_STATE_INIT; // Only SELECTING and REBOOTING matter
 static unsigned char dhcp_acked = 0;
 static unsigned char dhcp_renewal = 0;
 static unsigned char dhcp_renewal_nak = 0;
@@ -108,6 +123,54 @@ static unsigned int get_some_time(int which)
 	return (time_array[1] << 16 | time_array[0] >> 16);
 }
 
+// The perf counters start over on every boot, but the RTC keeps going, so lease
+// expiry across a reset is measured with it
+static unsigned int rtc_seconds(void)
+{
+	unsigned int first, second;
+
+	// Read until two reads agree so a carry between the halves can't be caught
+	// halfway through
+	do {
+		first = ((*RTC_HIGH & 0xffff) << 16) | (*RTC_LOW & 0xffff);
+		second = ((*RTC_HIGH & 0xffff) << 16) | (*RTC_LOW & 0xffff);
+	} while(first != second);
+
+	return first;
+}
+
+static int lease_cache_valid(void)
+{
+	dhcp_lease_cache_t *cache = LEASE_CACHE;
+
+	return (cache->magic == DHCP_LEASE_CACHE_MAGIC)
+		&& (cache->crc == crc32_update(0, (unsigned char *)cache, sizeof(dhcp_lease_cache_t) - 4))
+		&& (!memcmp(cache->mac, bb->mac, 6))
+		&& (cache->ip)
+		&& (rtc_seconds() < cache->expiry);
+}
+
+// Called on every ACK, so renewals keep the expiry current
+static void lease_cache_save(void)
+{
+	dhcp_lease_cache_t *cache = LEASE_CACHE;
+	unsigned int now = rtc_seconds();
+
+	cache->magic = DHCP_LEASE_CACHE_MAGIC;
+	cache->ip = dhcpoffer_ip_from_pkt;
+	cache->server_ip = dhcpoffer_server_ip_from_pkt;
+	// An infinite lease is 0xffffffff, which this clamps to
+	cache->expiry = (dhcp_lease_time > ~now) ? 0xffffffff : now + dhcp_lease_time;
+	memcpy(cache->mac, bb->mac, 6);
+	memset(cache->pad, 0, sizeof(cache->pad));
+	cache->crc = crc32_update(0, (unsigned char *)cache, sizeof(dhcp_lease_cache_t) - 4);
+}
+
+static void lease_cache_forget(void)
+{
+	LEASE_CACHE->magic = 0;
+}
+
 // Steps 1 & 3 and part of 5 are handled here, called by dhcp_go() and dhcp_renew()
 static void build_send_dhcp_packet(unsigned char kind)
 {
@@ -123,7 +186,7 @@ static void build_send_dhcp_packet(unsigned char kind)
 	// Make the packet data
 	kos_net_dhcp_fill_options(bb->mac, (dhcp_pkt_t*)dhcp_out_pkt, kind);
 
-	if(kind == DHCP_MSG_DHCPDISCOVER)
+	if((kind == DHCP_MSG_DHCPDISCOVER) || (kind == DHCP_INIT_REBOOT_TYPE))
 	{
 		bb->start(); // Accept broadcast packets and physical match packets (definitely need these!
 		// It's already run by rtl_init in bb_init, but it doesn't do anything to have it here just in case for future DHCP renewal purposes)
@@ -157,6 +220,7 @@ static void build_send_dhcp_packet(unsigned char kind)
 int handle_dhcp_reply(unsigned char *routersrcmac, dhcp_pkt_t* pkt_data, unsigned short len)
 {
 	int msg_type = kos_net_dhcp_get_message_type(pkt_data, len);
+	int rapid_commit = 0;
 
 	if(msg_type == DHCP_MSG_DHCPOFFER) // DHCP OFFER is 342 bytes
 	{
@@ -177,8 +241,14 @@ int handle_dhcp_reply(unsigned char *routersrcmac, dhcp_pkt_t* pkt_data, unsigne
 	}
 	else if(msg_type == DHCP_MSG_DHCPACK) // DHCP ACK is 342 bytes
 	{
+		// An ACK straight after DISCOVER is a Rapid Commit, and has to say so
+		if(dhcp_state == DHCP_STATE_SELECTING)
+		{
+			rapid_commit = dhcp_has_option(pkt_data, DHCP_OPTION_RAPID_COMMIT, len);
+		}
+
 		// Verify that IP address matches and we're all done with this handshake!
-		if( (pkt_data->xid == dhcpoffer_xid) && ((dhcp_renewal == 1) || (ntohl(pkt_data->yiaddr) == dhcpoffer_ip_from_pkt)) )
+		if( (pkt_data->xid == dhcpoffer_xid) && ((dhcp_renewal == 1) || rapid_commit || ((dhcp_state != DHCP_STATE_SELECTING) && (ntohl(pkt_data->yiaddr) == dhcpoffer_ip_from_pkt))) )
 		{
 			//
 			// Ideally there would be an ARP done here to ensure that the provided IP address is not already taken
@@ -187,12 +257,24 @@ int handle_dhcp_reply(unsigned char *routersrcmac, dhcp_pkt_t* pkt_data, unsigne
 			// aren't working right on the network, etc.
 			//
 
-			if(dhcp_renewal)
+			if(dhcp_renewal || rapid_commit)
 			{
 				// Refresh IP with result from renewal
 				dhcpoffer_ip_from_pkt = ntohl(pkt_data->yiaddr); // This is where we get our IP address from for renewal
 			}
 
+			if(!dhcp_renewal)
+			{
+				// After a Rapid Commit or INIT-REBOOT there was no OFFER to get these
+				// from, and renewal needs them
+				unsigned int server_ip = kos_net_dhcp_get_32bit(pkt_data, DHCP_OPTION_SERVER_ID, len);
+				if(server_ip)
+				{
+					dhcpoffer_server_ip_from_pkt = server_ip;
+				}
+				memcpy(router_mac, routersrcmac, 6);
+			}
+
 			// Get the lease time from ACK
 			// dhcp_lease_time is usable in little endian
 			dhcp_lease_time = kos_net_dhcp_get_32bit(pkt_data, DHCP_OPTION_IP_LEASE_TIME, len);
@@ -205,6 +287,7 @@ int handle_dhcp_reply(unsigned char *routersrcmac, dhcp_pkt_t* pkt_data, unsigne
 			PMCR_Restart(DCLOAD_PMCR, PMCR_ELAPSED_TIME_MODE, PMCR_COUNT_RATIO_CYCLES);
 #endif
 			dhcp_acked = 1;
+			lease_cache_save();
 
 			return 0; // success
 		}
@@ -225,6 +308,14 @@ int handle_dhcp_reply(unsigned char *routersrcmac, dhcp_pkt_t* pkt_data, unsigne
 			// dhcp_acked will be 0, which will cause dhcp_renew to return -2 to dcload.c's set_ip_dhcp(),
 			// and that will start the discovery process.
 			dhcp_renewal_nak = 1;
+			lease_cache_forget();
+			return 0;
+		}
+
+		if(dhcp_state == DHCP_STATE_REBOOTING)
+		{
+			// The cached lease is no good any more. dhcp_go() carries on with
+			// DISCOVER once this returns.
 			return 0;
 		}
 
@@ -250,12 +341,33 @@ int handle_dhcp_reply(unsigned char *routersrcmac, dhcp_pkt_t* pkt_data, unsigne
 
 // DHCP process:
 //
+// Step 0: DHCP REQUEST for the cached lease, if there is one (INIT-REBOOT)
 // Step 1: DHCP DISCOVER packet
-// STEP 2: Wait for DHCP OFFER packet from router
+// STEP 2: Wait for DHCP OFFER packet from router (or an ACK via Rapid Commit)
 // STEP 3: DHCP REQUEST packet
 // STEP 4: Wait for DHCP ACK from router
 // STEP 5+: DHCP renewal
 
+// Step 0: a server that still has our lease ACKs this right away. A NAK or no
+// answer within the timeout means going through DISCOVER after all.
+static void dhcp_init_reboot(void)
+{
+	dhcp_state = DHCP_STATE_REBOOTING;
+	dhcpoffer_ip_from_pkt = LEASE_CACHE->ip;
+	dhcpoffer_server_ip_from_pkt = LEASE_CACHE->server_ip;
+
+	build_send_dhcp_packet(DHCP_INIT_REBOOT_TYPE);
+	bb->loop(0); // Wait for DHCP ACK (or NAK...)
+
+	dhcp_state = DHCP_STATE_INIT;
+
+	if(!dhcp_acked)
+	{
+		lease_cache_forget();
+		timeout_loop = 1; // DISCOVER gets its usual first timeout
+	}
+}
+
 int dhcp_go(unsigned int *dhcp_ip_address_buffer) // Address buffer comes in as little endian
 {
 	dhcp_acked = 0;
@@ -263,6 +375,12 @@ int dhcp_go(unsigned int *dhcp_ip_address_buffer) // Address buffer comes in as
 	dhcp_attempts = 0;
 	timeout_loop = 1;   // Initial timeout in secs for waiting for DHCP response
 
+	// Not when retrying after a NAK, though
+	if((dhcp_nest_counter == 1) && lease_cache_valid())
+	{
+		dhcp_init_reboot();
+	}
+
 	while(!dhcp_acked)  // Loop DHCP attempts until acked
 	{
 		dhcp_attempts++; // Increase the attempt count
@@ -270,9 +388,12 @@ int dhcp_go(unsigned int *dhcp_ip_address_buffer) // Address buffer comes in as
 		{
 			timeout_loop = (dhcp_attempts > 10 ? 30 : 3*(dhcp_attempts)); // Increase the timeout for the next attempt, max 30 secs
 		}
+		dhcp_state = DHCP_STATE_SELECTING;
 		build_send_dhcp_packet(DHCP_MSG_DHCPDISCOVER);
 		bb->loop(0); // Wait for DHCP OFFER packet
+		dhcp_state = DHCP_STATE_INIT;
 		if (timeout_loop < 0) continue; // If timed out waiting for DHCP OFFER, this will be -1, start over
+		if (dhcp_acked) break; // Rapid Commit, no need for the rest
  		build_send_dhcp_packet(DHCP_MSG_DHCPREQUEST);
 		bb->loop(0); // Wait for DHCP ACK (or NAK...)
 		if (timeout_loop < 0) continue; // If timed out waiting for DHCP ACK, this will be -1, start over
@@ -330,6 +451,37 @@ int dhcp_renew(unsigned int *dhcp_ip_address_buffer)
 	}
 }
 
+// Whether the options have opt at all, for ones like Rapid Commit that are empty
+static int dhcp_has_option(dhcp_pkt_t *pkt, uint8 opt, int len)
+{
+	int i;
+
+	len -= DHCP_H_LEN;
+
+	// Skip the magic cookie, same as the KOS functions below
+	for(i = 4; i < len;)
+	{
+		if(pkt->options[i] == opt)
+		{
+			return 1;
+		}
+		else if(pkt->options[i] == DHCP_OPTION_PAD)
+		{
+			++i;
+		}
+		else if(pkt->options[i] == DHCP_OPTION_END)
+		{
+			break;
+		}
+		else
+		{
+			i += pkt->options[i + 1] + 2;
+		}
+	}
+
+	return 0;
+}
+
 // The following functions are adapted from KOS, so they need to be licensed properly
 
 //==============================================================================
@@ -385,7 +537,8 @@ static int kos_net_dhcp_fill_options(unsigned char *bbmac, dhcp_pkt_t *req, uint
 		{
 			/* Fill in the initial DHCPDISCOVER packet */
 	    //req->hops = 0;
-	    req->xid = htonl(get_some_time(DCLOAD_PMCR) ^ 0xDEADBEEF);
+	    dhcpoffer_xid = htonl(get_some_time(DCLOAD_PMCR) ^ 0xDEADBEEF); // Kept for a Rapid Commit ACK
+	    req->xid = dhcpoffer_xid;
 	    //req->secs = 0;
 	    //req->flags = 0; // 0x0000 want unicast response, 0x8000 want broadcast response
 	    //req->ciaddr = 0;
@@ -408,6 +561,15 @@ static int kos_net_dhcp_fill_options(unsigned char *bbmac, dhcp_pkt_t *req, uint
 			serverid = dhcpoffer_server_ip_from_pkt;
 			reqip = dhcpoffer_ip_from_pkt;
 		}
+		else if(msgtype == DHCP_INIT_REBOOT_TYPE)
+		{
+			/* Fill in the INIT-REBOOT request (RFC 2131 section 4.3.2): broadcast,
+			   ciaddr 0, requested IP but no server identifier */
+			dhcpoffer_xid = htonl(get_some_time(DCLOAD_PMCR) ^ 0xDEADBEEF);
+			req->xid = dhcpoffer_xid;
+
+			reqip = dhcpoffer_ip_from_pkt;
+		}
 		else // Assume renewal (msgtype == 0)
 		{
 			dhcpoffer_xid = (get_some_time(DCLOAD_PMCR) ^ 0xDEADBEEF) + renewal_increment; // It's a DHCP Request with a unique transaction ID
@@ -439,7 +601,7 @@ static int kos_net_dhcp_fill_options(unsigned char *bbmac, dhcp_pkt_t *req, uint
     /* Message Type: DHCPDISCOVER or DHCPREQUEST */
     req->options[pos++] = DHCP_OPTION_MESSAGE_TYPE;
     req->options[pos++] = 1; /* Length = 1 */
-		if(!msgtype) // msgtype of 0 means DHCP renewal to this fill function
+		if((!msgtype) || (msgtype == DHCP_INIT_REBOOT_TYPE)) // msgtype of 0 means DHCP renewal to this fill function
 		{
 			req->options[pos++] = DHCP_MSG_DHCPREQUEST;
 		}
@@ -477,6 +639,12 @@ static int kos_net_dhcp_fill_options(unsigned char *bbmac, dhcp_pkt_t *req, uint
     req->options[pos++] = DHCP_OPTION_BROADCAST_ADDR;
     req->options[pos++] = DHCP_OPTION_INTERFACE_MTU;
 
+    if(msgtype == DHCP_MSG_DHCPDISCOVER) {
+        /* Rapid Commit: a server that does it sends the ACK straight away */
+        req->options[pos++] = DHCP_OPTION_RAPID_COMMIT;
+        req->options[pos++] = 0; /* Length = 0 */
+    }
+
     if(serverid) {
         /* Add the Server identifier option */
         req->options[pos++] = DHCP_OPTION_SERVER_ID;
@@ -188,6 +188,28 @@ typedef struct __attribute__((packed, aligned(4))) {
 
 #define DHCP_H_LEN 236
 
+// Rapid Commit (RFC 4039), which KOS' list above stops short of
+#define DHCP_OPTION_RAPID_COMMIT 80
+
+// The last lease dcload got, kept so that after a reset it can ask the server
+// for the same address again (INIT-REBOOT) instead of starting over with
+// DISCOVER. It lives at a fixed spot in dcload-crt0.s that the 1st_read loader
+// carries over when it reloads dcload, and is only trusted if the magic, CRC and
+// MAC address check out and the RTC says the lease hasn't run out yet.
+#define DHCP_LEASE_CACHE_MAGIC 0x4443484c // 'DCHL'
+
+typedef struct __attribute__((packed, aligned(4))) {
+	unsigned int magic;
+	unsigned int ip; // LE
+	unsigned int server_ip; // LE
+	unsigned int expiry; // RTC seconds
+	unsigned char mac[6]; // Adapter the lease was for
+	unsigned char pad[6];
+	unsigned int crc; // crc32_update() of everything above
+} dhcp_lease_cache_t;
+
+extern dhcp_lease_cache_t dhcp_lease_cache;
+
 extern volatile unsigned int dhcp_lease_time;
 extern unsigned char dhcp_nest_counter_maxed;
 extern unsigned int dhcp_attempts;
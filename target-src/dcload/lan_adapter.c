@@ -15,30 +15,21 @@
 #include "dhcp.h"
 #include "memfuncs.h"
 #include "perfctr.h"
+#include "trace.h"
+#include "tcp.h"
 
 // Here's a datasheet for the FUJITSU MB86967 chip:
 // https://pdf1.alldatasheet.com/datasheet-pdf/view/61702/FUJITSU/MB86967.html
 // Fun fact: Sega did not physically wire the upper 8 bits of the data transfer
 // bus, so although the MB86967 can do 16-bit data transfers, the pins are just
 // not hooked up to do it! So packets need to be transfered one byte at a time
-// to and from the LAN Adapter.
+// to and from the LAN Adapter. (No point setting the chip's 16-bit data port
+// mode, the other half of every word would just go nowhere.)
 //
 // Also, the LAN Adapter operates in ISA bus mode, not PC Card mode.
 //
 // --Moopthehedgehog
 
-// TEMP
-//#define LAN_LOOP_TIMING
-//#define LAN_TX_LOOP_TIMING
-//#define LAN_RX_LOOP_TIMING
-//#define LAN_FULL_TRIP_TIMING
-
-#ifdef LAN_LOOP_TIMING
-//#include "perfctr.h"
-static char uint_string_array[11] = {0};
-#endif
-// end TEMP
-
 adapter_t adapter_la = {
 	"LAN Adapter (HIT-0300)",
 	{ 0 },		// Mac address
@@ -82,6 +73,151 @@ static vuint8 *xpc = REGC(0xa0600000);
 #define REG(x) ( xpc[(x)*4 + 0x400] )
 #define REGW(x) ( xpc[(x)*4 + 0x400] )
 
+//
+// Data port (FIFO) transfers
+//
+// Every byte still needs its own access to the data port across the expansion
+// bus, and that's most of what it costs to move a packet. What these cut is
+// everything else: the RAM side goes 4 bytes per load/store instead of 1, and
+// the loop runs once per 32 bytes. The TRACE_RX_COPY and TRACE_TX events (see
+// trace.h) time these for each packet.
+//
+
+static inline unsigned int la_read_word(void)
+{
+	// Separate statements, so the 4 reads happen in order
+	unsigned int w = REG(8);
+	w |= REG(8) << 8;
+	w |= REG(8) << 16;
+	w |= REG(8) << 24;
+
+	return w;
+}
+
+static inline void la_write_word(unsigned int w)
+{
+	REGW(8) = w;
+	REGW(8) = w >> 8;
+	REGW(8) = w >> 16;
+	REGW(8) = w >> 24;
+}
+
+// Reads exactly len bytes from the data port into dest (anything more would be
+// the next packet's)
+static void la_fifo_read(unsigned char *dest, int len)
+{
+	unsigned int *d;
+
+	// Bytes up to the first 4-byte boundary one at a time
+	while(((unsigned int)dest & 3) && len)
+	{
+		*dest++ = REG(8);
+		len--;
+	}
+
+	d = (unsigned int *)dest;
+
+	while(len >= 32)
+	{
+		d[0] = la_read_word();
+		d[1] = la_read_word();
+		d[2] = la_read_word();
+		d[3] = la_read_word();
+		d[4] = la_read_word();
+		d[5] = la_read_word();
+		d[6] = la_read_word();
+		d[7] = la_read_word();
+		d += 8;
+		len -= 32;
+	}
+
+	while(len >= 4)
+	{
+		*d++ = la_read_word();
+		len -= 4;
+	}
+
+	dest = (unsigned char *)d;
+	while(len--)
+	{
+		*dest++ = REG(8);
+	}
+}
+
+static void la_fifo_write(const unsigned char *src, int len)
+{
+	const unsigned int *s;
+
+	while(((unsigned int)src & 3) && len)
+	{
+		REGW(8) = *src++;
+		len--;
+	}
+
+	s = (const unsigned int *)src;
+
+	while(len >= 32)
+	{
+		la_write_word(s[0]);
+		la_write_word(s[1]);
+		la_write_word(s[2]);
+		la_write_word(s[3]);
+		la_write_word(s[4]);
+		la_write_word(s[5]);
+		la_write_word(s[6]);
+		la_write_word(s[7]);
+		s += 8;
+		len -= 32;
+	}
+
+	while(len >= 4)
+	{
+		la_write_word(*s++);
+		len -= 4;
+	}
+
+	src = (const unsigned char *)s;
+	while(len--)
+	{
+		REGW(8) = *src++;
+	}
+}
+
+// Transmit completion
+//
+// A full-size frame is only on the wire for about 1.2ms at 10Mbit, so sleeping
+// 2ms between looks at TMT OK would leave the transmitter idle for longer than
+// it was busy. Instead this spins on it, each look being a slow expansion bus
+// read anyway. Only if the transmitter is still at it after LA_TX_SPIN_US
+// (a congested half-duplex link backing off, say) does it drop back to the
+// relaxed 2ms polling.
+#define LA_TX_SPIN_US 5000
+#define LA_TX_SPIN ((unsigned long long int)PERFCOUNTER_SCALE * LA_TX_SPIN_US / 1000000)
+
+static void la_tx_wait(void)
+{
+	unsigned long long int spin_start;
+
+	if(__builtin_expect(REG(0) & 0x80, 1)) // Usually done already
+	{
+		return;
+	}
+
+	spin_start = PMCR_RegRead(DCLOAD_PMCR);
+	while(!(REG(0) & 0x80))
+	{
+		if(__builtin_expect((PMCR_RegRead(DCLOAD_PMCR) - spin_start) > LA_TX_SPIN, 0))
+		{
+			net_stats.tx_stalls++;
+			while(!(REG(0) & 0x80))
+			{
+				net_sleep_ms(2);
+			}
+			break;
+		}
+	}
+}
+
 static void net_strobe_eeprom(void)
 {
 	REGW(16) = FE_B16_SELECT;
@@ -347,10 +483,7 @@ void la_bb_stop(void)
 	while (REG(10) & 0x7f)
 		net_sleep_ms(2);
 */
-	while(!(REG(0) & 0x80)) // wait for any prior transmit of all packets in transmit buffer to finish
-	{
-		net_sleep_ms(2);
-	}
+	la_tx_wait(); // wait for any prior transmit of all packets in transmit buffer to finish
 	// We could reset first_transmit, or we could leave the TMT OK bit high for the next time (better)
 
 	/* Disable all receive */
@@ -379,8 +512,9 @@ void la_bb_stop(void)
 } */
 
 /* Transmit a packet */
-/* Note that it's technically possible to queue up more than one packet
-   at a time for transmission, but this is the simple way. */
+/* The adapter runs in dual-bank mode: this packet gets written into the free
+   bank while the last one may still be going out of the other, and only then
+   is there a wait for that one to finish before this one is started. */
 int la_bb_tx(unsigned char *pkt, int len)
 {
 	int i;
@@ -411,10 +545,7 @@ int la_bb_tx(unsigned char *pkt, int len)
 
 	unsigned char *copyback_pkt = to_p1(pkt);
 
-// Tx time
-#ifdef LAN_TX_LOOP_TIMING
-		unsigned long long int first_array = PMCR_RegRead(DCLOAD_PMCR);
-#endif
+	TRACE(TRACE_TX, len);
 
 	/* Is the length less than the minimum? */
 	if(len < 60)
@@ -424,11 +555,7 @@ int la_bb_tx(unsigned char *pkt, int len)
 		REGW(8) = 00; // High byte (LE)
 
 		/* Write the packet */
-		for (i=0; i<len; i++)
-		{
-			//REGW(8) = pkt[i];
-			REGW(8) = copyback_pkt[i];
-		}
+		la_fifo_write(copyback_pkt, len);
 
 		// Pad with zeroes to 60 bytes
 		for (i=len; i<60; i++)
@@ -446,22 +573,10 @@ int la_bb_tx(unsigned char *pkt, int len)
 		REGW(8) = (len & 0x0700) >> 8;
 
 		/* Write the packet */
-		for (i=0; i<len; i++)
-		{
-			//REGW(8) = pkt[i];
-			REGW(8) = copyback_pkt[i];
-		}
+		la_fifo_write(copyback_pkt, len);
 	}
 
-// Tx time end
-#ifdef LAN_TX_LOOP_TIMING
-		unsigned long long int second_array = PMCR_RegRead(DCLOAD_PMCR);
-		unsigned int loop_difference = (unsigned int)(second_array - first_array);
-
-		clear_lines(222, 24, global_bg_color);
-		uint_to_string_dec(loop_difference, (char*)uint_string_array);
-		draw_string(30, 222, uint_string_array, STR_COLOR);
-#endif
+	TRACE(TRACE_TX | TRACE_END, len);
 
 	// This will be blocked on the first transmit because setting ENA DLC (REG(6) bit 0x80) clears TMT OK...
 	// So keep track of whether this is the first transmit or not
@@ -471,10 +586,7 @@ int la_bb_tx(unsigned char *pkt, int len)
 	}
 	else
 	{
-		while(!(REG(0) & 0x80)) // wait for prior transmit (in the other bank, since dcload uses dual-bank mode) to finish
-		{
-			net_sleep_ms(2);
-		}
+		la_tx_wait(); // wait for prior transmit (in the other bank, since dcload uses dual-bank mode) to finish
 		REGW(0) = 0x80; // clear transmit in progress
 	}
 
@@ -482,6 +594,7 @@ int la_bb_tx(unsigned char *pkt, int len)
 	REGW(10) = 0x80 | 1;	/* 1 packet, 0x80 = start */
 
 // For stats
+	net_stats.tx_frames++;
 //	total_pkts_tx++;
 	/* if (!running)
 		draw_total(); */
@@ -493,7 +606,7 @@ int la_bb_tx(unsigned char *pkt, int len)
 /* Check for received packets */
 static int la_bb_rx(void)
 {
-	int i, len, count;
+	int len, count;
 	unsigned short status;
 
 	DEBUG("bb_rx entered\r\n");
@@ -515,11 +628,6 @@ static int la_bb_rx(void)
 			return count;
 		}
 
-// Full loop timing
-#ifdef LAN_FULL_TRIP_TIMING
-    unsigned long long int first_array1 = PMCR_RegRead(DCLOAD_PMCR);
-#endif
-
 		/* Get the receive status byte */
 		status = REG(8);
 		(void)REG(8);
@@ -533,6 +641,7 @@ static int la_bb_rx(void)
 		if(__builtin_expect((status & 0x3e) != 0x20, 0))
 		{
 			DEBUG("bb_rx exited: error\r\n");
+			net_stats.rx_errors++;
 			return -1;
 		}
 
@@ -540,52 +649,33 @@ static int la_bb_rx(void)
 		if(__builtin_expect(len > RX_PKT_BUF_SIZE, 0))
 		{
 			DEBUG("bb_rx exited: big packet\r\n");
+			net_stats.rx_oversize++;
 			return -2;
 		}
 
 		unsigned char *copyback_current_pkt = to_p1(current_pkt); // copyback pkt in cached memory area
 
-// Rx time
-#ifdef LAN_RX_LOOP_TIMING
-			unsigned long long int first_array = PMCR_RegRead(DCLOAD_PMCR);
-#endif
+		TRACE(TRACE_RX, len);
+		TRACE(TRACE_RX_COPY, len);
 
-		// This loop is dumb, but we are able to max out the LAN adapter with it, so that's neat
-		for (i=0; i<len; i++)
-		{
-			//current_pkt[i] = REG(8);
-			copyback_current_pkt[i] = REG(8);
-		}
+		la_fifo_read(copyback_current_pkt, len);
 		// Ensure cached data is written to memory
 		CacheBlockWriteBack(to_p1(raw_current_pkt), (2 + len + 31)/32);
 
-// Rx time end
-#ifdef LAN_RX_LOOP_TIMING
-		unsigned long long int second_array = PMCR_RegRead(DCLOAD_PMCR);
-		unsigned int loop_difference = (unsigned int)(second_array - first_array);
-
-		clear_lines(246, 24, global_bg_color);
-		uint_to_string_dec(loop_difference, (char*)uint_string_array);
-		draw_string(30, 246, uint_string_array, STR_COLOR);
-#endif
+		TRACE(TRACE_RX_COPY | TRACE_END, len);
 
 		/* Submit it for processing */
+		TRACE(TRACE_PROCESS, len);
 		//process_pkt(current_pkt);
 		process_pkt(copyback_current_pkt);
+		TRACE(TRACE_PROCESS | TRACE_END, len);
 
 // For stats
 //		total_pkts_rx++;
 		/* if (!running)
 			draw_total(); */
 
-#ifdef LAN_FULL_TRIP_TIMING
-		unsigned long long int second_array1 = PMCR_RegRead(DCLOAD_PMCR);
-		unsigned int loop_difference1 = (unsigned int)(second_array1 - first_array1);
-
-		clear_lines(412, 24, global_bg_color);
-		uint_to_string_dec(loop_difference1, (char*)uint_string_array);
-		draw_string(30, 412, uint_string_array, STR_COLOR);
-#endif
+		TRACE(TRACE_RX | TRACE_END, len);
 	}
 
 	return count;
@@ -709,11 +799,17 @@ void la_bb_loop(int is_main_loop)
 		draw_string(126, 198, reg_agg_temp, STR_COLOR);
 #endif
 
+		// Resend anything over TCP that's gone unacked too long
+		TCP_POLL();
+
 		if(is_main_loop && lan_link_up) // Only want this to run in main loop
 		{
 			// Do we need to renew our IP address?
 			// This will override set_ip_from_file() if the ip is in the 0.0.0.0/8 range
 			set_ip_dhcp();
+
+			// Send a MAPLESUB subscriber whatever changed, if it's time
+			maplesub_poll();
 		}
 
 		if(timeout_loop > 0)
@@ -735,6 +831,11 @@ void la_bb_loop(int is_main_loop)
 				prev_loop_elapsed = loop_secs_elapsed;
 			}
 		}
+
+		if(loop_single_pass)
+		{
+			return; // Caller checks and clears escape_loop
+		}
 	}
 
 	DEBUG("bb_loop exited\r\n");
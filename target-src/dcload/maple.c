@@ -12,6 +12,7 @@
 #include "maple.h"
 //#include <string.h>
 #include "memfuncs.h"
+#include "dcload.h"
 
 #define MAPLE(x) (*((volatile unsigned long *)(0xa05f6c00+(x))))
 
@@ -54,6 +55,19 @@ void maple_wait_dma()
 __attribute__((aligned(32))) volatile unsigned char dmabuffer[MAPLE_DMA_SIZE]; // Here's a global array
 
 
+/*
+ * Sender and recipient address of a frame for port/unit, with
+ * recipient in the low 8 bits.
+ */
+static int maple_addr(int port, int unit)
+{
+  int from = port << 6;
+  int to = (port << 6) | (unit>0? ((1<<(unit-1))&0x1f) : 0x20);
+
+  return (from << 8) | to;
+}
+
+
 /*
  * Send a command to a device and wait for the response.
  *
@@ -67,13 +81,12 @@ __attribute__((aligned(32))) volatile unsigned char dmabuffer[MAPLE_DMA_SIZE]; /
 void *maple_docmd(int port, int unit, int cmd, int datalen, void *data)
 {
   unsigned int *sendbuf, *recvbuf;
-  int to, from;
+  int addr;
 
   port &= 3;
 
   /* Compute sender and recipient address */
-  from = port << 6;
-  to = (port << 6) | (unit>0? ((1<<(unit-1))&0x1f) : 0x20);
+  addr = maple_addr(port, unit);
 
   /* Max data length = 255 longs = 1020 bytes */
   if(datalen > 255)
@@ -105,26 +118,55 @@ void *maple_docmd(int port, int unit, int cmd, int datalen, void *data)
      address where the response frame will be stored.  If no response is
      received within the timeout period, -1 will be written to this address. */
 
-  /* Here we know only one frame should be send and received, so
-     the final message control bit will always be set...          */
-  *sendbuf++ = datalen | (port << 16) | 0x80000000; // NOTE: These 3 writes use the uncacheable area
+  /* The whole message can go out through the store queues: straight
+     to memory where the DMA will see it, in 32-byte bursts. Not while
+     a program's running though, it may be using them itself.        */
+  if(!running && SQ_usable())
+  {
+    volatile unsigned int *sq = SQ_open(sendbuf);
+    unsigned int header[3];
+    int i;
+
+    header[0] = datalen | (port << 16) | 0x80000000;
+    header[1] = ((unsigned int)recvbuf & 0x0fffffff);
+    header[2] = (cmd & 0xff) | (addr << 8) | (datalen << 24);
+
+    for(i = 0; i < datalen + 3; i++)
+    {
+      sq[i] = (i < 3) ? header[i] : ((unsigned int *)data)[i - 3];
 
-  /* Write address to receive buffer where the response frame should be put */
-  *sendbuf++ = ((unsigned int)recvbuf & 0x0fffffff);
+      if((i & 7) == 7)
+        SQ_send(&sq[i & ~7]);
+    }
 
-  /* Create the frame header.  The fields are assembled "backwards"
-     because of the Maple Bus big-endianness.                       */
-  *sendbuf++ = (cmd & 0xff) | (to << 8) | (from << 16) | (datalen << 24);
+    if(i & 7)
+      SQ_send(&sq[i & ~7]); // The rest of the last block is don't-care
 
-  /* Copy parameter data, if any */
-  if(datalen > 0)
+    SQ_wait();
+  }
+  else
   {
-//    memcpy(sendbuf, data, datalen << 2); // sendbuf is 32-byte aligned, offset by 12. data is 8-byte aligned, offset by 4 due to port, unit, cmd, & datalen
-    // So memcpy_32bit the first 4 bytes to make it all 8-byte aligned (remaining sendbuf will be 16-byte aligned and remaining data will be 8-byte aligned)
-    memcpy_32bit(sendbuf, data, 4/4);
-    SH4_aligned_memcpy(to_p1((void *)sendbuf + 4), to_p1((void *)data + 4), datalen - 1); // use copy-back memory area for speed boost
-    CacheBlockWriteBack(to_p1((void *)((unsigned int)sendbuf & ~0x1f)), ((datalen * 4) + 31)/32); // Synchronize memory with opcache in 32-byte blocks, sendbuf is already 32-byte aligned
-    // Need to do that so DMA sees the data in memory
+    /* Here we know only one frame should be send and received, so
+       the final message control bit will always be set...          */
+    *sendbuf++ = datalen | (port << 16) | 0x80000000; // NOTE: These 3 writes use the uncacheable area
+
+    /* Write address to receive buffer where the response frame should be put */
+    *sendbuf++ = ((unsigned int)recvbuf & 0x0fffffff);
+
+    /* Create the frame header.  The fields are assembled "backwards"
+       because of the Maple Bus big-endianness.                       */
+    *sendbuf++ = (cmd & 0xff) | (addr << 8) | (datalen << 24);
+
+    /* Copy parameter data, if any */
+    if(datalen > 0)
+    {
+//      memcpy(sendbuf, data, datalen << 2); // sendbuf is 32-byte aligned, offset by 12. data is 8-byte aligned, offset by 4 due to port, unit, cmd, & datalen
+      // So memcpy_32bit the first 4 bytes to make it all 8-byte aligned (remaining sendbuf will be 16-byte aligned and remaining data will be 8-byte aligned)
+      memcpy_32bit(sendbuf, data, 4/4);
+      SH4_aligned_memcpy(to_p1((void *)sendbuf + 4), to_p1((void *)data + 4), (datalen - 1) * 4); // use copy-back memory area for speed boost
+      CacheBlockWriteBack(to_p1((void *)((unsigned int)sendbuf & ~0x1f)), ((datalen * 4) + 31)/32); // Synchronize memory with opcache in 32-byte blocks, sendbuf is already 32-byte aligned
+      // Need to do that so DMA sees the data in memory
+    }
   }
 
   /* Frame is finished, and DMA list is terminated with the flag bit.
@@ -138,3 +180,106 @@ void *maple_docmd(int port, int unit, int cmd, int datalen, void *data)
   /* Return a pointer to the response frame */
   return recvbuf;
 }
+
+
+/*
+ * Size in bytes of the response area a batch of frames would need,
+ * or -1 if it doesn't fit in dmabuffer.
+ */
+int maple_batch_size(maple_frame_t *frames, int count)
+{
+  int i, send_longs = 0, recv_longs = 0;
+
+  if(count <= 0 || count > MAPLE_BATCH_MAX)
+    return -1;
+
+  for(i = 0; i < count; i++)
+  {
+    send_longs += 3 + frames[i].datalen;
+    recv_longs += 1 + frames[i].resplen;
+  }
+
+  if(recv_longs > 1024/4 || send_longs > (MAPLE_DMA_SIZE - 1024)/4)
+    return -1;
+
+  return recv_longs << 2;
+}
+
+
+/*
+ * Send a batch of commands in one DMA list and wait for all the
+ * responses.
+ *
+ * Each frame gets 1 + resplen longwords of response room, one after
+ * the other from the start of dmabuffer, in the order given, and the
+ * whole area is what comes back in *res. The frame header says how
+ * much of each frame's room the device actually used. Frames that
+ * come back with MAPLE_RESPONSE_AGAIN are sent again, on their own,
+ * until they don't.
+ *
+ * A device that answers with more than the room it was given runs
+ * over into the next frame's, so the caller had better know what to
+ * expect (GETCOND on a controller is 3 longwords, for instance).
+ *
+ * Returns the size of the response area in bytes, or -1 if the
+ * frames don't fit in dmabuffer.
+ */
+int maple_docmd_batch(maple_frame_t *frames, int count, void **res)
+{
+  unsigned int *sendbuf, *recvbuf, *slot;
+  unsigned short slots[MAPLE_BATCH_MAX];   /* longwords into recvbuf */
+  unsigned char pending[MAPLE_BATCH_MAX];
+  int i, j, left, size;
+
+  if((size = maple_batch_size(frames, count)) < 0)
+    return -1;
+
+  for(i = 0, j = 0; i < count; i++)
+  {
+    slots[i] = j;
+    pending[i] = i; /* Everything goes in the first time around */
+    j += 1 + frames[i].resplen;
+  }
+
+  recvbuf = (unsigned int *) ((unsigned int)dmabuffer | 0xa0000000);
+  *res = recvbuf;
+  left = count;
+
+  while(left)
+  {
+    sendbuf = (unsigned int *) ((unsigned int)recvbuf + 1024);
+
+    maple_wait_dma();
+    MAPLE(0x04) = (unsigned int)sendbuf & 0x0fffffff;
+
+    /* Same message layout as maple_docmd(), with the last-message
+       flag only on the last one */
+    for(i = 0; i < left; i++)
+    {
+      maple_frame_t *frame = &frames[pending[i]];
+      int port = frame->port & 3;
+
+      *sendbuf++ = frame->datalen | (port << 16) | ((i == left - 1) ? 0x80000000 : 0);
+      *sendbuf++ = ((unsigned int)(recvbuf + slots[pending[i]]) & 0x0fffffff);
+      *sendbuf++ = (frame->cmd & 0xff) | (maple_addr(port, frame->unit) << 8) | (frame->datalen << 24);
+
+      for(j = 0; j < frame->datalen; j++)
+        *sendbuf++ = ((unsigned int *)frame->data)[j];
+    }
+
+    MAPLE(0x18) = 1;
+    maple_wait_dma();
+
+    /* Keep the ones that have to go again */
+    for(i = 0, j = 0; i < left; i++)
+    {
+      slot = recvbuf + slots[pending[i]];
+
+      if(*(char *)slot == MAPLE_RESPONSE_AGAIN)
+        pending[j++] = pending[i];
+    }
+    left = j;
+  }
+
+  return size;
+}
@@ -45,10 +45,28 @@ struct maple_devinfo {
 };
 
 
+/* One frame of a maple_docmd_batch() */
+typedef struct {
+  unsigned char port;
+  unsigned char unit;
+  unsigned char cmd;
+  unsigned char datalen;   /* longwords of parameter data */
+  unsigned char resplen;   /* longwords of room for the response data */
+  void *data;              /* parameter data (big endian!) */
+} maple_frame_t;
+
+/* Every unit on every port: the main unit and 5 sub units each */
+#define MAPLE_BATCH_MAX 24
+
+
 void maple_init(void);
 void maple_wait_dma(void);
 void *maple_docmd(int port, int unit, int cmd, int datalen, void *data);
+int maple_batch_size(maple_frame_t *frames, int count);
+int maple_docmd_batch(maple_frame_t *frames, int count, void **res);
 
-#define MAPLE_DMA_SIZE (1024 + 1024 + 4 + 4 + 4)
+// The send side is rounded up to whole 32-byte blocks, since that's what the
+// store queues write
+#define MAPLE_DMA_SIZE (1024 + ((1024 + 4 + 4 + 4 + 31) & ~31))
 
 extern __attribute__((aligned(32))) volatile unsigned char dmabuffer[MAPLE_DMA_SIZE];
@@ -355,6 +355,248 @@ void * SH4_aligned_memcpy(void *dest, void *src, unsigned int numbytes)
   return returnval;
 }
 
+//
+// Copy-and-checksum
+//
+// These move packet payloads and add them into an Internet checksum in the same
+// pass, so the data only gets touched once. Sums are "partial": any 32-bit
+// value that's congruent to the real one's complement sum mod 0xffff, so they
+// can be chained into each other and folded down to 16 bits once at the end
+// (see checksum_fold() in packet.c). Summing native 16-bit words like this
+// comes out the same regardless of byte order.
+//
+
+// Add 2 bytes at a time into a partial sum
+// Len is (# of total bytes/2), so it's "# of 16-bits"
+// Source must be 2-byte aligned
+// Good for up to 64kB on top of a sum this file returned.
+
+unsigned int memsum_16bit(const void *src, unsigned int len, unsigned int sum)
+{
+  const unsigned short *s = (unsigned short*)src;
+
+  while(len--)
+  {
+    sum += *s++;
+  }
+
+  return sum;
+}
+
+// 32-bit copy and sum, 32 bytes per loop
+// Len is (# of total bytes/32), so it's "# of 32-bytes"
+// Source and destination buffers must both be 4-byte aligned
+// Words are summed with addc so carries only need to be folded in once at the
+// end: each one out of the top is worth 2^32, which is 1 mod 0xffff.
+
+unsigned int memcpy_32bit_32Bytes_csum(void *dest, const void *src, unsigned int len, unsigned int sum)
+{
+  if(!len)
+  {
+    return sum;
+  }
+
+  unsigned int carries = 0;
+  unsigned int scratch, scratch2;
+
+  asm volatile (
+    "clrt\n" // (MT)
+  ".align 2\n"
+  "1:\n\t"
+    "mov.l @%[in]+, %[scratch]\n\t" // (LS)
+    "mov.l @%[in]+, %[scratch2]\n\t" // (LS)
+    "addc %[scratch], %[sum]\n\t" // (EX)
+    "mov.l %[scratch], @%[out]\n\t" // (LS)
+    "addc %[scratch2], %[sum]\n\t" // (EX)
+    "mov.l %[scratch2], @(4, %[out])\n\t" // (LS)
+    "mov.l @%[in]+, %[scratch]\n\t" // (LS)
+    "mov.l @%[in]+, %[scratch2]\n\t" // (LS)
+    "addc %[scratch], %[sum]\n\t" // (EX)
+    "mov.l %[scratch], @(8, %[out])\n\t" // (LS)
+    "addc %[scratch2], %[sum]\n\t" // (EX)
+    "mov.l %[scratch2], @(12, %[out])\n\t" // (LS)
+    "mov.l @%[in]+, %[scratch]\n\t" // (LS)
+    "mov.l @%[in]+, %[scratch2]\n\t" // (LS)
+    "addc %[scratch], %[sum]\n\t" // (EX)
+    "mov.l %[scratch], @(16, %[out])\n\t" // (LS)
+    "addc %[scratch2], %[sum]\n\t" // (EX)
+    "mov.l %[scratch2], @(20, %[out])\n\t" // (LS)
+    "mov.l @%[in]+, %[scratch]\n\t" // (LS)
+    "mov.l @%[in]+, %[scratch2]\n\t" // (LS)
+    "addc %[scratch], %[sum]\n\t" // (EX)
+    "mov.l %[scratch], @(24, %[out])\n\t" // (LS)
+    "addc %[scratch2], %[sum]\n\t" // (EX)
+    "mov.l %[scratch2], @(28, %[out])\n\t" // (LS)
+    "movt %[scratch]\n\t" // Last carry out of this block (EX)
+    "add %[scratch], %[carries]\n\t" // (EX)
+    "add #32, %[out]\n\t" // (EX)
+    "dt %[size]\n\t" // while(--len) (EX)
+    "bf.s 1b\n\t" // Branch is decided before the delay slot runs (BR)
+    " clrt\n" // Fresh carry for the next block (MT)
+    : [in] "+&r" ((unsigned int)src), [out] "+&r" ((unsigned int)dest), [size] "+&r" (len),
+    [sum] "+&r" (sum), [carries] "+&r" (carries), [scratch] "=&r" (scratch), [scratch2] "=&r" (scratch2) // outputs
+    : // inputs
+    : "t", "memory" // clobbers
+  );
+
+  // Partial fold so there's room for more to get added on
+  return (sum & 0xffff) + (sum >> 16) + carries;
+}
+
+// General-purpose copy-and-checksum function to call
+// Copies numbytes from src to dest and returns partial sum 'sum' with the data
+// added in. Same idea as SH4_aligned_memcpy(): one side is always a packet
+// buffer, which is aligned, and if the other side is too this will be a rocket.
+// Otherwise it's a regular copy followed by a sum over whichever side is at
+// least 2-byte aligned, or a byte-by-byte sum if neither is.
+unsigned int SH4_aligned_memcpy_csum(void *dest, void *src, unsigned int numbytes, unsigned int sum)
+{
+  unsigned int offset;
+  unsigned char *sum_src = (unsigned char *)src;
+
+  if( // Check 4-byte alignment for 32-byte copy and sum
+      ( !( ((unsigned int)src | (unsigned int)dest) & 0x03) )
+      &&
+      (numbytes >= 32)
+    )
+  {
+    sum = memcpy_32bit_32Bytes_csum(dest, src, numbytes >> 5, sum);
+    offset = numbytes & -32;
+    dest = (char *)dest + offset;
+    src = (char *)src + offset;
+    numbytes -= offset;
+    sum_src = (unsigned char *)src;
+  }
+
+  // Whatever's left
+  SH4_aligned_memcpy(dest, src, numbytes);
+  if((unsigned int)src & 0x01)
+  {
+    sum_src = (unsigned char *)dest;
+  }
+
+  if((unsigned int)sum_src & 0x01)
+  {
+    // Both sides are odd, so no 16-bit loads. Bytes at odd offsets are the
+    // high halves of the little-endian 16-bit words.
+    for(offset = 0; offset < numbytes; offset++)
+    {
+      sum += (offset & 1) ? (sum_src[offset] << 8) : sum_src[offset];
+    }
+
+    return sum;
+  }
+
+  sum = memsum_16bit(sum_src, numbytes >> 1, sum);
+  if(numbytes & 1)
+  {
+    sum += sum_src[numbytes - 1]; // The sum is a little-endian sum, so an odd byte will be an 8-bit int
+  }
+
+  return sum;
+}
+
+//
+// Store queues
+//
+// Each of the two 32-byte store queues gets filled with plain stores into the
+// 0xe0000000 area and then sent out as a single 32-byte burst by a pref on it,
+// without going anywhere near the operand cache. That's the fastest way to
+// write to anything uncacheable: P2 RAM, VRAM, G2 devices. With the MMU off,
+// address bits 25:5 of the destination come from the store queue address and
+// bits 28:26 come from QACR0/QACR1, so one call can't cross a 64MB boundary.
+// Programs may be using the store queues themselves, so check SQ_usable() and
+// only use these while dcload has the machine to itself.
+//
+
+// Returns where to store to for 32-byte aligned 'dest'. Store a block's worth
+// there, SQ_send() it, carry on with the next 32 bytes and so on, then
+// SQ_wait() before anything else looks at the destination.
+volatile unsigned int * SQ_open(void *dest)
+{
+  // QACRn bits 4:2 are external address bits 28:26, same for both queues
+  SQ_QACR0 = ((unsigned int)dest >> 24) & 0x1c;
+  SQ_QACR1 = ((unsigned int)dest >> 24) & 0x1c;
+
+  return (volatile unsigned int *)(0xe0000000 | ((unsigned int)dest & 0x03ffffe0));
+}
+
+void SQ_wait(void)
+{
+  // A store into a queue stalls until that queue's last burst has gone out,
+  // so one store into each of them waits for both
+  volatile unsigned int *d = (volatile unsigned int *)0xe0000000;
+
+  d[0] = 0;
+  d[8] = 0;
+}
+
+// 32 bytes at a time through the store queues
+// Len is (# of total bytes/32), so it's "# of 32 Bytes"
+// Destination must be 32-byte aligned, source must be 4-byte aligned
+
+void * SQ_memcpy(void *dest, const void *src, unsigned int len)
+{
+  if(!len)
+  {
+    return dest;
+  }
+
+  const unsigned int *s = (const unsigned int *)src;
+  volatile unsigned int *d = SQ_open(dest);
+
+  while(len--)
+  {
+    d[0] = s[0];
+    d[1] = s[1];
+    d[2] = s[2];
+    d[3] = s[3];
+    d[4] = s[4];
+    d[5] = s[5];
+    d[6] = s[6];
+    d[7] = s[7];
+    SQ_send(d); // Fire off this queue while the other one fills
+    d += 8;
+    s += 8;
+  }
+
+  SQ_wait();
+
+  return dest;
+}
+
+// Set 32 bytes of 'value' at a time through the store queues
+// Len is (# of total bytes/32), so it's "# of 32 Bytes"
+// Destination must be 32-byte aligned
+
+void * SQ_memset_32bit(void *dest, unsigned int value, unsigned int len)
+{
+  if(!len)
+  {
+    return dest;
+  }
+
+  volatile unsigned int *d = SQ_open(dest);
+
+  while(len--)
+  {
+    d[0] = value;
+    d[1] = value;
+    d[2] = value;
+    d[3] = value;
+    d[4] = value;
+    d[5] = value;
+    d[6] = value;
+    d[7] = value;
+    SQ_send(d);
+    d += 8;
+  }
+
+  SQ_wait();
+
+  return dest;
+}
+
 // Offset RAM buffer to BBA
 // 32 bytes per loop, takes full numbytes
 void * SH4_mem_to_pkt_X_movca_32(void *dest, void *src, unsigned int numbytes)
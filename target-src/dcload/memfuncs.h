@@ -17,6 +17,35 @@ int memcmp_32bit_eq(const void *str1, const void *str2, unsigned int count);
 
 void * SH4_aligned_memcpy(void *dest, void *src, unsigned int numbytes);
 
+unsigned int memsum_16bit(const void *src, unsigned int len, unsigned int sum);
+unsigned int memcpy_32bit_32Bytes_csum(void *dest, const void *src, unsigned int len, unsigned int sum);
+unsigned int SH4_aligned_memcpy_csum(void *dest, void *src, unsigned int numbytes, unsigned int sum);
+
+#define SQ_QACR0 (*(volatile unsigned int *)0xff000038)
+#define SQ_QACR1 (*(volatile unsigned int *)0xff00003c)
+#define SH4_MMUCR (*(volatile unsigned int *)0xff000010)
+
+volatile unsigned int * SQ_open(void *dest);
+void SQ_wait(void);
+void * SQ_memcpy(void *dest, const void *src, unsigned int len);
+void * SQ_memset_32bit(void *dest, unsigned int value, unsigned int len);
+
+// Burst out the store queue 'sq' points into
+static inline void SQ_send(volatile unsigned int *sq)
+{
+	asm volatile ("pref @%[ptr]\n"
+		: // outputs
+		: [ptr] "r" (sq) // inputs
+		: "memory" // clobbers memory
+	);
+}
+
+// The store queue functions only know MMU-off addressing
+static inline int SQ_usable(void)
+{
+	return !(SH4_MMUCR & 1); // MMUCR.AT
+}
+
 void * memcpy_32bit_16Bytes(void *dest, const void *src, unsigned int len);
 void * SH4_aligned_pktcpy(void *dest, void *src, unsigned int numbytes);
 
@@ -6,6 +6,9 @@
 #include "net.h"
 #include "dhcp.h"
 #include "memfuncs.h"
+#include "perfctr.h"
+#include "dcload.h" // DCLOAD_PMCR
+#include "tcp.h"
 
 static void process_broadcast(unsigned char *pkt);
 static void process_icmp(ether_header_t *ether, ip_header_t *ip, icmp_header_t *icmp);
@@ -20,6 +23,14 @@ __attribute__((aligned(32))) unsigned char raw_pkt_buf[RAW_TX_PKT_BUF_SIZE]; //
 // The performance gains are well worth the 2 wasted bytes.
 __attribute__((aligned(2))) unsigned char * pkt_buf = &(raw_pkt_buf[2]);
 
+net_stats_t net_stats = {0};
+
+static inline void netstats_cmd_done(unsigned int which, unsigned long long int start)
+{
+	net_stats.cmd_count[which]++;
+	net_stats.cmd_cycles[which] += PMCR_RegRead(DCLOAD_PMCR) - start;
+}
+
 static void process_broadcast(unsigned char *pkt) // arp request
 {
 	ether_header_t *ether_header = (ether_header_t *)pkt;
@@ -118,14 +129,10 @@ static void process_icmp(ether_header_t *ether, ip_header_t *ip, icmp_header_t *
 	}
 }
 
-static void process_udp(ether_header_t *ether, ip_header_t *ip, udp_header_t *udp)
+static ip_udp_pseudo_header_t * make_pseudo(ip_header_t *ip, udp_header_t *udp)
 {
-	ip_udp_pseudo_header_t *pseudo;
-	unsigned short i;
-	// Note that UDP's length field actually includes the UDP header, which is UDP_H_LEN
-	unsigned short udp_data_length = ntohs(udp->length) - UDP_H_LEN;
+	ip_udp_pseudo_header_t *pseudo = (ip_udp_pseudo_header_t *)to_p1(pseudo_array); // global small pseudo header array
 
-	pseudo = (ip_udp_pseudo_header_t *)to_p1(pseudo_array); // global small pseudo header array
 	pseudo->src_ip = ip->src;
 	pseudo->dest_ip = ip->dest;
 	pseudo->zero = 0;
@@ -136,9 +143,41 @@ static void process_udp(ether_header_t *ether, ip_header_t *ip, udp_header_t *ud
 	pseudo->length = udp->length;
 	pseudo->checksum = 0;
 
+	return pseudo;
+}
+
+static void process_udp(ether_header_t *ether, ip_header_t *ip, udp_header_t *udp)
+{
+	ip_udp_pseudo_header_t *pseudo;
+	unsigned short i;
+	// Note that UDP's length field actually includes the UDP header, which is UDP_H_LEN
+	unsigned short udp_data_length = ntohs(udp->length) - UDP_H_LEN;
+	unsigned long long int cmd_start = PMCR_RegRead(DCLOAD_PMCR);
+
+	pseudo = make_pseudo(ip, udp);
+
 	/* checksum == 0 means no checksum */
 	if (udp->checksum != 0)
+	{
+		// PARTBIN is the bulk of what comes in, so rather than walking the payload
+		// here and then again to copy it, the checksum gets verified as part of
+		// the copy
+		command_t *command = (command_t *)udp->data;
+
+		if (__builtin_expect((udp_data_length >= COMMAND_LEN) && (!memcmp_32bit_eq(command->id, CMD_PARTBIN, 4/4)), 1))
+		{
+			unsigned int sum = memsum_16bit(pseudo, PSEUDO_H_LEN/2, 0);
+			sum = memsum_16bit(command, COMMAND_LEN/2, sum);
+
+			if (!cmd_partbin_csum(command, to_p1(command->data), sum, udp->checksum, udp_data_length - COMMAND_LEN))
+			{
+				netstats_cmd_done(NETSTATS_CMD_PARTBIN, cmd_start);
+				return;
+			}
+		}
+
 		i = checksum_udp((unsigned short *)pseudo, (unsigned short *)udp->data, udp_data_length/2, udp_data_length%2); // integer divide; need to round up to next even number
+	}
 	else
 		i = 0;
 	/* checksum == 0xffff means checksum was really 0 */
@@ -148,6 +187,7 @@ static void process_udp(ether_header_t *ether, ip_header_t *ip, udp_header_t *ud
 	if (__builtin_expect(i != udp->checksum, 0))
 	{
 		/*    scif_puts("UDP CHECKSUM BAD\n"); */
+		net_stats.udp_csum_bad++;
 		return;
 	}
 
@@ -164,91 +204,275 @@ static void process_udp(ether_header_t *ether, ip_header_t *ip, udp_header_t *ud
 	}
 	else
 	{
-		command_t *command = (command_t *)udp->data;
+		tool_tcp = 0;
+		process_command(ether, ip, udp, cmd_start);
+	}
+}
 
-		// Only one of these will ever match at a time. What we can do is set this variable to 0 after compare succeeds.
-		// There is no id of 0, as they're all 4-character, non-null-terminated strings.
-		// Unfortunately packet headers are 42 bytes, which is NOT a multiple of 4. It is a multiple of 2, though, so we can do this without crashing:
-//		__attribute__((aligned(4))) unsigned int pkt_match_id = ((unsigned int) *(unsigned short*)&command->id[2] << 16) | (unsigned int) *(unsigned short*)command->id;
+void process_command(ether_header_t *ether, ip_header_t *ip, udp_header_t *udp, unsigned long long int cmd_start)
+{
+	unsigned int stat_cmd = NETSTATS_CMDS;
+	command_t *command = (command_t *)udp->data;
 
-		// We can do this now that the receive packet buffer has been aligned.
-		// All command structs are now aligned on a 4-byte boundary thanks to the shift-by-2 trick
-		unsigned int pkt_match_id = *(unsigned int*)command->id;
+	// Only one of these will ever match at a time. What we can do is set this variable to 0 after compare succeeds.
+	// There is no id of 0, as they're all 4-character, non-null-terminated strings.
+	// Unfortunately packet headers are 42 bytes, which is NOT a multiple of 4. It is a multiple of 2, though, so we can do this without crashing:
+//	__attribute__((aligned(4))) unsigned int pkt_match_id = ((unsigned int) *(unsigned short*)&command->id[2] << 16) | (unsigned int) *(unsigned short*)command->id;
 
-		// This one is the most likely to be called the most often, so put it first and tell GCC it's likely to be called
-		if (__builtin_expect((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_PARTBIN, 4/4)), 1))
-		{
-			// Handle legacy packets and v2.0.0+ packets <= 1460 bytes
-			cmd_partbin(command);
-			pkt_match_id = 0;
-		}
+	// We can do this now that the receive packet buffer has been aligned.
+	// All command structs are now aligned on a 4-byte boundary thanks to the shift-by-2 trick
+	unsigned int pkt_match_id = *(unsigned int*)command->id;
 
-		// Make ethernet header in transmit packet buffer since all below functions have a response packet
-		// (except reboot)
-		make_ether(ether->src, ether->dest, (ether_header_t *)pkt_buf);
+	// This one is the most likely to be called the most often, so put it first and tell GCC it's likely to be called
+	if (__builtin_expect((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_PARTBIN, 4/4)), 1))
+	{
+		// Handle legacy packets and v2.0.0+ packets <= 1460 bytes
+		cmd_partbin(command);
+		stat_cmd = NETSTATS_CMD_PARTBIN;
+		pkt_match_id = 0;
+	}
 
-		// Next likely to be called most often (e.g. during maple <--> PC comms)
-		if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_MAPLE, 4/4)))
-		{
-			cmd_maple(ip, udp, command);
-			pkt_match_id = 0;
-		}
+	// Make ethernet header in transmit packet buffer since all below functions have a response packet
+	// (except reboot)
+	make_ether(ether->src, ether->dest, (ether_header_t *)pkt_buf);
 
-		// Next likely to be called most often (e.g. using PC to do perf counting)
-		if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_PMCR, 4/4)))
-		{
-			cmd_pmcr(ip, udp, command);
-			pkt_match_id = 0;
-		}
+	// Next likely to be called most often (e.g. during maple <--> PC comms)
+	if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_MAPLE, 4/4)))
+	{
+		cmd_maple(ip, udp, command);
+		stat_cmd = NETSTATS_CMD_MAPLE;
+		pkt_match_id = 0;
+	}
 
-		if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_DONEBIN, 4/4)))
-		{
-			cmd_donebin(ip, udp, command);
-			pkt_match_id = 0;
-		}
+	if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_MAPLEBATCH, 4/4)))
+	{
+		cmd_maplebatch(ip, udp, command);
+		stat_cmd = NETSTATS_CMD_MAPLEBATCH;
+		pkt_match_id = 0;
+	}
 
-		if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_RETVAL, 4/4)))
-		{
-			cmd_retval(ip, udp, command);
-			pkt_match_id = 0;
-		}
+	if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_MAPLESUB, 4/4)))
+	{
+		cmd_maplesub(ether, ip, udp, command);
+		stat_cmd = NETSTATS_CMD_MAPLESUB;
+		pkt_match_id = 0;
+	}
 
-		if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_LOADBIN, 4/4)))
-		{
-			cmd_loadbin(ip, udp, command);
-			pkt_match_id = 0;
-		}
+	// Next likely to be called most often (e.g. using PC to do perf counting)
+	if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_PMCR, 4/4)))
+	{
+		cmd_pmcr(ip, udp, command);
+		stat_cmd = NETSTATS_CMD_PMCR;
+		pkt_match_id = 0;
+	}
 
-		if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_SENDBINQ, 4/4)))
-		{
-			cmd_sendbinq(ip, udp, command);
-			pkt_match_id = 0;
-		}
+	if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_DONEBIN, 4/4)))
+	{
+		cmd_donebin(ip, udp, command);
+		stat_cmd = NETSTATS_CMD_DONEBIN;
+		pkt_match_id = 0;
+	}
 
-		if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_SENDBIN, 4/4)))
+	if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_RETVAL, 4/4)))
+	{
+		cmd_retval(ip, udp, command);
+		stat_cmd = NETSTATS_CMD_RETVAL;
+		pkt_match_id = 0;
+	}
+
+	if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_LOADBIN, 4/4)))
+	{
+		cmd_loadbin(ip, udp, command);
+		stat_cmd = NETSTATS_CMD_LOADBIN;
+		pkt_match_id = 0;
+	}
+
+	if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_SENDBINQ, 4/4)))
+	{
+		cmd_sendbinq(ip, udp, command);
+		stat_cmd = NETSTATS_CMD_SENDBINQ;
+		pkt_match_id = 0;
+	}
+
+	if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_SENDBIN, 4/4)))
+	{
+		cmd_sendbin(ip, udp, command);
+		stat_cmd = NETSTATS_CMD_SENDBIN;
+		pkt_match_id = 0;
+	}
+
+	if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_EXECUTE, 4/4)))
+	{
+		// Doesn't come back if it starts a program, so count it going in
+		net_stats.cmd_count[NETSTATS_CMD_EXECUTE]++;
+		cmd_execute(ether, ip, udp, command);
+		pkt_match_id = 0;
+	}
+
+	if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_VERSION, 4/4)))
+	{
+		cmd_version(ip, udp, command);
+		stat_cmd = NETSTATS_CMD_VERSION;
+		pkt_match_id = 0;
+	}
+
+	if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_NETSTATS, 4/4)))
+	{
+		// Count this one before the reply is built, so it shows up in its own numbers
+		netstats_cmd_done(NETSTATS_CMD_NETSTATS, cmd_start);
+		cmd_netstats(ip, udp, command);
+		pkt_match_id = 0;
+	}
+
+	if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_TRACE, 4/4)))
+	{
+		cmd_trace(ip, udp, command);
+		stat_cmd = NETSTATS_CMD_TRACE;
+		pkt_match_id = 0;
+	}
+
+	if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_REBOOT, 4/4)))
+	{
+		// This function does not return
+		cmd_reboot();
+	}
+
+	if (stat_cmd < NETSTATS_CMDS)
+	{
+		netstats_cmd_done(stat_cmd, cmd_start);
+	}
+	else if (pkt_match_id)
+	{
+		net_stats.unknown_cmds++;
+	}
+}
+
+void net_tx_command(unsigned int len)
+{
+#if DCLOAD_TCP
+	if(tool_tcp)
+	{
+		tcp_tx_command(len);
+		return;
+	}
+#endif
+
+	bb->tx(pkt_buf, ETHER_H_LEN + IP_H_LEN + UDP_H_LEN + len);
+}
+
+// IP fragment reassembly
+//
+// Only for PARTBINs, and only once LOADBIN has agreed to BULK_FRAGMENTS. A
+// whole datagram won't fit anywhere in dcload, so nothing is buffered: each
+// fragment's share of the payload goes straight to where the PARTBIN says it
+// belongs, with the UDP checksum summed on the way and checked at the last
+// fragment. That needs the first fragment (the one with the UDP and command
+// headers) to come first, so one datagram is put together at a time and its
+// fragments have to arrive in order, which is how hosts send them and how a
+// LAN delivers them. Anything else drops the datagram, and the chunks it
+// would have filled get asked for again at DONEBIN time like any other lost
+// PARTBIN.
+
+static struct {
+	unsigned int active;
+	unsigned int src; // As it is in the IP header
+	unsigned short packet_id;
+	unsigned short udp_checksum;
+	unsigned int udp_length; // The whole datagram's
+	unsigned int next_offset; // Into the datagram, where the next fragment should start
+	unsigned int cmd_addr;
+	unsigned int sum;
+} frag = {0};
+
+#define FRAG_HEADERS_LEN (UDP_H_LEN + COMMAND_LEN)
+
+static void process_fragment(ip_header_t *ip, unsigned int ip_ihl)
+{
+	unsigned short flags_offset = ntohs(ip->flags_frag_offset);
+	unsigned int offset = (flags_offset & 0x1fff) * 8;
+	unsigned int more = flags_offset & 0x2000;
+	unsigned char *data = (unsigned char *)ip + 4*ip_ihl;
+	unsigned int len = ntohs(ip->length) - 4*ip_ihl;
+	unsigned long long int cmd_start = PMCR_RegRead(DCLOAD_PMCR);
+
+	if(ip->protocol != IP_UDP_PROTOCOL)
+	{
+		goto drop;
+	}
+
+	if(!offset)
+	{
+		udp_header_t *udp = (udp_header_t *)data;
+		command_t *command = (command_t *)udp->data;
+
+		// A new datagram means the last one isn't getting finished
+		frag.active = 0;
+
+		if((!more) || (len < FRAG_HEADERS_LEN) || (ntohs(udp->length) < FRAG_HEADERS_LEN)
+			|| memcmp_32bit_eq(command->id, CMD_PARTBIN, 4/4)
+			|| cmd_partbin_split_begin(command, ntohs(udp->length) - FRAG_HEADERS_LEN, 1))
 		{
-			cmd_sendbin(ip, udp, command);
-			pkt_match_id = 0;
+			goto drop;
 		}
 
-		if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_EXECUTE, 4/4)))
+		frag.active = 1;
+		frag.src = ip->src;
+		frag.packet_id = ip->packet_id;
+		frag.udp_checksum = udp->checksum;
+		frag.udp_length = ntohs(udp->length);
+		frag.cmd_addr = ntohl(command->address);
+		frag.sum = 0;
+
+		if(frag.udp_checksum)
 		{
-			cmd_execute(ether, ip, udp, command);
-			pkt_match_id = 0;
+			frag.sum = memsum_16bit(make_pseudo(ip, udp), PSEUDO_H_LEN/2, 0);
+			frag.sum = memsum_16bit(command, COMMAND_LEN/2, frag.sum);
 		}
 
-		if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_VERSION, 4/4)))
+		data += FRAG_HEADERS_LEN;
+		len -= FRAG_HEADERS_LEN;
+		frag.next_offset = FRAG_HEADERS_LEN;
+	}
+	else if((!frag.active) || (ip->src != frag.src) || (ip->packet_id != frag.packet_id) || (offset != frag.next_offset))
+	{
+		// Out of order, or another datagram's
+		frag.active = 0;
+		goto drop;
+	}
+
+	if((frag.next_offset + len > frag.udp_length) || ((!more) && (frag.next_offset + len != frag.udp_length)))
+	{
+		frag.active = 0;
+		goto drop;
+	}
+
+	frag.sum = cmd_partbin_split_copy(frag.cmd_addr + frag.next_offset - FRAG_HEADERS_LEN, data, len, frag.sum, frag.udp_checksum);
+	frag.next_offset += len;
+	net_stats.cmd_cycles[NETSTATS_CMD_PARTBIN] += PMCR_RegRead(DCLOAD_PMCR) - cmd_start;
+
+	if(!more)
+	{
+		frag.active = 0;
+
+		/* checksum == 0xffff means checksum was really 0 */
+		if(frag.udp_checksum == 0xffff)
+			frag.udp_checksum = 0;
+
+		if((!frag.udp_checksum) || (checksum_fold(frag.sum) == frag.udp_checksum))
 		{
-			cmd_version(ip, udp, command);
-			pkt_match_id = 0;
+			cmd_partbin_split_done(frag.cmd_addr, frag.udp_length - FRAG_HEADERS_LEN);
+			net_stats.cmd_count[NETSTATS_CMD_PARTBIN]++;
 		}
-
-		if ((pkt_match_id) && (!memcmp_32bit_eq(&pkt_match_id, CMD_REBOOT, 4/4)))
+		else
 		{
-			// This function does not return
-			cmd_reboot();
+			net_stats.udp_csum_bad++;
 		}
 	}
+
+	return;
+
+drop:
+	net_stats.ip_fragments++;
 }
 
 static void process_mine(unsigned char *pkt)
@@ -269,11 +493,6 @@ static void process_mine(unsigned char *pkt)
 		return;
 	}
 
-	/* ignore fragmented packets */
-
-	if(__builtin_expect(ip_header->flags_frag_offset & 0xff3f, 0))
-		return;
-
 	unsigned char ip_ihl = ip_header->version_ihl & 0x0f;
 
 	/* check ip header checksum */
@@ -281,7 +500,17 @@ static void process_mine(unsigned char *pkt)
 	ip_header->checksum = 0;
 	ip_header->checksum = checksum((unsigned short *)ip_header, 2*ip_ihl, 0); // 2*ip_ihl because unsigned shorts
 	if (i != ip_header->checksum)
+	{
+		net_stats.ip_csum_bad++;
 		return;
+	}
+
+	/* fragments: only fragmented PARTBINs get put back together */
+	if(__builtin_expect(ip_header->flags_frag_offset & 0xff3f, 0))
+	{
+		process_fragment(ip_header, ip_ihl);
+		return;
+	}
 
 	if(__builtin_expect(ip_header->protocol == IP_UDP_PROTOCOL, 1))
 	{
@@ -295,12 +524,67 @@ static void process_mine(unsigned char *pkt)
 		icmp_header = (icmp_header_t *)(pkt + ETHER_H_LEN + 4*ip_ihl);
 		process_icmp(ether_header, ip_header, icmp_header);
 	}
+#if DCLOAD_TCP
+	else if(ip_header->protocol == IP_TCP_PROTOCOL)
+	{
+		process_tcp(ether_header, ip_header, ip_ihl);
+	}
+#endif
+}
+
+// For adapters that can look at a frame's headers before copying the rest of
+// it out of the NIC. pkt only needs to hold the first PARTBIN_HEADERS_LEN bytes
+// and payload is where the rest of the frame can be read from. If it's a PARTBIN
+// for us that lands inside the binary being loaded, the payload goes straight
+// from there to its destination and this returns 1. Anything else returns 0
+// without having touched anything, and the frame should go through
+// process_pkt() as usual.
+int process_partbin_direct(unsigned char *pkt, unsigned char *payload, unsigned int pkt_size)
+{
+	ether_header_t *ether_header = (ether_header_t *)pkt;
+	ip_header_t *ip_header = (ip_header_t *)(pkt + ETHER_H_LEN);
+	udp_header_t *udp_header = (udp_header_t *)(pkt + ETHER_H_LEN + IP_H_LEN);
+	command_t *command = (command_t *)udp_header->data;
+	unsigned int sum;
+	unsigned long long int cmd_start = PMCR_RegRead(DCLOAD_PMCR);
+
+	if((pkt_size < PARTBIN_HEADERS_LEN) || (ether_header->type[0] != 0x08) || (ether_header->type[1] != 0x00))
+		return 0;
+
+	if(memcmp_32bit_eq(command->id, CMD_PARTBIN, 4/4) || memcmp_16bit_eq(ether_header->dest, bb->mac, 6/2))
+		return 0;
+
+	// No ip options, no fragments, and the frame has to hold all of it
+	if((ip_header->version_ihl != 0x45) || (ip_header->flags_frag_offset & 0xff3f) || (ip_header->protocol != IP_UDP_PROTOCOL))
+		return 0;
+
+	if(((unsigned int)(ETHER_H_LEN + ntohs(ip_header->length)) > pkt_size) || (ntohs(ip_header->length) != IP_H_LEN + ntohs(udp_header->length)) || (ntohs(udp_header->length) < UDP_H_LEN + COMMAND_LEN))
+		return 0;
+
+	/* check ip header checksum */
+	unsigned short i = ip_header->checksum;
+	ip_header->checksum = 0;
+	if (i != checksum((unsigned short *)ip_header, IP_H_LEN/2, 0))
+		return 0;
+	ip_header->checksum = i;
+
+	sum = memsum_16bit(make_pseudo(ip_header, udp_header), PSEUDO_H_LEN/2, 0);
+	sum = memsum_16bit(command, COMMAND_LEN/2, sum);
+
+	if(cmd_partbin_csum(command, payload, sum, udp_header->checksum, ntohs(udp_header->length) - UDP_H_LEN - COMMAND_LEN))
+		return 0;
+
+	net_stats.rx_frames++;
+	netstats_cmd_done(NETSTATS_CMD_PARTBIN, cmd_start);
+	return 1;
 }
 
 void process_pkt(unsigned char *pkt)
 {
 	ether_header_t *ether_header = (ether_header_t *)pkt;
 
+	net_stats.rx_frames++;
+
 	if (ether_header->type[0] != 0x08)
 		return;
 
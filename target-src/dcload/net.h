@@ -1,6 +1,8 @@
 #ifndef __NET_H__
 #define __NET_H__
 
+#include "commands.h" // NETSTATS_CMDS
+
 // Raw transmit buffer array size
 // 1514 bytes is not a multiple of 8.
 // Ethernet header (14) + ip header (20) + udp header (8) + command struct (12) = 54 bytes before command->data
@@ -22,8 +24,47 @@
 // ICMP Protocol Identifier
 #define IP_ICMP_PROTOCOL 1
 
-// This is the only function that needs to be exported
+// TCP Protocol Identifier
+#define IP_TCP_PROTOCOL 6
+
+// Ethernet + ip (no options) + udp headers + command struct, i.e. where a
+// PARTBIN's payload starts in a frame
+#define PARTBIN_HEADERS_LEN 54
+
+// Network statistics
+//
+// Kept as frames come and go, and handed to dc-tool by CMD_NETSTATS. The
+// per-command arrays are indexed by the NETSTATS_CMD_* numbers in commands.h,
+// and the cycle counts are DCLOAD_PMCR cycles from the UDP header being looked
+// at to the handler returning.
+#define NETSTATS_COUNTERS 10
+
+typedef struct {
+	unsigned int rx_frames;
+	unsigned int tx_frames;
+	unsigned int rx_errors; // Flagged bad by the adapter
+	unsigned int rx_oversize; // Too big for the receive buffer
+	unsigned int rx_overflows; // RTL8139 receive ring overflows, each one means a full rtl_init()
+	unsigned int ip_csum_bad;
+	unsigned int ip_fragments; // Dropped: not a fragmented PARTBIN, or out of order
+	unsigned int udp_csum_bad;
+	unsigned int tx_stalls; // Transmits that had to wait for the adapter to free up
+	unsigned int unknown_cmds;
+	unsigned int cmd_count[NETSTATS_CMDS];
+	unsigned long long int cmd_cycles[NETSTATS_CMDS];
+} net_stats_t;
+
+extern net_stats_t net_stats;
+
 void process_pkt(unsigned char *pkt);
+int process_partbin_direct(unsigned char *pkt, unsigned char *payload, unsigned int pkt_size);
+
+// Runs the command in udp->data, whichever way it came in. cmd_start is when it
+// started being looked at, for net_stats.
+void process_command(ether_header_t *ether, ip_header_t *ip, udp_header_t *udp, unsigned long long int cmd_start);
+// Sends the reply in pkt_buf (headers already made for UDP, len bytes after
+// them) back the way the command came in
+void net_tx_command(unsigned int len);
 
 extern const unsigned char broadcast[6]; // Used in DHCP code
 
@@ -1,5 +1,6 @@
 #include "packet.h"
 #include "memfuncs.h"
+#include "net.h"
 
 // The two checksums here are different because the UDP one needs a "pseudo-header," while the IP one doesn't
 unsigned short checksum(unsigned short *buf, int count, int is_odd)
@@ -62,6 +63,40 @@ unsigned short checksum_udp(unsigned short *buf_pseudo, unsigned short *buf_data
 	return ~(sum & 0xffff);
 }
 
+__attribute__((aligned(32))) static unsigned int crc32_table[256]; // Here's a global array
+
+unsigned int crc32_update(unsigned int crc, const unsigned char *buf, unsigned int len)
+{
+	unsigned int i, j, c;
+
+	if (__builtin_expect(!crc32_table[1], 0))
+	{
+		for (i = 0; i < 256; i++)
+		{
+			c = i;
+			for (j = 0; j < 8; j++)
+				c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+			crc32_table[i] = c;
+		}
+	}
+
+	crc = ~crc;
+	while (len--)
+		crc = crc32_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+// Fold a partial sum from the memfuncs copy-and-checksum functions down into a
+// finished 16-bit checksum
+unsigned short checksum_fold(unsigned int sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum;
+}
+
 void make_ether(unsigned char *dest, unsigned char *src, ether_header_t *ether)
 {
 	memcpy_16bit(ether->dest, dest, 6/2);
@@ -88,8 +123,7 @@ void make_ip(int dest, int src, int length, char protocol, ip_header_t *ip, unsi
 
 __attribute__((aligned(4))) unsigned char pseudo_array[PSEUDO_H_LEN]; // Here's a global array (not really global, but... search terms)
 
-// UDP packet length should always be an even number. It's the length of the UDP payload data specified by the 'data' variable.
-void make_udp(unsigned short dest, unsigned short src, int length, ip_header_t *ip, udp_header_t *udp)
+static ip_udp_pseudo_header_t * fill_udp(unsigned short dest, unsigned short src, int length, ip_header_t *ip, udp_header_t *udp)
 {
 	ip_udp_pseudo_header_t * pseudo = (ip_udp_pseudo_header_t*)pseudo_array;
 
@@ -108,7 +142,63 @@ void make_udp(unsigned short dest, unsigned short src, int length, ip_header_t *
 	pseudo->length = udp->length;
 	pseudo->checksum = 0;
 
+	return pseudo;
+}
+
+// UDP packet length should always be an even number. It's the length of the UDP payload data specified by the 'data' variable.
+void make_udp(unsigned short dest, unsigned short src, int length, ip_header_t *ip, udp_header_t *udp)
+{
+	ip_udp_pseudo_header_t * pseudo = fill_udp(dest, src, length, ip, udp);
+
 	udp->checksum = checksum_udp((unsigned short *)pseudo, (unsigned short *)udp->data, length/2, length%2);
 	if (udp->checksum == 0)
 		udp->checksum = 0xffff;
 }
+
+// Set up headers for a stream of UDP packets to the same place. 'length' is the
+// UDP payload length of the first packet, same as for make_udp().
+void udp_stream_init(udp_stream_t *stream, int dest_ip, int src_ip, unsigned short dest, unsigned short src, int length, ip_header_t *ip, udp_header_t *udp, unsigned short pkt_id)
+{
+	ip_udp_pseudo_header_t * pseudo;
+
+	make_ip(dest_ip, src_ip, UDP_H_LEN + length, IP_UDP_PROTOCOL, ip, pkt_id);
+	pseudo = fill_udp(dest, src, length, ip, udp);
+
+	// Lengths get added back in per packet
+	pseudo->udp_length = 0;
+	pseudo->length = 0;
+
+	stream->ip = ip;
+	stream->udp = udp;
+	stream->length = length;
+	stream->pseudo_sum = memsum_16bit(pseudo, PSEUDO_H_LEN/2, 0);
+	stream->nocsum = 0;
+}
+
+// Finish the headers for the next packet in a stream. 'data_sum' is the partial
+// sum (see memfuncs.c) of the UDP payload, usually from copying it in.
+void udp_stream_packet(udp_stream_t *stream, int length, unsigned int data_sum)
+{
+	if (length != stream->length)
+	{
+		unsigned short old_length = stream->ip->length;
+
+		stream->ip->length = htons(IP_H_LEN + UDP_H_LEN + length);
+		// RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m')
+		stream->ip->checksum = checksum_fold((unsigned short)~stream->ip->checksum + (unsigned short)~old_length + stream->ip->length);
+
+		stream->udp->length = htons(UDP_H_LEN + length);
+		stream->length = length;
+	}
+
+	if (stream->nocsum)
+	{
+		stream->udp->checksum = 0;
+		return;
+	}
+
+	// Length shows up twice, once in the pseudo header and once in the real one
+	stream->udp->checksum = checksum_fold(data_sum + stream->pseudo_sum + 2 * stream->udp->length);
+	if (stream->udp->checksum == 0)
+		stream->udp->checksum = 0xffff;
+}
@@ -45,6 +45,21 @@ typedef struct __attribute__ ((packed, aligned(4))) {
 
 #define ICMP_H_LEN 8
 
+typedef struct __attribute__ ((packed, aligned(4))) {
+	unsigned short src;
+	unsigned short dest;
+	unsigned int seq;
+	unsigned int ack;
+	unsigned char data_offset; // Header length in words, in the top 4 bits
+	unsigned char flags;
+	unsigned short window;
+	unsigned short checksum;
+	unsigned short urgent;
+	unsigned char options[]; // Make flexible array member
+} tcp_header_t;
+
+#define TCP_H_LEN 20
+
 typedef struct __attribute__ ((packed, aligned(8))) {
 	unsigned short hw_addr_space;
 	unsigned short proto_addr_space;
@@ -81,6 +96,27 @@ void make_ether(unsigned char *dest, unsigned char *src, ether_header_t *ether);
 void make_ip(int dest, int src, int length, char protocol, ip_header_t *ip, unsigned short pkt_id);
 void make_udp(unsigned short dest, unsigned short src, int length, ip_header_t *ip, udp_header_t *udp);
 
+// Same CRC-32 as zlib's crc32(), pass 0 to start
+unsigned int crc32_update(unsigned int crc, const unsigned char *buf, unsigned int len);
+
+// For sums from the memfuncs copy-and-checksum functions
+unsigned short checksum_fold(unsigned int sum);
+
+// Header templates for a run of UDP packets that only differ in payload and
+// length, like the SENDBIN stream. Headers get built once, then each packet is
+// just a length patch with an incremental IP checksum update (RFC 1624) and a
+// UDP checksum from the already-summed constant part of the pseudo header.
+typedef struct {
+	ip_header_t *ip;
+	udp_header_t *udp;
+	int length; // UDP payload length the headers are currently set up for
+	unsigned int pseudo_sum; // Partial sum of the pseudo header, lengths left out
+	int nocsum; // Send with a zero checksum, meaning "none"
+} udp_stream_t;
+
+void udp_stream_init(udp_stream_t *stream, int dest_ip, int src_ip, unsigned short dest, unsigned short src, int length, ip_header_t *ip, udp_header_t *udp, unsigned short pkt_id);
+void udp_stream_packet(udp_stream_t *stream, int length, unsigned int data_sum);
+
 #define ntohl bswap32
 #define htonl bswap32
 #define ntohs bswap16
@@ -13,20 +13,8 @@
 #include "dhcp.h"
 #include "memfuncs.h"
 #include "perfctr.h"
-
-// TEMP
-//#define LOOP_TIMING
-//#define TX_LOOP_TIMING
-//#define RX_LOOP_TIMING
-//#define PKT_PROCESS_TIMING
-//#define FULL_TRIP_TIMING
-
-#ifdef LOOP_TIMING
-//#include "perfctr.h"
-#include "video.h"
-static char uint_string_array[11] = {0};
-#endif
-// end TEMP
+#include "trace.h"
+#include "tcp.h"
 
 // Pull together all the goodies
 adapter_t adapter_bba = {
@@ -47,7 +35,9 @@ static volatile unsigned char rtl_is_copying = 0;
 
 static void rtl_reset(void);
 static void rtl_init(void);
+static void rtl_tx_reap(void);
 static void pktcpy(unsigned char *dest, unsigned char *src, unsigned int n);
+static int rtl_rx_direct(unsigned char *src, unsigned int n);
 static int rtl_bb_rx(void);
 
 // 8, 16, and 32 bit access to G2 addresses
@@ -75,6 +65,72 @@ static vuc * const txdesc[4] = {
 	REGC(GAPS_TX_IO_AREA + 0x7800)
 };
 
+#if BBA_G2_DMA
+// G2 DMA channel 3. Channel 0 belongs to the AICA, and 3 is the one programs
+// are least likely to be using.
+#define G2_DMA_CHAN 3
+
+// Per-channel registers, 0x20 apart from 0xa05f7800
+static vul * const g2dma = REGL(0xa05f7800 + G2_DMA_CHAN * 0x20);
+#define G2_DMA_G2_ADDR   0 // G2 side, 32-byte aligned
+#define G2_DMA_SH4_ADDR  1 // System memory side, 32-byte aligned
+#define G2_DMA_SIZE      2 // Multiple of 32, bit 31 set
+#define G2_DMA_DIR       3 // 0: system memory to G2, 1: G2 to system memory
+#define G2_DMA_TRIGGER   4 // 0: started by writing G2_DMA_START
+#define G2_DMA_ENABLE    5
+#define G2_DMA_START     6 // Reads back 1 while the transfer is running
+
+// Outgoing packets get copied into one of these first, which is cheap next to
+// the G2 bus, so the caller can build its next packet in pkt_buf while this
+// one is DMAed into GAPS.
+__attribute__((aligned(32))) static unsigned char tx_staging[2][RAW_TX_PKT_BUF_SIZE]; // Here's a global array.
+static unsigned int tx_staging_next = 0;
+// The descriptor DMA is filling, and the length to hand the chip once it's done (0 if none)
+static unsigned int tx_dma_slot = 0;
+static unsigned int tx_dma_len = 0;
+static unsigned char rtl_rx_on = 0;
+
+static void g2_dma_init(void)
+{
+	*(vul*)0xa05f7890 = 27; // SB_G2DSTO: DS# timeout, as KOS sets it
+	*(vul*)0xa05f78bc = 0x4659404f; // SB_G2APRO: G2 DMA may reach all of main RAM (0x4659 is the write key)
+}
+
+// Always goes through the GAPS DMA image, so point 0x142c at the right spot first
+static void g2_dma_start(unsigned int sh4_addr, unsigned int len, unsigned int to_sh4)
+{
+	g2dma[G2_DMA_G2_ADDR] = 0x01848000;
+	g2dma[G2_DMA_SH4_ADDR] = sh4_addr & 0x1fffffe0;
+	g2dma[G2_DMA_SIZE] = ((len + 31) & -32) | 0x80000000;
+	g2dma[G2_DMA_DIR] = to_sh4;
+	g2dma[G2_DMA_TRIGGER] = 0;
+	g2dma[G2_DMA_ENABLE] = 1;
+	g2dma[G2_DMA_START] = 1;
+}
+
+static void g2_dma_wait(void)
+{
+	while(g2dma[G2_DMA_START] & 1);
+
+	// Ack the end-of-DMA event (SB_ISTNRM) so a running program that has that
+	// interrupt enabled never hears about it
+	*(vul*)0xa05f6900 = 1 << (15 + G2_DMA_CHAN);
+}
+
+// Hands the packet DMA has been putting into its descriptor to the chip. Has
+// to happen before anything else moves the GAPS DMA image, and before dcload
+// stops polling the adapter.
+static void rtl_tx_dma_finish(void)
+{
+	if(tx_dma_len)
+	{
+		g2_dma_wait();
+		nic32[RT_TXSTATUS0/4 + tx_dma_slot] = tx_dma_len | 0x20000; // Set Early TX to 64 bytes
+		tx_dma_len = 0;
+	}
+}
+#endif
+
 int rtl_bb_detect(void)
 {
 	// This pointer's data is always aligned to 4 bytes--just look at the register address!
@@ -363,11 +419,24 @@ static void rtl_init(void)
 	nic16[RT_MII_BMCR/2] |= 0x9200;
 
 	/* Initialize status vars */
+#if BBA_G2_DMA
+	// A packet still on its way into GAPS is lost with the reset
+	if(tx_dma_len)
+	{
+		g2_dma_wait();
+		tx_dma_len = 0;
+	}
+#endif
+
 	rtl.cur_tx = 0;
+	rtl.dirty_tx = 0; // The reset handed all the descriptors back
 	rtl.cur_rx = 0;
 
 	/* Enable receiving broadcast and physical match packets */
 	nic32[RT_RXCONFIG/4] |= 0x0000000a;
+#if BBA_G2_DMA
+	rtl_rx_on = 1;
+#endif
 }
 
 int rtl_bb_init(void)
@@ -377,6 +446,10 @@ int rtl_bb_init(void)
 	// The BBA uses the range 0x01840000-0x0184ffff for TX and RX (with usage above
 	// 0x01848000 apparently for GAPS DMA), plus the 2 bytes at 0x0183fffc for... something
 
+#if BBA_G2_DMA
+	g2_dma_init();
+#endif
+
 	/* Initialize the "GAPS" PCI glue controller. */
 
 	// NOTE: Setting 0x5a14a500 turns off GAPS.
@@ -425,8 +498,17 @@ int rtl_bb_init(void)
 	g232[0x1414/4] = 0x00000001;
 
 	// Clear the GAPS area
-	memset_zeroes_64bit((void*)0x01840000, 32768/8);
-	CacheBlockPurge((void*)0x01840000, 32768/32); // Write back and invalidate the cache over that area since it's volatile
+	if(SQ_usable())
+	{
+		// Device memory is what the store queues are for, and it keeps 32kB of
+		// junk out of the cache
+		SQ_memset_32bit((void*)0x01840000, 0, 32768/32);
+	}
+	else
+	{
+		memset_zeroes_64bit((void*)0x01840000, 32768/8);
+		CacheBlockPurge((void*)0x01840000, 32768/32); // Write back and invalidate the cache over that area since it's volatile
+	}
 
 	// do this weird dance
 	// Appears to set and check some magic numbers to know if it's being initted properly...?
@@ -467,41 +549,66 @@ int rtl_bb_init(void)
 void rtl_bb_start(void)
 {
 	nic32[RT_RXCONFIG/4] |= 0x0000000a;
+#if BBA_G2_DMA
+	rtl_rx_on = 1;
+#endif
 }
 
 void rtl_bb_stop(void)
 {
 	nic32[RT_RXCONFIG/4] &= 0xfffffff5;
+#if BBA_G2_DMA
+	rtl_rx_on = 0;
+	rtl_tx_dma_finish();
+#endif
 }
 
-int rtl_bb_tx(unsigned char * pkt, int len) // pg. 15 in RTL8139C datasheet: http://realtek.info/pdf/rtl8139cp.pdf
+// Retires every queued packet the chip has finished DMAing out of its
+// descriptor, oldest first. One read of TSAD covers all four descriptors, so
+// this costs a single G2 access however many there are to reap.
+static void rtl_tx_reap(void)
 {
-	// According to KOS source we gotta wait for G2 FIFO to be empty by checking
-	// this bit before reading from/writing to G2. So do that here.
-	while((*(volatile unsigned int*)0xa05f688c) & 0x20U);
+	unsigned int tsad = nic16[RT_MII_TSAD/2];
+	unsigned int slot;
 
-	while (!(nic32[RT_TXSTATUS0/4 + rtl.cur_tx] & 0x2000U))
-	{ // While tx is not complete (checking OWN)
-		if (nic32[RT_TXSTATUS0/4 + rtl.cur_tx] & 0x40000000U)
-		{ // Check for abort
-			// Found another bug: (nic32[RT_TXSTATUS0/4 + rtl.cur_tx] |= 1; // <-- If abort, set descriptor size to 1)
-			// |= the length to 1 doesn't do anything if the length is an odd number >= 1...
-			// Should probably be RT_TXCONFIG register |= 1, which clears abort state and retransmits, see pg 21 of RTL8139C or pg 17 of RTL8139D datasheet
-			nic32[RT_TXCONFIG/4] |= 0x1;
+	while(rtl.dirty_tx != rtl.cur_tx)
+	{
+		slot = rtl.dirty_tx % RT_TX_RING_LEN;
+
+		if(!(tsad & RT_TSAD_OWN(slot)))
+		{ // Still the chip's
+			if(tsad & RT_TSAD_TABT(slot))
+			{ // Check for abort
+				// Found another bug: (nic32[RT_TXSTATUS0/4 + rtl.cur_tx] |= 1; // <-- If abort, set descriptor size to 1)
+				// |= the length to 1 doesn't do anything if the length is an odd number >= 1...
+				// Should probably be RT_TXCONFIG register |= 1, which clears abort state and retransmits, see pg 21 of RTL8139C or pg 17 of RTL8139D datasheet
+				nic32[RT_TXCONFIG/4] |= 0x1;
+			}
+			break;
 		}
+
+		rtl.dirty_tx++;
 	}
+}
 
-// Tx time
-#ifdef TX_LOOP_TIMING
-		unsigned long long int first_array = PMCR_RegRead(DCLOAD_PMCR);
-#endif
+// bb->tx only queues the packet: it gets copied into the next free descriptor
+// and handed to the chip, and this returns while that's still going out on the
+// wire. Completions are only looked at once all four descriptors are in
+// flight, so streaming sends (like cmd_sendbinq) copy packet N+1 into GAPS
+// while the chip is still sending packet N and don't touch the status
+// registers otherwise.
+int rtl_bb_tx(unsigned char * pkt, int len) // pg. 15 in RTL8139C datasheet: http://realtek.info/pdf/rtl8139cp.pdf
+{
+	unsigned int slot;
+
+	TRACE(TRACE_TX, len);
 
 	unsigned char *copyback_pkt_base = to_p1(&pkt[-2]); // copyback base in cached memory area
 
 	__builtin_prefetch(copyback_pkt_base);
 
-	// Set GAPS DMA image offset pointer to relevant TX region
-	g232[0x142c/4] = (unsigned int)txdesc[rtl.cur_tx];
+	// Everything up to the copy into GAPS only touches RAM, so it's done before
+	// waiting on the G2 bus or a free descriptor.
 
 	/* 8139 doesn't auto-pad */
 	if(len < 60) // This condition may look a little gnarly, but that's because it's meant for speed above all else.
@@ -599,29 +706,72 @@ int rtl_bb_tx(unsigned char * pkt, int len) // pg. 15 in RTL8139C datasheet: htt
 		// but the NIC is configured to auto-append a 4-byte CRC.
 	}
 
+#if BBA_G2_DMA
+	// Stage it while the previous packet may still be on its way into GAPS
+	unsigned char *staging = tx_staging[tx_staging_next];
+	tx_staging_next ^= 1;
+
+	memcpy_64bit_32Bytes(staging, copyback_pkt_base, (2 + len + 31)/32);
+	CacheBlockWriteBack(staging, (2 + len + 31)/32);
+#endif
+
+	// According to KOS source we gotta wait for G2 FIFO to be empty by checking
+	// this bit before reading from/writing to G2. So do that here.
+	while((*(volatile unsigned int*)0xa05f688c) & 0x20U);
+
+#if BBA_G2_DMA
+	// Previous packet goes to the chip first, so the reap below sees it
+	rtl_tx_dma_finish();
+#endif
+
+	// Ring full: wait for the oldest one to free up
+	if(__builtin_expect((unsigned short)(rtl.cur_tx - rtl.dirty_tx) >= RT_TX_RING_LEN, 0))
+	{
+		net_stats.tx_stalls++;
+		do
+		{
+			rtl_tx_reap();
+		} while((unsigned short)(rtl.cur_tx - rtl.dirty_tx) >= RT_TX_RING_LEN);
+	}
+
+	slot = rtl.cur_tx % RT_TX_RING_LEN;
+
+	// Set GAPS DMA image offset pointer to relevant TX region
+	g232[0x142c/4] = (unsigned int)txdesc[slot];
+
+#if BBA_G2_DMA
+	// Same layout as the CPU copy below, alignment offset and all
+	g2_dma_start((unsigned int)staging, 2 + len, 0);
+	tx_dma_slot = slot;
+	tx_dma_len = len;
+#else
 	// Copy packet over to RTL via GAPS while also accounting for dcload-ip's packet alignment offset
 	SH4_mem_to_pkt_X_movca_32((unsigned char*)0x81848000, copyback_pkt_base, len);
 	// Technically this will prefetch beyond 1536 for packets between 1504 and 1514 in size, but that's not an issue.
-
-// Tx time end
-#ifdef TX_LOOP_TIMING
-		unsigned long long int second_array = PMCR_RegRead(DCLOAD_PMCR);
-		unsigned int loop_difference = (unsigned int)(second_array - first_array);
-
-		clear_lines(222, 24, global_bg_color);
-		uint_to_string_dec(loop_difference, (char*)uint_string_array);
-		draw_string(30, 222, uint_string_array, STR_COLOR);
 #endif
 
+	TRACE(TRACE_TX | TRACE_END, len);
+
+#if BBA_G2_DMA
+	// Sent by rtl_tx_dma_finish() once the DMA is done. With RX off, nothing is
+	// going to come along and do that (e.g. EXEC's reply right before the
+	// program starts), so wait for it here.
+	if(!rtl_rx_on)
+	{
+		rtl_tx_dma_finish();
+	}
+#else
 	// Set len (SIZE field), destructively zeroing out all other R/W settings. OWN needs to be cleared by software; it does here.
 	// Software writes don't impact the read-only bits.
 	// Zeroing also sets Early FIFO TX threshold to 8 bytes.
 	// Finally, writing to the status register triggers the packet send.
-		nic32[RT_TXSTATUS0/4 + rtl.cur_tx] = len | 0x20000; // Set Early TX to 64 bytes
-	//nic32[RT_TXSTATUS0/4 + rtl.cur_tx] = len | 0x10000; // Set Early TX to 32 bytes
-//	nic32[RT_TXSTATUS0/4 + rtl.cur_tx] = len;
+		nic32[RT_TXSTATUS0/4 + slot] = len | 0x20000; // Set Early TX to 64 bytes
+	//nic32[RT_TXSTATUS0/4 + slot] = len | 0x10000; // Set Early TX to 32 bytes
+//	nic32[RT_TXSTATUS0/4 + slot] = len;
+#endif
 
-	rtl.cur_tx = (rtl.cur_tx + 1) % 4; // Move to next txdesc buffer
+	rtl.cur_tx++; // Queued. Move to next txdesc buffer
+	net_stats.tx_frames++;
 
 	return 1;
 }
@@ -635,10 +785,21 @@ static void pktcpy(unsigned char *dest, unsigned char *src, unsigned int n) // d
 	// this bit before reading from/writing to G2. So do that here.
 	while((*(volatile unsigned int*)0xa05f688c) & 0x20U);
 
+#if BBA_G2_DMA
+	rtl_tx_dma_finish(); // About to move the image
+#endif
+
 	// Set GAPS DMA image offset pointer to relevant RX region
 	//--	g232[0x142c/4] = (unsigned int)src;
 	g232[0x142c/4] = (unsigned int)src - 2; // Yup, this works. So we can just use memcpy_32bit()
 
+#if BBA_G2_DMA
+	// DMA writes RAM behind the cache's back, so drop whatever it had there
+	// first (a dirty line written back mid-transfer would clobber the packet)
+	CacheBlockInvalidate(dest, (2 + n + 31)/32);
+	g2_dma_start((unsigned int)dest, n + 2, 1);
+	g2_dma_wait();
+#else
 	// NOWRAP
 	// Note: the +3 may mean we read some of the CRC for not-byte-multiple packets. That's fine: it doesn't cause us any problems.
 	//--	SH4_pkt_to_mem_X_movca_32(dest, (unsigned char*)0x01848000, n); // This takes full n now
@@ -646,6 +807,43 @@ static void pktcpy(unsigned char *dest, unsigned char *src, unsigned int n) // d
 	memcpy_32bit(dest, (unsigned char*)0x81848000, (n + 2 + 3)/4); // Lol this is as fast as the asm functions
 	CacheBlockInvalidate((unsigned char*)0x81848000, (n + 2 + 31)/32); // Need to invalidate the src packet
 	CacheBlockWriteBack(dest, (2 + n + 31)/32);
+#endif
+}
+
+// PARTBINs make up nearly everything that comes in during a load, and copying
+// them out of the ring only for cmd_partbin() to copy the payload again doubles
+// the memory traffic. So only the headers get copied out here; if
+// process_partbin_direct() takes the frame, the payload goes from the ring to
+// its destination in one pass. Returns 0 if the frame needs the full pktcpy().
+static int rtl_rx_direct(unsigned char *src, unsigned int n)
+{
+	int handled;
+
+#if BBA_G2_DMA
+	// With DMA, pktcpy() doesn't stall the CPU on G2 reads, so the copy out of
+	// the frame in RAM is the only CPU pass over the payload either way
+	return 0;
+#endif
+
+	if (n < PARTBIN_HEADERS_LEN)
+		return 0;
+
+	// According to KOS source we gotta wait for G2 FIFO to be empty by checking
+	// this bit before reading from/writing to G2. So do that here.
+	while((*(volatile unsigned int*)0xa05f688c) & 0x20U);
+
+	// Same shift-by-2 through the GAPS DMA image as pktcpy(), which also puts
+	// the payload at 0x81848000 + 56: 8-byte aligned, just like command->data
+	g232[0x142c/4] = (unsigned int)src - 2;
+
+	memcpy_32bit(raw_current_pkt, (unsigned char*)0x81848000, (2 + PARTBIN_HEADERS_LEN)/4);
+	CacheBlockWriteBack(raw_current_pkt, (2 + PARTBIN_HEADERS_LEN + 31)/32);
+
+	handled = process_partbin_direct(to_p1(current_pkt), (unsigned char*)0x81848000 + 2 + PARTBIN_HEADERS_LEN, n);
+
+	CacheBlockInvalidate((unsigned char*)0x81848000, ((handled ? n : PARTBIN_HEADERS_LEN) + 2 + 31)/32); // Need to invalidate the src packet
+
+	return handled;
 }
 
 static int rtl_bb_rx()
@@ -680,50 +878,32 @@ static int rtl_bb_rx()
 
 		pkt_size = rx_size - 4;
 
-// Full loop timing
-#ifdef FULL_TRIP_TIMING
-    unsigned long long int first_array1 = PMCR_RegRead(DCLOAD_PMCR);
-#endif
+		TRACE(TRACE_RX, pkt_size);
 
-		if ((rx_status & 1) && (pkt_size <= RX_PKT_BUF_SIZE))
+		if (__builtin_expect(!(rx_status & 1), 0))
+		{
+			net_stats.rx_errors++;
+		}
+		else if (__builtin_expect(pkt_size > RX_PKT_BUF_SIZE, 0))
+		{
+			net_stats.rx_oversize++;
+		}
+		else
 		{
 			pkt = (unsigned char*)(GAPS_RX_IO_AREA + 0x0000 + ring_offset + 4); // + 4 to skip the status byte (DMA)
 
-// Rx time
-#ifdef RX_LOOP_TIMING
-			unsigned long long int first_array = PMCR_RegRead(DCLOAD_PMCR);
-#endif
-
-			pktcpy(raw_current_pkt, pkt, pkt_size); // SH4_pkt_to_mem() will shift it by 2 for current_pkt
-
-// Rx time end
-#ifdef RX_LOOP_TIMING
-		unsigned long long int second_array = PMCR_RegRead(DCLOAD_PMCR);
-		unsigned int loop_difference = (unsigned int)(second_array - first_array);
-
-		clear_lines(246, 24, global_bg_color);
-		uint_to_string_dec(loop_difference, (char*)uint_string_array);
-		draw_string(30, 246, uint_string_array, STR_COLOR);
-#endif
-
-// Process time
-#ifdef PKT_PROCESS_TIMING
-			asm volatile ("nop\n" : : : "memory");
-		unsigned long long int	first_array2 = PMCR_RegRead(DCLOAD_PMCR);
-#endif
-
-			//process_pkt(current_pkt);
-			process_pkt(to_p1(current_pkt));
-
-// Process time end
-#ifdef PKT_PROCESS_TIMING
-		unsigned long long int second_array2 = PMCR_RegRead(DCLOAD_PMCR);
-		unsigned int loop_difference2 = (unsigned int)(second_array2 - first_array2);
-
-		clear_lines(270, 24, global_bg_color);
-		uint_to_string_dec(loop_difference2, (char*)uint_string_array);
-		draw_string(30, 270, uint_string_array, STR_COLOR);
-#endif
+			// Take the shortcut for PARTBINs if it applies
+			if(!rtl_rx_direct(pkt, pkt_size))
+			{
+				TRACE(TRACE_RX_COPY, pkt_size);
+				pktcpy(raw_current_pkt, pkt, pkt_size); // SH4_pkt_to_mem() will shift it by 2 for current_pkt
+				TRACE(TRACE_RX_COPY | TRACE_END, pkt_size);
+
+				TRACE(TRACE_PROCESS, pkt_size);
+				//process_pkt(current_pkt);
+				process_pkt(to_p1(current_pkt));
+				TRACE(TRACE_PROCESS | TRACE_END, pkt_size);
+			}
 
 		}
 
@@ -765,14 +945,7 @@ static int rtl_bb_rx()
 
 		processed++;
 
-#ifdef FULL_TRIP_TIMING
-		unsigned long long int second_array1 = PMCR_RegRead(DCLOAD_PMCR);
-		unsigned int loop_difference1 = (unsigned int)(second_array1 - first_array1);
-
-		clear_lines(412, 24, global_bg_color);
-		uint_to_string_dec(loop_difference1, (char*)uint_string_array);
-		draw_string(30, 412, uint_string_array, STR_COLOR);
-#endif
+		TRACE(TRACE_RX | TRACE_END, pkt_size);
 	}
 
 	return processed;
@@ -804,6 +977,10 @@ void rtl_bb_loop(int is_main_loop)
 	// OMG this is polling the network adapter. Well, ok then.
 	while(!escape_loop)
 	{
+#if BBA_G2_DMA
+		// Send off whatever the last pass left DMAing into GAPS
+		rtl_tx_dma_finish();
+#endif
 
 		/* Check interrupt status */
 		if (nic16[RT_INTRSTATUS/2] != intr)
@@ -885,14 +1062,21 @@ void rtl_bb_loop(int is_main_loop)
 			nic16[RT_INTRSTATUS/2] = 0xffff;
 	*/
 			// NetBSD, FreeBSD, and OpenBSD all just do a full re-init if this happens.
+			net_stats.rx_overflows++;
 			rtl_init();
 		}
 
+		// Resend anything over TCP that's gone unacked too long
+		TCP_POLL();
+
 		if(is_main_loop && rtl_link_up && (!rtl_is_copying)) // Only want this to run in main loop
 		{
 			// Do we need to renew our IP address?
 			// This will override set_ip_from_file() if the ip is in the 0.0.0.0/8 range
 			set_ip_dhcp();
+
+			// Send a MAPLESUB subscriber whatever changed, if it's time
+			maplesub_poll();
 		}
 
 		if(timeout_loop > 0)
@@ -914,6 +1098,17 @@ void rtl_bb_loop(int is_main_loop)
 				prev_loop_elapsed = loop_secs_elapsed;
 			}
 		}
+
+		if(loop_single_pass)
+		{
+#if BBA_G2_DMA
+			rtl_tx_dma_finish();
+#endif
+			return; // Caller checks and clears escape_loop
+		}
 	}
 	escape_loop = 0;
+#if BBA_G2_DMA
+	rtl_tx_dma_finish();
+#endif
 }
@@ -65,6 +65,12 @@
 #define RT_TX_HOST_OWNS        0x00002000 /* Set to 1 when DMA operation is completed */
 #define RT_TX_SIZE_MASK        0x00001fff /* Descriptor size mask */
 
+/* RTL8139C TSAD bits (one per descriptor n, so all four can be read at once) */
+#define RT_TSAD_TOK(n)         (0x1000 << (n)) /* Transmit ok */
+#define RT_TSAD_TUN(n)         (0x0100 << (n)) /* Transmit FIFO underrun */
+#define RT_TSAD_TABT(n)        (0x0010 << (n)) /* Transmission aborted */
+#define RT_TSAD_OWN(n)         (0x0001 << (n)) /* Host owns the descriptor again */
+
 /* RTL8139C receive status bits */
 #define RT_RX_MULTICAST        0x00008000 /* Multicast packet */
 #define RT_RX_PAM              0x00004000 /* Physical address matched */
@@ -91,10 +97,14 @@
 
 #define GAPSPCI_ID "GAPSPCI_BRIDGE_2"
 
+// The RTL8139C has 4 TX descriptors, each with its own 2kB buffer in GAPS.
+#define RT_TX_RING_LEN       4U
+
 /* RTL8139C Config/Status info */
 typedef struct {
 	unsigned short cur_rx;                /* Current Rx read ptr */
-	unsigned short cur_tx;                /* Current available Tx slot */
+	unsigned short cur_tx;                /* Tx packets queued so far (slot is cur_tx % RT_TX_RING_LEN) */
+	unsigned short dirty_tx;              /* Tx packets the chip is known to be done with */
 	unsigned char  mac[6];                /* Mac address */
 } rtl_status_t;
 
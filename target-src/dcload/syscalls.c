@@ -33,10 +33,18 @@
 #include "commands.h"
 #include "scif.h"
 #include "adapter.h"
+#include "cdfs.h"
+#include "tcp.h"
 
 unsigned short dcload_syscall_port = 31313; // Legacy mode default port, gets overridn in v2.0.0+ by value from dc-tool
 unsigned int syscall_retval = 0;
 unsigned char* syscall_data; // Used by cmd_retval and gdbpacket syscall
+unsigned int syscall_retsize = 0; // RETVAL size field, only cdfs read-ahead uses it
+unsigned int mapleinput_frame = 0;
+
+// Here's a global array. Holds an outgoing command while build_send_packet()
+// waits out an async CDFS read, or for the last one over TCP to be acked.
+static __attribute__((aligned(4))) unsigned char parked_command[RX_PKT_BUF_SIZE - ETHER_H_LEN - IP_H_LEN - UDP_H_LEN];
 
 static struct dirent our_dir; // Here's a global array
 
@@ -61,8 +69,7 @@ void build_send_packet(int command_len)
 	ip_header_t * ip = (ip_header_t *)(pkt_buf + ETHER_H_LEN);
 	udp_header_t * udp = (udp_header_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN);
 
-	// Unused
-	//unsigned char * command = pkt_buf + ETHER_H_LEN + IP_H_LEN + UDP_H_LEN;
+	unsigned char * command = pkt_buf + ETHER_H_LEN + IP_H_LEN + UDP_H_LEN;
 /*
 	scif_puts("build_send_packet\n");
 	scif_putchar(command[0]);
@@ -71,6 +78,33 @@ void build_send_packet(int command_len)
 	scif_putchar(command[3]);
 	scif_puts("\n");
 */
+	// An async CDFS read still in flight has to complete before anything else
+	// goes out. Finishing it reuses pkt_buf, so park the command meanwhile.
+	if(__builtin_expect(cdfs_read_pending, 0))
+	{
+		memcpy(parked_command, command, command_len);
+		cdfs_redir_finish_read();
+		memcpy(command, parked_command, command_len);
+	}
+
+#if DCLOAD_TCP
+	if(tool_console_tcp)
+	{
+		// The last reply has to be acked before this one takes its place in
+		// pkt_buf, which it almost always is by now
+		if(__builtin_expect(tcp_tx_pending(), 0))
+		{
+			memcpy(parked_command, command, command_len);
+			tcp_flush();
+			memcpy(command, parked_command, command_len);
+		}
+
+		bb->start();
+		tcp_tx_command(command_len);
+		return;
+	}
+#endif
+
 	make_ether(tool_mac, bb->mac, ether);
 	make_ip(tool_ip, our_ip, UDP_H_LEN + command_len, IP_UDP_PROTOCOL, ip, 0);
 	make_udp(tool_port, dcload_syscall_port, command_len, ip, udp);
@@ -80,6 +114,8 @@ void build_send_packet(int command_len)
 
 void dcexit(void)
 {
+	cdfs_redir_finish_read(); // Needs packet RX, so do it first
+
 	bb->stop(); // Disable packet RX
 
 	command_t * command = (command_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN + UDP_H_LEN);
@@ -418,3 +454,31 @@ int rewinddir(DIR *dir)
 
 	return syscall_retval;
 }
+
+// For repeatable input (dc-tool -I and -J): the program calls this once a frame
+// with the conditions it just read, 'size' bytes for each of the 4 ports one
+// after the other in 'cond'. dc-tool either records them under the frame number
+// (the calls counted since the program started), or sends back what it recorded
+// for that frame to use instead. Returns how many bytes of cond were replaced, 0
+// if none were, or -1 if dc-tool is doing neither.
+int mapleinput(void *cond, size_t size)
+{
+	command_3int_t * command = (command_3int_t *)(pkt_buf + ETHER_H_LEN + IP_H_LEN + UDP_H_LEN);
+	unsigned int total = size * MAPLEINPUT_PORTS;
+
+	if (size > MAPLEINPUT_MAX / MAPLEINPUT_PORTS)
+		return -1;
+
+	memcpy(command->id, CMD_MAPLEINPUT, 4);
+	command->value0 = htonl(mapleinput_frame++);
+	command->value1 = htonl(size);
+	command->value2 = htonl(MAPLEINPUT_PORTS);
+	memcpy((unsigned char *)command + sizeof(command_3int_t), cond, total);
+	build_send_packet(sizeof(command_3int_t) + total);
+	bb->loop(0);
+
+	if (((int)syscall_retval > 0) && (syscall_retval <= total))
+		memcpy(cond, syscall_data, syscall_retval);
+
+	return syscall_retval;
+}
@@ -45,11 +45,21 @@
 #define CMD_CDFSREAD "DC19"
 #define CMD_GDBPACKET "DC20"
 #define CMD_REWINDDIR "DC21"
+#define CMD_CDFSTOC   "DC22"
+#define CMD_MAPLEINPUT "DC23"
+
+// mapleinput() passes along a condition for each of the 4 ports in one go, up
+// to a whole maple response frame's worth for all of them together
+#define MAPLEINPUT_PORTS 4
+#define MAPLEINPUT_MAX 1024
 
 extern unsigned short dcload_syscall_port;
 
 extern unsigned int syscall_retval;
 extern unsigned char* syscall_data;
+extern unsigned int syscall_retsize;
+// Calls to mapleinput() since the running program was started
+extern unsigned int mapleinput_frame;
 
 typedef struct __attribute__ ((packed, aligned(4))) {
 	unsigned char id[4];
@@ -0,0 +1,732 @@
+// See tcp.h for what this is and isn't.
+
+#include <string.h>
+#include "tcp.h"
+#include "commands.h"
+#include "net.h"
+#include "adapter.h"
+#include "memfuncs.h"
+#include "perfctr.h"
+#include "dcload.h" // DCLOAD_PMCR, installed_adapter
+
+#if DCLOAD_TCP
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+
+// The receive window is however many full segments the adapter can hold on to
+// while dcload is busy with the one before: a good part of the BBA's 16KB
+// receive ring, but only one for the LAN adapter.
+#define TCP_WINDOW_BBA (8 * TCP_MSS)
+#define TCP_WINDOW_LAN (1 * TCP_MSS)
+#define TCP_WINDOW ((installed_adapter == LAN_MODEL) ? TCP_WINDOW_LAN : TCP_WINDOW_BBA)
+
+// SENDBIN data dcload puts in flight at once, on top of whatever the host's
+// window allows
+#define TCP_TX_WINDOW (8 * TCP_MSS)
+
+#define TCP_RTO_MS 200
+#define TCP_RTO ((unsigned long long int)PERFCOUNTER_SCALE * TCP_RTO_MS / 1000)
+
+// Records this small get copied aside when they're sent, since they might
+// still need resending after pkt_buf has been used for something else: the
+// reply to EXEC, which the program's first syscall goes out right after, and
+// anything the console sends without waiting for a reply
+#define TCP_TX_COPY 32
+
+#define SEQ_LT(a, b) ((int)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int)((a) - (b)) <= 0)
+
+#define TCP_CLOSED      0
+#define TCP_SYN_RCVD    1
+#define TCP_ESTABLISHED 2
+
+// What's being sent, between tx_start and snd_max
+#define TCP_TX_NONE   0
+#define TCP_TX_SYN    1
+#define TCP_TX_RECORD 2 // One record, in pkt_buf or tx_copy
+#define TCP_TX_BIN    3 // SENDBIN records, then a DONEBIN
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+typedef struct {
+	unsigned char mac[6];
+	unsigned short port; // These three as they are in the headers
+	unsigned int ip;
+	unsigned short our_port;
+} tcp_peer_t;
+
+static struct {
+	unsigned int state;
+	tcp_peer_t peer;
+	unsigned int rcv_nxt;
+	unsigned int snd_una;
+	unsigned int snd_nxt;
+	unsigned int snd_max;
+	unsigned int snd_wnd;
+	unsigned int tx_kind;
+	unsigned int tx_start;
+	unsigned int tx_len; // TCP_TX_RECORD: with padding
+	unsigned int tx_copied;
+	unsigned int bin_addr;
+	unsigned int bin_size;
+	unsigned int dupacks;
+	unsigned int ack_sent; // Last ack that went out
+	unsigned long long int rto_start;
+} tcp = {0};
+
+// Where the receive side is in the stream when it's not between records
+static struct {
+	unsigned int have; // Bytes of hdr there are so far
+	unsigned int left; // PARTBIN payload still to come
+	unsigned int pad;
+	unsigned int dest;
+	unsigned int start;
+	unsigned int size;
+	unsigned int tracked; // The load map knows about it
+	unsigned long long int cmd_start;
+	__attribute__((aligned(4))) unsigned char hdr[TCP_RECORD_H_LEN + COMMAND_LEN];
+} rx = {0};
+
+// Here's a global array. Pure acks, resets and the SYN go out of here so
+// pkt_buf keeps whatever might need resending. 2 bytes in for alignment, like
+// pkt_buf, and a whole number of cache blocks.
+static __attribute__((aligned(32))) unsigned char raw_ctl_buf[96];
+#define ctl_buf (raw_ctl_buf + 2)
+
+static __attribute__((aligned(4))) unsigned char tx_copy[TCP_TX_COPY]; // Here's a global array.
+
+// Where a record starts in pkt_buf
+#define TCP_RECORD (pkt_buf + ETHER_H_LEN + IP_H_LEN + TCP_H_LEN)
+
+static unsigned int tcp_pseudo_sum(unsigned int src, unsigned int dest, unsigned int tcp_len)
+{
+	// Addresses as they are in the IP header, summed like memsum_16bit() would
+	return (src & 0xffff) + (src >> 16) + (dest & 0xffff) + (dest >> 16) + htons(IP_TCP_PROTOCOL) + htons(tcp_len);
+}
+
+// The payload (len bytes, summed to payload_sum) needs to be in place in frame
+// already
+static void tcp_send(unsigned char *frame, tcp_peer_t *peer, unsigned int flags, unsigned int seq, unsigned int ack, unsigned int len, unsigned int payload_sum)
+{
+	ip_header_t *ip = (ip_header_t *)(frame + ETHER_H_LEN);
+	tcp_header_t *th = (tcp_header_t *)(frame + ETHER_H_LEN + IP_H_LEN);
+	unsigned int hlen = TCP_H_LEN;
+
+	if(flags & TCP_SYN)
+	{
+		th->options[0] = 2; // MSS
+		th->options[1] = 4;
+		th->options[2] = TCP_MSS >> 8;
+		th->options[3] = TCP_MSS & 0xff;
+		hlen += 4;
+	}
+
+	make_ether(peer->mac, bb->mac, (ether_header_t *)frame);
+	make_ip(ntohl(peer->ip), our_ip, hlen + len, IP_TCP_PROTOCOL, ip, 0);
+
+	th->src = peer->our_port;
+	th->dest = peer->port;
+	th->seq = htonl(seq);
+	th->ack = htonl(ack);
+	th->data_offset = (hlen / 4) << 4;
+	th->flags = flags;
+	th->window = htons(TCP_WINDOW);
+	th->checksum = 0;
+	th->urgent = 0;
+
+	payload_sum += tcp_pseudo_sum(ip->src, ip->dest, hlen + len);
+	th->checksum = checksum_fold(memsum_16bit(th, hlen/2, payload_sum));
+
+	bb->tx(frame, ETHER_H_LEN + IP_H_LEN + hlen + len);
+}
+
+// On the connection, these always carry an ack
+
+static void tcp_send_ctl(unsigned int flags, unsigned int seq)
+{
+	tcp.ack_sent = tcp.rcv_nxt;
+	tcp_send(ctl_buf, &tcp.peer, flags, seq, tcp.rcv_nxt, 0, 0);
+}
+
+static void tcp_send_data(unsigned int flags, unsigned int seq, unsigned int len, unsigned int sum)
+{
+	tcp.ack_sent = tcp.rcv_nxt;
+	tcp_send(pkt_buf, &tcp.peer, flags, seq, tcp.rcv_nxt, len, sum);
+}
+
+// Something came in for a connection that doesn't exist (RFC 793's reset
+// generation)
+static void tcp_reset_reply(ether_header_t *ether, ip_header_t *ip, tcp_header_t *th, unsigned int len)
+{
+	tcp_peer_t peer;
+
+	memcpy(peer.mac, ether->src, 6);
+	peer.ip = ip->src;
+	peer.port = th->src;
+	peer.our_port = th->dest;
+
+	if(th->flags & TCP_ACK)
+	{
+		tcp_send(ctl_buf, &peer, TCP_RST, ntohl(th->ack), 0, 0, 0);
+	}
+	else
+	{
+		len += (th->flags & TCP_SYN) ? 1 : 0;
+		len += (th->flags & TCP_FIN) ? 1 : 0;
+		tcp_send(ctl_buf, &peer, TCP_RST | TCP_ACK, 0, ntohl(th->seq) + len, 0, 0);
+	}
+}
+
+// Gives up on the connection, for when the stream can't go on
+static void tcp_abort(void)
+{
+	if(tcp.state != TCP_CLOSED)
+	{
+		tcp_send_ctl(TCP_RST | TCP_ACK, tcp.snd_max);
+	}
+
+	tcp.state = TCP_CLOSED;
+	tcp.tx_kind = TCP_TX_NONE;
+	tcp.snd_una = tcp.snd_nxt = tcp.snd_max;
+}
+
+//
+// Sending
+//
+
+// Builds SENDBIN record k (or the DONEBIN after the last one) in pkt_buf.
+// Returns its length, and its sum in *sum.
+static unsigned int tcp_bin_record(unsigned int k, unsigned int *sum)
+{
+	unsigned char *record = TCP_RECORD;
+	command_t *command = (command_t *)(record + TCP_RECORD_H_LEN);
+	unsigned int offset = k * 1440;
+	unsigned int len = 0;
+
+	if(offset < tcp.bin_size)
+	{
+		len = min(tcp.bin_size - offset, 1440);
+		memcpy(command->id, CMD_SENDBIN, 4);
+		command->address = htonl(tcp.bin_addr + offset);
+		command->size = htonl(len);
+		*sum = SH4_aligned_memcpy_csum(to_p1(command->data), (void *)(tcp.bin_addr + offset), len, 0);
+	}
+	else
+	{
+		memcpy(command->id, CMD_DONEBIN, 4);
+		command->address = 0;
+		command->size = 0;
+		*sum = 0;
+	}
+
+	*(unsigned int *)record = htons(COMMAND_LEN + len); // Other half stays zero
+
+	// Pad, and include that in the sum too
+	while(len & 3)
+	{
+		command->data[len++] = 0;
+	}
+
+	*sum = memsum_16bit(record, (TCP_RECORD_H_LEN + COMMAND_LEN)/2, *sum);
+
+	return TCP_RECORD_H_LEN + COMMAND_LEN + len;
+}
+
+// Where SENDBIN record k starts in the stream. Every one but the last is full
+// size, and then there's the DONEBIN.
+static unsigned int tcp_bin_offset(unsigned int k)
+{
+	return min(k * TCP_MSS, tcp.snd_max - tcp.tx_start - (TCP_RECORD_H_LEN + COMMAND_LEN));
+}
+
+// Sends whatever the windows allow from snd_nxt on
+static void tcp_tx_pump(void)
+{
+	unsigned int len, sum, window;
+
+	if((tcp.state == TCP_CLOSED) || (tcp.snd_nxt == tcp.snd_max))
+	{
+		return;
+	}
+
+	if(tcp.snd_una == tcp.snd_nxt)
+	{
+		tcp.rto_start = PMCR_RegRead(DCLOAD_PMCR);
+	}
+
+	if(tcp.tx_kind == TCP_TX_SYN)
+	{
+		tcp_send_ctl(TCP_SYN | TCP_ACK, tcp.tx_start);
+		tcp.snd_nxt = tcp.snd_max;
+	}
+	else if(tcp.tx_kind == TCP_TX_RECORD)
+	{
+		if(tcp.tx_copied)
+		{
+			memcpy(TCP_RECORD, tx_copy, tcp.tx_len);
+		}
+
+		tcp_send_data(TCP_ACK | TCP_PSH, tcp.tx_start, tcp.tx_len, memsum_16bit(TCP_RECORD, tcp.tx_len/2, 0));
+		tcp.snd_nxt = tcp.snd_max;
+	}
+	else if(tcp.tx_kind == TCP_TX_BIN)
+	{
+		window = min(tcp.snd_wnd, TCP_TX_WINDOW);
+
+		// Start from the record snd_nxt is in, which is only ever partly sent
+		// after going back
+		unsigned int k = (tcp.snd_nxt - tcp.tx_start) / TCP_MSS;
+
+		while(tcp.snd_nxt != tcp.snd_max)
+		{
+			// Always at least one, or a zero window would never get probed
+			if((tcp.snd_nxt != tcp.snd_una) && (tcp.snd_nxt - tcp.snd_una + TCP_MSS > window))
+			{
+				break;
+			}
+
+			len = tcp_bin_record(k, &sum);
+			tcp_send_data(TCP_ACK, tcp.tx_start + tcp_bin_offset(k), len, sum);
+			tcp.snd_nxt = tcp.tx_start + tcp_bin_offset(k) + len;
+			k++;
+		}
+	}
+}
+
+void tcp_tx_command(unsigned int command_len)
+{
+	unsigned char *record = TCP_RECORD;
+	unsigned int len = TCP_RECORD_H_LEN + command_len;
+
+	if(tcp.state != TCP_ESTABLISHED)
+	{
+		return;
+	}
+
+	// Whatever's unacked has been written over by now, and records have to be
+	// whole segments
+	if((tcp.tx_kind != TCP_TX_NONE) || (len > TCP_MSS))
+	{
+		tcp_abort();
+		return;
+	}
+
+	memmove(record + TCP_RECORD_H_LEN, pkt_buf + ETHER_H_LEN + IP_H_LEN + UDP_H_LEN, command_len);
+	*(unsigned int *)record = htons(command_len);
+
+	while(len & 3)
+	{
+		record[len++] = 0;
+	}
+
+	tcp.tx_kind = TCP_TX_RECORD;
+	tcp.tx_start = tcp.snd_nxt;
+	tcp.tx_len = len;
+	tcp.snd_max = tcp.snd_nxt + len;
+
+	tcp.tx_copied = (len <= TCP_TX_COPY);
+	if(tcp.tx_copied)
+	{
+		memcpy(tx_copy, record, len);
+	}
+
+	tcp_tx_pump();
+}
+
+void tcp_tx_bin(unsigned int addr, unsigned int size)
+{
+	if(tcp.state != TCP_ESTABLISHED)
+	{
+		return;
+	}
+
+	if(tcp.tx_kind != TCP_TX_NONE)
+	{
+		tcp_abort();
+		return;
+	}
+
+	tcp.tx_kind = TCP_TX_BIN;
+	tcp.tx_start = tcp.snd_nxt;
+	tcp.bin_addr = addr;
+	tcp.bin_size = size;
+
+	// Full records, the leftover, then the DONEBIN
+	tcp.snd_max = tcp.snd_nxt + (size / 1440) * TCP_MSS;
+	if(size % 1440)
+	{
+		tcp.snd_max += (TCP_RECORD_H_LEN + COMMAND_LEN + (size % 1440) + 3) & ~3;
+	}
+	tcp.snd_max += TCP_RECORD_H_LEN + COMMAND_LEN;
+
+	tcp_tx_pump();
+}
+
+int tcp_tx_pending(void)
+{
+	return (tcp.state != TCP_CLOSED) && (tcp.snd_una != tcp.snd_max);
+}
+
+void tcp_flush(void)
+{
+	bb->start();
+
+	while(tcp_tx_pending())
+	{
+		loop_single_pass = 1;
+		bb->loop(0);
+		loop_single_pass = 0;
+
+		// Nothing should be setting it while the console's between syscalls
+		if(escape_loop)
+		{
+			escape_loop = 0;
+			break;
+		}
+	}
+}
+
+void tcp_poll(void)
+{
+	if(!tcp_tx_pending())
+	{
+		return;
+	}
+
+	if((PMCR_RegRead(DCLOAD_PMCR) - tcp.rto_start) >= TCP_RTO)
+	{
+		tcp.snd_nxt = tcp.snd_una;
+		tcp.dupacks = 0;
+		tcp_tx_pump();
+	}
+}
+
+//
+// Receiving
+//
+
+static unsigned int tcp_peer_mss(tcp_header_t *th, unsigned int hlen)
+{
+	unsigned char *opt = th->options;
+	unsigned char *end = (unsigned char *)th + hlen;
+
+	while((opt < end) && (*opt != 0)) // 0 is end of options
+	{
+		if(*opt == 1) // nop
+		{
+			opt++;
+			continue;
+		}
+
+		if((opt + 2 > end) || (opt[1] < 2) || (opt + opt[1] > end))
+		{
+			break;
+		}
+
+		if((opt[0] == 2) && (opt[1] == 4))
+		{
+			return (opt[2] << 8) | opt[3];
+		}
+
+		opt += opt[1];
+	}
+
+	return 536; // RFC 879's default
+}
+
+static void tcp_rx_partbin_done(void)
+{
+	if(rx.tracked)
+	{
+		cmd_partbin_split_done(rx.start, rx.size);
+	}
+
+	net_stats.cmd_count[NETSTATS_CMD_PARTBIN]++;
+	net_stats.cmd_cycles[NETSTATS_CMD_PARTBIN] += PMCR_RegRead(DCLOAD_PMCR) - rx.cmd_start;
+}
+
+// The record and command headers of a PARTBIN are all here
+static void tcp_rx_partbin(void)
+{
+	command_t *command = (command_t *)(rx.hdr + TCP_RECORD_H_LEN);
+	unsigned int length = (rx.hdr[0] << 8) | rx.hdr[1];
+
+	rx.have = 0;
+	rx.cmd_start = PMCR_RegRead(DCLOAD_PMCR);
+	rx.size = length - COMMAND_LEN;
+	rx.left = rx.size;
+	rx.pad = ((length + 3) & ~3) - length;
+	rx.start = rx.dest = ntohl(command->address);
+
+	// TCP checked it already, so unlike over UDP a PARTBIN that isn't part of a
+	// LOADBIN is still fine to take, there's just no map to mark
+	rx.tracked = !cmd_partbin_split_begin(command, rx.size, 0);
+
+	if(!rx.left)
+	{
+		tcp_rx_partbin_done();
+	}
+}
+
+// A whole command, in place in the frame. The 8 bytes before it have been
+// looked at already, so a UDP header for the command handlers goes there.
+static void tcp_rx_command(ether_header_t *ether, ip_header_t *ip, unsigned char *command, unsigned int length)
+{
+	udp_header_t *udp = (udp_header_t *)(command - UDP_H_LEN);
+
+	udp->src = tcp.peer.port;
+	udp->dest = tcp.peer.our_port;
+	udp->length = htons(UDP_H_LEN + length);
+	udp->checksum = 0;
+
+	tool_tcp = 1;
+	process_command(ether, ip, udp, PMCR_RegRead(DCLOAD_PMCR));
+}
+
+// Takes in-order data and advances rcv_nxt past however much of it was used,
+// which is all of it unless a record other than PARTBIN is cut off at the end.
+static void tcp_rx_stream(ether_header_t *ether, ip_header_t *ip, unsigned char *data, unsigned int len)
+{
+	unsigned int n, length;
+
+	while(len && (tcp.state == TCP_ESTABLISHED))
+	{
+		if(rx.left)
+		{
+			n = min(len, rx.left);
+			cmd_partbin_split_copy(rx.dest, data, n, 0, 0);
+			rx.dest += n;
+			rx.left -= n;
+
+			if(!rx.left)
+			{
+				tcp_rx_partbin_done();
+			}
+		}
+		else if(rx.pad)
+		{
+			n = min(len, rx.pad);
+			rx.pad -= n;
+		}
+		else if(rx.have)
+		{
+			n = min(len, sizeof(rx.hdr) - rx.have);
+			memcpy(rx.hdr + rx.have, data, n);
+			rx.have += n;
+
+			if(rx.have == sizeof(rx.hdr))
+			{
+				tcp_rx_partbin();
+			}
+		}
+		else
+		{
+			// The start of a record: not much to go on until the ID's there
+			if(len < TCP_RECORD_H_LEN + 4)
+			{
+				return;
+			}
+
+			length = (data[0] << 8) | data[1];
+			if(length < COMMAND_LEN)
+			{
+				tcp_abort();
+				return;
+			}
+
+			if(!memcmp(data + TCP_RECORD_H_LEN, CMD_PARTBIN, 4))
+			{
+				n = min(len, sizeof(rx.hdr));
+				memcpy(rx.hdr, data, n);
+				rx.have = n;
+
+				if(rx.have == sizeof(rx.hdr))
+				{
+					tcp_rx_partbin();
+				}
+			}
+			else
+			{
+				n = (TCP_RECORD_H_LEN + length + 3) & ~3;
+
+				// Anything else gets handled in place, so it has to be all here
+				if((n > len) || ((unsigned int)data & 3))
+				{
+					return;
+				}
+
+				// Past it before anything gets sent back
+				tcp.rcv_nxt += n;
+				tcp_rx_command(ether, ip, data + TCP_RECORD_H_LEN, length);
+				data += n;
+				len -= n;
+				continue;
+			}
+		}
+
+		tcp.rcv_nxt += n;
+		data += n;
+		len -= n;
+	}
+}
+
+void process_tcp(ether_header_t *ether, ip_header_t *ip, unsigned int ip_ihl)
+{
+	tcp_header_t *th = (tcp_header_t *)((unsigned char *)ip + 4*ip_ihl);
+	unsigned int tcp_len = ntohs(ip->length) - 4*ip_ihl;
+	unsigned int hlen, len, seq, ack, sum, rcv_nxt;
+	unsigned char *data;
+
+	if(tcp_len < TCP_H_LEN)
+	{
+		return;
+	}
+
+	hlen = (th->data_offset >> 4) * 4;
+	if((hlen < TCP_H_LEN) || (hlen > tcp_len))
+	{
+		return;
+	}
+
+	sum = memsum_16bit(th, tcp_len/2, tcp_pseudo_sum(ip->src, ip->dest, tcp_len));
+	if(tcp_len & 1)
+	{
+		sum += ((unsigned char *)th)[tcp_len - 1]; // The sum is a little-endian sum, so an odd byte will be an 8-bit int
+	}
+
+	if(checksum_fold(sum))
+	{
+		return;
+	}
+
+	data = (unsigned char *)th + hlen;
+	len = tcp_len - hlen;
+	seq = ntohl(th->seq);
+	ack = ntohl(th->ack);
+
+	int ours = (tcp.state != TCP_CLOSED) && (ip->src == tcp.peer.ip) && (th->src == tcp.peer.port) && (th->dest == tcp.peer.our_port);
+
+	if(th->flags & TCP_RST)
+	{
+		if(ours)
+		{
+			tcp.state = TCP_CLOSED;
+			tcp.tx_kind = TCP_TX_NONE;
+		}
+		return;
+	}
+
+	if(th->flags & TCP_SYN)
+	{
+		// dc-tool connecting, maybe again after going away without closing.
+		// Whatever connection there was is gone now.
+		if((th->flags & TCP_ACK) || (tcp_peer_mss(th, hlen) < TCP_MSS))
+		{
+			tcp_reset_reply(ether, ip, th, len);
+			return;
+		}
+
+		memcpy(tcp.peer.mac, ether->src, 6);
+		tcp.peer.ip = ip->src;
+		tcp.peer.port = th->src;
+		tcp.peer.our_port = th->dest;
+		our_ip = ntohl(ip->dest);
+
+		tcp.state = TCP_SYN_RCVD;
+		tcp.rcv_nxt = seq + 1;
+		tcp.snd_wnd = ntohs(th->window);
+		tcp.tx_kind = TCP_TX_SYN;
+		tcp.tx_start = tcp.snd_una = tcp.snd_nxt = (unsigned int)PMCR_RegRead(DCLOAD_PMCR);
+		tcp.snd_max = tcp.tx_start + 1;
+		tcp.dupacks = 0;
+		memset(&rx, 0, sizeof(rx));
+
+		tcp_tx_pump();
+		return;
+	}
+
+	if(!ours)
+	{
+		// Pure acks could be for a connection that was just closed
+		if(len || (th->flags & TCP_FIN))
+		{
+			tcp_reset_reply(ether, ip, th, len);
+		}
+		return;
+	}
+
+	if(!(th->flags & TCP_ACK))
+	{
+		return;
+	}
+
+	if(SEQ_LT(tcp.snd_una, ack) && SEQ_LEQ(ack, tcp.snd_max))
+	{
+		tcp.snd_una = ack;
+		if(SEQ_LT(tcp.snd_nxt, ack))
+		{
+			tcp.snd_nxt = ack;
+		}
+
+		tcp.dupacks = 0;
+		tcp.rto_start = PMCR_RegRead(DCLOAD_PMCR);
+
+		if(tcp.state == TCP_SYN_RCVD)
+		{
+			tcp.state = TCP_ESTABLISHED;
+		}
+
+		if(tcp.snd_una == tcp.snd_max)
+		{
+			tcp.tx_kind = TCP_TX_NONE;
+		}
+	}
+	else if((ack == tcp.snd_una) && (!len) && tcp_tx_pending())
+	{
+		// Three duplicates means what was sent after snd_una got lost
+		if(++tcp.dupacks == 3)
+		{
+			tcp.snd_nxt = tcp.snd_una;
+		}
+	}
+
+	tcp.snd_wnd = ntohs(th->window);
+
+	if(tcp.state != TCP_ESTABLISHED)
+	{
+		return;
+	}
+
+	rcv_nxt = tcp.rcv_nxt;
+
+	if(len && (seq == rcv_nxt))
+	{
+		tcp_rx_stream(ether, ip, data, len);
+	}
+
+	if((th->flags & TCP_FIN) && (seq + len == tcp.rcv_nxt))
+	{
+		// All of it got used, so this is the end. Close straight away.
+		tcp.rcv_nxt++;
+		tcp_send_ctl(TCP_FIN | TCP_ACK, tcp.snd_max);
+		tcp.state = TCP_CLOSED;
+		tcp.tx_kind = TCP_TX_NONE;
+		return;
+	}
+
+	tcp_tx_pump();
+
+	// Out of order or cut short means the host has to resend from rcv_nxt, and
+	// a duplicate ack is how it finds out. Anything that got used needs acking
+	// unless something sent since already did.
+	if(len && ((seq != rcv_nxt) || (tcp.rcv_nxt == rcv_nxt) || (tcp.ack_sent != tcp.rcv_nxt)))
+	{
+		tcp_send_ctl(TCP_ACK, tcp.snd_nxt);
+	}
+}
+
+#endif
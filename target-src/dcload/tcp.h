@@ -0,0 +1,65 @@
+#ifndef __TCP_H__
+#define __TCP_H__
+
+#include "commands.h"
+
+// Minimal TCP transport
+//
+// When DCLOAD_TCP (Makefile.cfg) is set, dc-tool -k can connect to dcload over
+// TCP instead of sending it UDP datagrams, and let the host's TCP stack take
+// care of retransmission, pacing and congestion instead of dc-tool's timeouts.
+// The commands are the same ones that go over UDP, just framed as records in
+// the byte stream:
+//
+//   2 bytes  length of the command (header and data), big endian
+//   2 bytes  zero
+//   length   the command, exactly as it would have been in a UDP datagram
+//   0-3      zero bytes, so the next record starts on a multiple of 4
+//
+// Replies and console syscalls come back the same way on the same connection.
+//
+// dcload's end is as small as it can be:
+// - One connection at a time, on the port dc-tool sends its UDP commands to. A
+//   new SYN replaces whatever connection there was.
+// - No options besides MSS. The MSS dcload asks for is one full PARTBIN record,
+//   so PARTBINs line up with segments. The receive window is fixed and small
+//   enough for the adapter to buffer, which makes window scaling pointless.
+// - Nothing is buffered for reassembly: segments have to arrive in order, and
+//   anything else gets dropped and acked so the host resends it. A command other
+//   than PARTBIN also has to arrive whole in one segment, which it will if it
+//   was sent in one write. PARTBIN data goes straight to its destination
+//   wherever the segment boundaries fall.
+// - Nothing is kept around to retransmit from either. A reply stays in pkt_buf
+//   until it's acked (dc-tool doesn't send anything new until it has the reply
+//   to the last thing), and SENDBIN data is read out of memory again. Retransmit
+//   is a fixed timeout or 3 duplicate acks, then go back to the oldest unacked
+//   byte.
+// - Closing is a FIN straight back with no TIME_WAIT.
+
+// Largest record that fits in a segment (record header, command and payload):
+// exactly a full-sized PARTBIN or SENDBIN packet
+#define TCP_RECORD_H_LEN 4
+#define TCP_MSS (TCP_RECORD_H_LEN + COMMAND_LEN + 1440)
+
+#if DCLOAD_TCP
+void process_tcp(ether_header_t *ether, ip_header_t *ip, unsigned int ip_ihl);
+
+// Sends the command in pkt_buf, laid out for UDP after ETHER_H_LEN + IP_H_LEN +
+// UDP_H_LEN bytes, as a record to the connected dc-tool
+void tcp_tx_command(unsigned int command_len);
+// Streams size bytes from addr as SENDBIN records followed by a DONEBIN, and
+// returns without waiting; the rest goes out as acks come in
+void tcp_tx_bin(unsigned int addr, unsigned int size);
+// For the console: whether anything sent is still waiting for an ack, and
+// servicing the adapter until it isn't
+int tcp_tx_pending(void);
+void tcp_flush(void);
+// Retransmit timer, called on every pass of the adapter loops
+void tcp_poll(void);
+
+#define TCP_POLL() tcp_poll()
+#else
+#define TCP_POLL() do { } while(0)
+#endif
+
+#endif
@@ -0,0 +1,73 @@
+// See trace.h for what all this is for.
+
+#include "trace.h"
+#include "packet.h" // htonl
+#include "perfctr.h"
+#include "dcload.h" // DCLOAD_PMCR
+
+unsigned int trace_head = 0;
+// Set while dc-tool is fetching the ring, so the fetch doesn't push out the
+// records it's after
+unsigned char trace_paused = 0;
+
+#if DCLOAD_TRACE
+trace_record_t trace_ring[DCLOAD_TRACE]; // Here's a global array.
+
+void trace_event(unsigned int event, unsigned int arg)
+{
+	trace_record_t *record;
+
+	if(trace_paused)
+	{
+		return;
+	}
+
+	record = &trace_ring[trace_head % DCLOAD_TRACE];
+	record->event_arg = (event << 24) | (arg & 0x00ffffff);
+	record->timestamp = (unsigned int)PMCR_RegRead(DCLOAD_PMCR);
+	trace_head++;
+}
+#endif
+
+unsigned int trace_copy(unsigned int *first, unsigned int *out, unsigned int max)
+{
+#if DCLOAD_TRACE
+	unsigned int i, count;
+
+	if((trace_head > DCLOAD_TRACE) && (*first < trace_head - DCLOAD_TRACE))
+	{
+		*first = trace_head - DCLOAD_TRACE;
+	}
+
+	if(*first >= trace_head)
+	{
+		return 0;
+	}
+
+	count = trace_head - *first;
+	if(count > max)
+	{
+		count = max;
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		trace_record_t *record = &trace_ring[(*first + i) % DCLOAD_TRACE];
+		*out++ = htonl(record->event_arg);
+		*out++ = htonl(record->timestamp);
+	}
+
+	return count;
+#else
+	(void)first;
+	(void)out;
+	(void)max;
+	return 0;
+#endif
+}
+
+void trace_clear(void)
+{
+	trace_head = 0;
+	trace_paused = 0;
+}
@@ -0,0 +1,57 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+// Packet timeline tracing
+//
+// When DCLOAD_TRACE (Makefile.cfg) is non-zero, the adapter drivers log events
+// into a ring of that many records as frames go in and out: when each frame
+// starts and finishes being received, the copy out of the adapter, the
+// process_pkt() call, and each transmit. Every record is the event, an argument
+// (the frame length for all of these) and the low 32 bits of DCLOAD_PMCR.
+// dc-tool fetches the ring with CMD_TRACE and lines it up with its own sends
+// and receives.
+//
+// Events come in begin/end pairs, with TRACE_END set on the end one. A frame's
+// copy and processing (and any replies sent while processing it) nest inside
+// its TRACE_RX. A TRACE_RX without a copy inside it was a PARTBIN taken
+// straight off the BBA's receive ring.
+
+#define TRACE_END     0x01
+#define TRACE_RX      0x02
+#define TRACE_RX_COPY 0x04
+#define TRACE_PROCESS 0x06
+#define TRACE_TX      0x08
+
+// CMD_TRACE hands back at most this many records at a time
+#define TRACE_RECORDS_PER_REPLY 128
+
+typedef struct {
+	unsigned int event_arg; // event << 24 | arg
+	unsigned int timestamp;
+} trace_record_t;
+
+// Free-running count of records written. The newest DCLOAD_TRACE of them are in
+// the ring.
+extern unsigned int trace_head;
+extern unsigned char trace_paused;
+
+#if DCLOAD_TRACE & (DCLOAD_TRACE - 1)
+#error "DCLOAD_TRACE needs to be a power of 2"
+#endif
+
+#if DCLOAD_TRACE
+extern trace_record_t trace_ring[DCLOAD_TRACE];
+
+void trace_event(unsigned int event, unsigned int arg);
+#define TRACE(event, arg) trace_event(event, arg)
+#else
+#define TRACE(event, arg) do { } while(0)
+#endif
+
+// Copies up to max records starting at record number first (or the oldest one
+// still in the ring, if that's gone) to out in network byte order. Returns how
+// many were copied and sets *first to the number of the first one.
+unsigned int trace_copy(unsigned int *first, unsigned int *out, unsigned int max);
+void trace_clear(void);
+
+#endif